@@ -3,14 +3,42 @@
  *
  * -----------------------------------------------------------------------------
  *
- * 1. We map the log file into memory, so that multiple gigabyte sized
- *    log files pose no issues.
+ * 1. We map the log files into memory, so that multiple gigabyte sized
+ *    log files pose no issues. All logs are read in the same pass,
+ *    so that sessions spanning multiple files are joined together.
  *
- *    - init_log_view()
+ *    If the log is compressed with gzip or zstd, it is decompressed
+ *    by the worker threads as they go, either in independent units
+ *    (BGZF blocks, zstd frames) or as line-aligned blocks produced by
+ *    a separate decompressing thread.
+ *    Standard input and named pipes are streamed the same way, so that
+ *    memory use stays constant regardless of the amount of input.
+ *
+ *    - init_input()
+ *
+ *    With --state, the requests and sessions of a previous run are
+ *    loaded from a state file, and only data appended to the logs
+ *    since then is scanned. The state file is rewritten after scanning.
+ *
+ *    - load_state()
+ *    - save_state()
+ *
+ *    With --follow, lines appended to the logs are scanned as they
+ *    arrive, and the path graph is written again at every interval.
+ *
+ *    - update_follow()
+ *
+ *    With --cache, the records parsed from the logs are written to
+ *    a columnar cache file, with requests as they appear in the logs.
+ *    As long as the logs are unchanged, later runs load the cache
+ *    instead of scanning the logs, and only truncate the requests.
+ *
+ *    - load_cache()
+ *    - save_cache()
  *
  * -----------------------------------------------------------------------------
  *
- * 2. We look at the first line to infer indices of fields relevant to us,
+ * 2. We look at the first line of the first log to infer indices of fields relevant to us,
  *    such as timestamp, IP addresses, request info (method + URL)
  *    and user agent.
  *
@@ -18,25 +46,31 @@
  *
  * -----------------------------------------------------------------------------
  *
- * 3. We split the memory area into N chunks, where N is the number of threads
+ * 3. We split the memory area into small fixed-size chunks (WORK_CHUNK_SIZE),
+ *    and start N worker threads, where N is the number of threads
  *    available. By default, we use the number of logical CPU cores as
  *    the thread count.
- *    After the chunks have been divided, we start N worker threads,
- *    each with a context (struct thread_ctx) containing pointers to shared
- *    data, such as log information, line configuration, request and session
- *    tables etc.
+ *    Each thread has a context (struct thread_ctx) containing pointers
+ *    to shared data, such as log information, line configuration,
+ *    request and session tables etc.
+ *    Whenever a thread is done with a chunk, it claims the next
+ *    unprocessed one from a shared work queue, so that threads with
+ *    less expensive chunks simply process more of them.
  *
  *    - start_work_ctx()
  *
  * -----------------------------------------------------------------------------
  *
- * 4. Each threads scans their respective chunks for lines, from which
+ * 4. Each thread scans their claimed chunks for lines, from which
  *    they split the line into fields delimited by spaces or double quotes.
+ *    Only the fields up to the last one we need are split, and the rest
+ *    of the line is skipped.
  *
  *    - run_thread()
  *
  *    4.1. A session ID (sid) is constructed from one line, which is a 64-bit
- *         hash consisting of one or more of the following fields:
+ *         (or with SESSION_ID_128, 128-bit) hash consisting of one or more
+ *         of the following fields:
  *           * first IP address (should be source address)
  *           * second IP address (should be destination address)
  *           * user agent
@@ -54,9 +88,8 @@
  *    4.2 A truncated copy of the request field, with only method and URL,
  *        is stored in a hash table, for avoiding duplicate storage for
  *        identical requests.
- *        There are multiple hash tables (REQUEST_SET_NBUCKETS),
- *        each with separate locks, in order to reduce lock contention
- *        across multiple threads.
+ *        The hash table is lock-free, so that threads looking up
+ *        frequent requests don't contend with each other.
  *
  *          - add_request_set_entry()
  *
@@ -68,11 +101,49 @@
  *        since they may arrive in different order, and it will not be merged
  *        to the session entry if it is a repeated request, in which case
  *        only the repeat count for that request is incremented.
- *        As with request table, there are
- *        multiple hash tables (SESSION_MAP_NBUCKETS) for session entries,
- *        each with separate locks.
+ *        Session entries are spread over shards (SESSION_MAP_NSHARDS),
+ *        each an open-addressing hash table with a separate lock.
  *
  *          - amend_session_map_entry()
+ *
+ *        Alternatively, with --partitioned-sessions, each thread buffers
+ *        its (sid, timestamp, request ID) records locally, partitioned by
+ *        session map shard. After scanning, each partition is merged
+ *        into its shard by one thread, without locking.
+ *
+ *          - add_session_record()
+ *          - merge_session_records()
+ *
+ *        With --memory-limit, the records are instead buffered per thread
+ *        up to the limit, and each full buffer is sorted by session ID and
+ *        timestamp and written to a temporary file as a run. After
+ *        scanning, the runs are merged, and each session is folded into
+ *        the path graph as it comes out of the merge.
+ *
+ *          - add_spill_record()
+ *          - merge_spill_buffers()
+ *
+ *    --------------------------------------------------------------------------
+ *
+ *    4.4 With --session-timeout, a session ends after a gap between
+ *        requests longer than the timeout. Each thread publishes the
+ *        latest timestamp it has scanned, and sessions idle for longer
+ *        than the timeout before the lowest of them are folded into
+ *        a path graph and removed from the session hash tables.
+ *        This assumes that logs are written roughly in time order.
+ *
+ *          - evict_session_map_entries()
+ *          - add_path_graph_session()
+ *
+ * -----------------------------------------------------------------------------
+ *
+ * 5. Optionally, with --infer-templates, requests are merged into endpoint
+ *    templates, by replacing path segments that take too many distinct
+ *    values with $PARAM, and sessions are updated to refer to the templates.
+ *    This runs on the request set left by the scan, after any truncation,
+ *    so it makes the output smaller but not the peak memory use.
+ *
+ *    - infer_request_templates()
  */
 
 #include <assert.h>
@@ -91,39 +162,98 @@
 #include <string.h>
 #include <unistd.h>
 
-#include "lib/uthash.h"
+#include <ck_pr.h>
 
+#include "cache.h"
 #include "debug.h"
 #include "dot.h"
 #include "field.h"
 #include "file_view.h"
+#include "follow.h"
 #include "hash.h"
+#include "input.h"
 #include "path_graph.h"
 #include "regex.h"
 #include "request.h"
 #include "session.h"
+#include "spill.h"
+#include "state.h"
+#include "stats.h"
+#include "stream.h"
+#include "template.h"
 #include "time.h"
 #include "truncate.h"
 #include "util.h"
 
 #define APATHY_VERSION "0.2.0"
 
-/* Working area for one thread. */
+/* Working area for one thread, claimed from a work queue. */
 struct thread_chunk {
 	size_t      size;
 	const char *start;
-	const char *end;   /* start + size bytes */
+	const char *end;           /* start + size bytes */
+	const char *data_end;      /* End of the data containing the chunk */
+	int         at_line_start; /* If not, the chunk starts within a line */
+	struct      stream_block *block; /* Block to release after scanning, if any */
+	struct      input *input;  /* Input of a decompressed unit, if any */
+	size_t      unit;          /* Index of the unit in the input */
+};
+
+/*
+ * Pool of fixed-size chunks covering the whole log.
+ * Idle threads claim the next chunk by incrementing an atomic cursor,
+ * so a slow thread only holds up the chunk it is working on.
+ *
+ * The chunks of mapped logs and the decompression units of compressed
+ * logs are numbered across all logs, in the order they were given.
+ * Once those are claimed, threads scan the blocks read from the
+ * remaining logs by a pool of producer threads.
+ */
+struct work_queue {
+#define WORK_CHUNK_SIZE (2 * 1024 * 1024)
+	size_t   ninputs;
+	struct   input *inputs;
+	uint64_t *input_chunks; /* Index of the first chunk of each input */
+	size_t   chunk_size;
+	uint64_t nchunks;
+	uint64_t next_chunk;    /* Index of next unclaimed chunk */
+	size_t   nstreams;
+	void   **streams;       /* Streamed inputs */
+	struct   block_stream stream;
+};
+
+/*
+ * Pool of session record partitions, merged into the session map
+ * by idle threads after all chunks have been scanned.
+ */
+struct merge_queue {
+	size_t   nrecord_sets;
+	struct   session_records **record_sets; /* One per thread */
+	uint64_t next_partition;                /* Index of next unmerged partition */
 };
 
 /* Thread-specific context. */
 struct thread_ctx {
 	int    tid;
-	struct file_view *log_view;
 	struct line_config *line_config;
 	struct truncate_patterns *truncate_patterns;
+	struct work_queue *work_queue;
+	struct merge_queue *merge_queue;
 	struct thread_chunk chunk;
 	struct request_set *request_set;
 	struct session_map *session_map;
+	struct session_records *session_records; /* NULL if sessions go directly to the session map */
+	struct spill_buffer *spill_buffer;       /* NULL unless sessions are spilled to disk */
+	struct session_evictor *evictor;         /* NULL if sessions are not evicted during the scan */
+	char  *unit_buf;                         /* Decompressed input unit */
+	size_t unit_cap;
+	uint64_t chunk_max_ts;                   /* Latest timestamp in the current chunk */
+
+	/* Statistics */
+	uint64_t nchunks;        /* Number of chunks claimed */
+	uint64_t nbytes;         /* Number of bytes in claimed chunks */
+	uint64_t nlines;         /* Number of lines scanned */
+	uint64_t nskipped_lines; /* Number of lines without the expected fields */
 };
 
 /*
@@ -134,39 +264,164 @@ struct work_ctx {
 #define NTHREADS_DEFAULT   4
 #define NTHREADS_MAX       4096
 	int       nthreads;
+	struct    work_queue work_queue;
+	struct    merge_queue merge_queue;
+	struct    session_records *session_records[NTHREADS_MAX];
+	struct    spill_buffer *spill_buffers[NTHREADS_MAX];
+	size_t    memory_limit; /* 0 unless sessions are spilled to disk */
 	pthread_t thread[NTHREADS_MAX];
 	struct    thread_ctx thread_ctx[NTHREADS_MAX];
+	struct    session_evictor *evictor;
+};
+
+/*
+ * Sessions idle for longer than a timeout, evicted from the session map
+ * during the scan, and folded into a path graph, so that the session
+ * map only holds recent sessions.
+ *
+ * Each thread publishes a watermark, the latest timestamp in the chunk
+ * it last scanned. With lines in time order, no line left to scan is
+ * older than the lowest watermark, so a session idle for longer than
+ * the timeout before it would be split there anyway, and can be folded
+ * into the graph right away.
+ */
+struct session_evictor {
+	uint64_t          timeout_ms; /* 0 if sessions never time out */
+	uint64_t          base_ts;    /* Watermark at the start of a scan */
+	uint64_t          cutoff_ts;  /* Sessions idle since before this were evicted */
+	uint64_t          nevicted;   /* Evicted session count */
+	int               nthreads;   /* Threads in the current scan */
+	ck_spinlock_t     lock;       /* Held by the thread evicting sessions */
+	uint64_t          watermarks[NTHREADS_MAX];
+	struct path_graph graph;      /* Paths of evicted or spilled sessions */
 };
 
 void usage(void);
 
-void *
-run_thread(void *ctx)
+/*
+ * Claims the next unprocessed chunk from the work queue.
+ * Returns 0 if there are no chunks left.
+ */
+static int
+claim_thread_chunk(struct thread_ctx *thread_ctx)
 {
-	assert(ctx != NULL);
+	assert(thread_ctx != NULL);
+
+	struct work_queue *wq = thread_ctx->work_queue;
+	struct thread_chunk *chunk = &thread_ctx->chunk;
+
+	uint64_t chunk_idx = ck_pr_faa_64(&wq->next_chunk, 1);
+	if (wq->nchunks <= chunk_idx) {
+		if (wq->nstreams == 0)
+			return 0;
+
+		struct stream_block *block = claim_stream_block(&wq->stream);
+		if (block == NULL)
+			return 0;
+
+		chunk->start         = block->data;
+		chunk->end           = block->data + block->size;
+		chunk->data_end      = chunk->end;
+		chunk->at_line_start = 1;
+		chunk->size          = block->size;
+		chunk->block         = block;
+		chunk->input         = NULL;
+		return 1;
+	}
+
+	/* Find the input of the chunk. */
+	size_t lo = 0;
+	size_t hi = wq->ninputs;
+	while (lo + 1 < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (wq->input_chunks[mid] <= chunk_idx)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	struct input *input = &wq->inputs[lo];
+	chunk_idx -= wq->input_chunks[lo];
+	chunk->block = NULL;
+	chunk->input = NULL;
+
+	if (input->type == INPUT_UNITS) {
+		load_input_unit(input, chunk_idx,
+		    &thread_ctx->unit_buf, &thread_ctx->unit_cap,
+		    &chunk->start, &chunk->end);
+		chunk->data_end      = chunk->end;
+		chunk->size          = chunk->end - chunk->start;
+		chunk->at_line_start = 1;
+		chunk->input         = input;
+		chunk->unit          = chunk_idx;
+		return 1;
+	}
+
+	size_t start_offset = input->scan_start + chunk_idx * wq->chunk_size;
+	size_t end_offset = MIN(start_offset + wq->chunk_size, input->scan_end);
+
+	chunk->start         = input->view.src + start_offset;
+	chunk->end           = input->view.src + end_offset;
+	chunk->data_end      = input->view.src + input->scan_end;
+	chunk->at_line_start = start_offset == input->scan_start;
+	chunk->size          = end_offset - start_offset;
+
+	return 1;
+}
+
+/*
+ * Scans all lines starting within the current chunk of a thread.
+ * A line crossing the end of the chunk is read to its end,
+ * while a partial line at the start of the chunk is skipped,
+ * since it belongs to the previous chunk.
+ */
+static void
+scan_thread_chunk(struct thread_ctx *thread_ctx)
+{
+	assert(thread_ctx != NULL);
 
-	struct thread_ctx *thread_ctx = ctx;
-	struct file_view *log_view = thread_ctx->log_view;
 	struct truncate_patterns *tp = thread_ctx->truncate_patterns;
-	const char *src = thread_ctx->chunk.start;
 	struct line_config *lc = thread_ctx->line_config;
 	struct request_set *rs = thread_ctx->request_set;
 	struct session_map *sm = thread_ctx->session_map;
+	struct session_records *sr = thread_ctx->session_records;
+	struct spill_buffer *sb = thread_ctx->spill_buffer;
+
+	struct field_cursor fc;
+	struct thread_chunk *chunk = &thread_ctx->chunk;
+	if (chunk->start == chunk->end)
+		return;
+
+	init_field_cursor(&fc, lc, chunk->start, chunk->data_end,
+	    chunk->at_line_start);
 
 	while (1) {
-		if (thread_ctx->chunk.end <= src || src == NULL)
+		if (chunk->end <= fc.src || fc.src == NULL)
 			break;
 
-		int skip_line_seek = log_view->src == src;
-		struct field_view fvs[NALL_FIELDS_MAX];
-		memset(&fvs, 0, sizeof(fvs));
+		/*
+		 * Stop if no line starts after the cursor, such as after
+		 * a newline at the end of the log, or when the chunk starts
+		 * within the last line. Also stop if the partial line at the
+		 * start of the chunk ends past the chunk, since the next line
+		 * then belongs to a later chunk.
+		 */
+		if (!fc.skip_line_seek) {
+			const char *nl = *fc.src == '\n' ? fc.src
+			    : memchr(fc.src, '\n', fc.end - fc.src);
+			if (nl == NULL || nl + 1 == fc.end || chunk->end <= nl)
+				break;
+		}
 
-		size_t nfields = get_fields(fvs, NALL_FIELDS_MAX, src, skip_line_seek, &src);
-		if (nfields != lc->nall_fields)
+		struct field_view fvs[NFIELD_TYPES];
+		thread_ctx->nlines++;
+		if (!next_scan_fields(&fc, fvs)) {
+			thread_ctx->nskipped_lines++;
 			continue;
+		}
 
 		uint64_t ts = 0;
-		session_id_t sid = hash64_init();
+		session_id_t sid = init_session_id();
 		struct request_info ri = {
 			.request  = NULL,
 			.method   = NULL,
@@ -179,7 +434,7 @@ run_thread(void *ctx)
 
 		for (size_t i = 0; i < lc->nscan_field_info; i++) {
 			struct field_info *fi = &lc->scan_field_info[i];
-			struct field_view *fv = &fvs[fi->index];
+			struct field_view *fv = &fvs[i];
 
 			switch (fi->type) {
 			case FIELD_RFC3339:
@@ -196,11 +451,11 @@ run_thread(void *ctx)
 				break;
 			case FIELD_IPADDR:
 				if (fi->is_session)
-					sid = hash64_update_ipaddr(sid, fv->src);
+					sid = update_session_id_ipaddr(sid, fv->src);
 				break;
 			case FIELD_USERAGENT:
 				if (fi->is_session)
-					sid = hash64_update(sid, fv->src, fv->len);
+					sid = update_session_id(sid, fv->src, fv->len);
 				break;
 			case FIELD_REQUEST:
 				ri.request = fv->src;
@@ -225,30 +480,167 @@ run_thread(void *ctx)
 			}
 		}
 
+		thread_ctx->chunk_max_ts = MAX(thread_ctx->chunk_max_ts, ts);
+
 		rid = add_request_set_entry(rs, &ri, tp);
-		amend_session_map_entry(sm, sid, ts, rid);
-	} 
+		if (sb != NULL)
+			add_spill_record(sb, sid, ts, rid);
+		else if (sr != NULL)
+			add_session_record(sr, sid, ts, rid);
+		else
+			amend_session_map_entry(sm, sid, ts, rid);
+	}
+}
+
+/*
+ * Scans the lines crossing the ends of the decompressed unit just
+ * scanned, once the neighboring units have been scanned too.
+ * This is done before the watermark of the thread moves past the unit,
+ * so that sessions are never evicted before these lines are scanned.
+ */
+static void
+scan_unit_lines(struct thread_ctx *thread_ctx)
+{
+	assert(thread_ctx != NULL);
+
+	struct thread_chunk *chunk = &thread_ctx->chunk;
+	assert(chunk->input != NULL);
+
+	size_t size = stitch_input_unit(chunk->input, chunk->unit,
+	    &thread_ctx->unit_buf, &thread_ctx->unit_cap);
+
+	chunk->start         = thread_ctx->unit_buf;
+	chunk->end           = thread_ctx->unit_buf + size;
+	chunk->data_end      = chunk->end;
+	chunk->at_line_start = 1;
+	chunk->size          = size;
+	scan_thread_chunk(thread_ctx);
+	thread_ctx->nbytes += size;
+}
+
+static void
+fold_evicted_session(void *ctx, struct session_map_entry *entry)
+{
+	struct session_evictor *ev = ctx;
+	add_path_graph_session(&ev->graph, entry, ev->timeout_ms);
+}
+
+/*
+ * Publishes the watermark of a thread after it has scanned a chunk,
+ * and evicts sessions that have been idle for longer than the timeout
+ * before the lowest watermark of all threads.
+ * Sessions are evicted by one thread at a time, whenever the lowest
+ * watermark has advanced by another timeout, so a session stays in the
+ * session map for at most twice the timeout after its last request.
+ */
+static void
+evict_idle_sessions(struct thread_ctx *thread_ctx)
+{
+	assert(thread_ctx != NULL);
+
+	struct session_evictor *ev = thread_ctx->evictor;
+
+	/* A chunk without timestamps says nothing about the time order. */
+	if (thread_ctx->chunk_max_ts != 0)
+		ck_pr_store_64(&ev->watermarks[thread_ctx->tid],
+		    thread_ctx->chunk_max_ts);
+
+	uint64_t low_ts = UINT64_MAX;
+	for (int tid = 0; tid < ev->nthreads; tid++)
+		low_ts = MIN(low_ts, ck_pr_load_64(&ev->watermarks[tid]));
+	if (low_ts < ev->timeout_ms)
+		return;
+
+	uint64_t cutoff_ts = low_ts - ev->timeout_ms;
+	if (!ck_spinlock_trylock(&ev->lock))
+		return;
+	if (ev->cutoff_ts + ev->timeout_ms <= cutoff_ts) {
+		ev->cutoff_ts = cutoff_ts;
+		ev->nevicted += evict_session_map_entries(thread_ctx->session_map,
+		    cutoff_ts, fold_evicted_session, ev);
+	}
+	ck_spinlock_unlock(&ev->lock);
+}
+
+void *
+run_thread(void *ctx)
+{
+	assert(ctx != NULL);
+
+	struct thread_ctx *thread_ctx = ctx;
+
+	while (claim_thread_chunk(thread_ctx)) {
+		thread_ctx->chunk_max_ts = 0;
+		scan_thread_chunk(thread_ctx);
+		thread_ctx->nchunks++;
+		thread_ctx->nbytes += thread_ctx->chunk.size;
+
+		if (thread_ctx->chunk.input != NULL)
+			scan_unit_lines(thread_ctx);
+
+		if (thread_ctx->chunk.block != NULL)
+			release_stream_block(&thread_ctx->work_queue->stream,
+			    thread_ctx->chunk.block);
+
+		if (thread_ctx->evictor != NULL)
+			evict_idle_sessions(thread_ctx);
+	}
+
+	pthread_exit(NULL);
+}
+
+void *
+run_merge_thread(void *ctx)
+{
+	assert(ctx != NULL);
+
+	struct thread_ctx *thread_ctx = ctx;
+	struct merge_queue *mq = thread_ctx->merge_queue;
+
+	while (1) {
+		uint64_t p = ck_pr_faa_64(&mq->next_partition, 1);
+		if (SESSION_RECORDS_NPARTITIONS <= p)
+			break;
+
+		merge_session_records(thread_ctx->session_map, mq->record_sets,
+		    mq->nrecord_sets, p);
+	}
 
 	pthread_exit(NULL);
 }
 
 void
-start_work_ctx(struct work_ctx *work_ctx, int nthreads, struct file_view *log_view,
-               struct truncate_patterns *tp, struct line_config *lc,
-	       struct request_set *rs, struct session_map *sm)
+start_work_ctx(struct work_ctx *work_ctx, int nthreads, struct input *inputs,
+               size_t ninputs, struct truncate_patterns *tp,
+               struct line_config *lc, struct request_set *rs,
+               struct session_map *sm, struct session_evictor *ev,
+               int partitioned_sessions, size_t memory_limit)
 {
 	assert(work_ctx != NULL);
-	assert(log_view != NULL);
+	assert(inputs != NULL);
+	assert(0 < ninputs);
 	assert(tp != NULL);
 	assert(lc != NULL);
 	assert(rs != NULL);
 	assert(sm != NULL);
+	assert(ev != NULL);
 
 	int rc;
 
 #define MT_THRESHOLD (4 * 1024 * 1024)
-	/* If log size is under MT_THRESHOLD, use one thread. */
-	if (log_view->size < MT_THRESHOLD)
+	/* If uncompressed logs are under MT_THRESHOLD in total, use one thread. */
+	size_t mapped_size = 0;
+	int all_mapped = 1;
+	for (size_t i = 0; i < ninputs; i++) {
+		if (inputs[i].skip)
+			continue;
+		if (inputs[i].type == INPUT_MAPPED)
+			mapped_size += inputs[i].scan_end - inputs[i].scan_start;
+		else
+			all_mapped = 0;
+	}
+
+	if (all_mapped && mapped_size < MT_THRESHOLD)
 		nthreads = 1;
 	else if (nthreads == -1) {
 		nthreads = sysconf(_SC_NPROCESSORS_CONF);
@@ -265,31 +657,108 @@ start_work_ctx(struct work_ctx *work_ctx, int nthreads, struct file_view *log_vi
 	assert(0 < nthreads && nthreads <= NTHREADS_MAX);
 
 	work_ctx->nthreads = nthreads;
+	work_ctx->evictor = ev;
+	work_ctx->memory_limit = memory_limit;
+
+	/* Lines appended since the last scan are no older than its lines. */
+	ev->nthreads = nthreads;
+	for (int tid = 0; tid < nthreads; tid++)
+		ev->watermarks[tid] = ev->base_ts;
+
+	struct work_queue *wq = &work_ctx->work_queue;
+	wq->ninputs    = ninputs;
+	wq->inputs     = inputs;
+	wq->chunk_size = WORK_CHUNK_SIZE;
+	wq->nchunks    = 0;
+	wq->next_chunk = 0;
+	wq->nstreams   = 0;
+
+	wq->input_chunks = calloc(ninputs, sizeof(*wq->input_chunks));
+	if (wq->input_chunks == NULL)
+		ERR("%s", "calloc");
+
+	wq->streams = calloc(ninputs, sizeof(*wq->streams));
+	if (wq->streams == NULL)
+		ERR("%s", "calloc");
+
+	for (size_t i = 0; i < ninputs; i++) {
+		struct input *input = &inputs[i];
+
+		wq->input_chunks[i] = wq->nchunks;
+		if (input->skip)
+			continue;
+
+		switch (input->type) {
+		case INPUT_MAPPED:
+			wq->nchunks += (input->scan_end - input->scan_start
+			    + wq->chunk_size - 1) / wq->chunk_size;
+			break;
+		case INPUT_UNITS:
+			wq->nchunks += input->nunits;
+			break;
+		case INPUT_STREAM:
+			wq->streams[wq->nstreams++] = input;
+			break;
+		}
+	}
+
+	/*
+	 * Streamed logs are read by up to one producer per thread,
+	 * with two blocks per thread, so that none has to wait for the next
+	 * one, and one more for each producer to fill.
+	 */
+	if (wq->nstreams != 0) {
+		size_t nproducers = MIN(wq->nstreams, (size_t)nthreads);
+		start_block_stream(&wq->stream, read_input_stream, wq->streams,
+		    wq->nstreams, 2 * (size_t)nthreads + nproducers, nproducers);
+	}
+
+	struct merge_queue *mq = &work_ctx->merge_queue;
+	mq->nrecord_sets   = 0;
+	mq->record_sets    = work_ctx->session_records;
+	mq->next_partition = 0;
 
-	size_t chunk_size = log_view->size / nthreads;
-	size_t chunk_rem = log_view->size % nthreads;
 	for (int tid = 0; tid < nthreads; tid++) {
-		size_t start_offset;
-		size_t end_offset;
 		struct thread_ctx *thread_ctx;
+		struct session_records *sr = NULL;
+		struct spill_buffer *sb = NULL;
 
-		start_offset = tid * chunk_size;
-		if (tid < nthreads - 1)
-			end_offset = start_offset + chunk_size;
-		else
-			end_offset = start_offset + chunk_size + chunk_rem;
+		/* The memory limit is shared evenly by the record buffers. */
+		if (memory_limit != 0) {
+			sb = calloc(1, sizeof(*sb));
+			if (sb == NULL)
+				ERR("%s", "calloc");
+			init_spill_buffer(sb, MAX(1, memory_limit / (size_t)nthreads
+			    / sizeof(struct session_record)));
+			work_ctx->spill_buffers[tid] = sb;
+		} else if (partitioned_sessions) {
+			sr = calloc(1, sizeof(*sr));
+			if (sr == NULL)
+				ERR("%s", "calloc");
+			init_session_records(sr);
+			work_ctx->session_records[mq->nrecord_sets++] = sr;
+		}
 
 		thread_ctx = &work_ctx->thread_ctx[tid];
 
-		thread_ctx->log_view          = log_view;
 		thread_ctx->truncate_patterns = tp;
 		thread_ctx->line_config       = lc;
 		thread_ctx->tid               = tid;
-		thread_ctx->chunk.start       = log_view->src + start_offset;
-		thread_ctx->chunk.end         = log_view->src + end_offset;
-		thread_ctx->chunk.size        = end_offset - start_offset;
+		thread_ctx->work_queue        = wq;
+		thread_ctx->merge_queue       = mq;
 		thread_ctx->request_set       = rs;
 		thread_ctx->session_map       = sm;
+		thread_ctx->session_records   = sr;
+		thread_ctx->spill_buffer      = sb;
+		thread_ctx->evictor           = sr == NULL && sb == NULL
+		                                && ev->timeout_ms != 0 ? ev : NULL;
+		thread_ctx->unit_buf          = NULL;
+		thread_ctx->unit_cap          = 0;
+		thread_ctx->chunk_max_ts      = 0;
+		thread_ctx->nchunks           = 0;
+		thread_ctx->nbytes            = 0;
+		thread_ctx->nlines            = 0;
+		thread_ctx->nskipped_lines    = 0;
 
 		rc = pthread_create(&work_ctx->thread[tid], NULL, run_thread,
 		                    (void *)thread_ctx);
@@ -298,6 +767,24 @@ start_work_ctx(struct work_ctx *work_ctx, int nthreads, struct file_view *log_vi
 	}
 }
 
+/*
+ * Starts the same number of threads as start_work_ctx(), for merging
+ * the session records buffered by each thread into the session map.
+ */
+void
+start_merge_ctx(struct work_ctx *work_ctx)
+{
+	assert(work_ctx != NULL);
+
+	for (int tid = 0; tid < work_ctx->nthreads; tid++) {
+		struct thread_ctx *thread_ctx = &work_ctx->thread_ctx[tid];
+		int rc = pthread_create(&work_ctx->thread[tid], NULL,
+		    run_merge_thread, (void *)thread_ctx);
+		if (rc != 0)
+			ERR("%s", "pthread_create");
+	}
+}
+
 void
 finish_work_ctx(struct work_ctx *work_ctx)
 {
@@ -308,21 +795,171 @@ finish_work_ctx(struct work_ctx *work_ctx)
 	}
 }
 
+/*
+ * Waits for the merge threads, and frees the merged session records.
+ */
+void
+finish_merge_ctx(struct work_ctx *work_ctx)
+{
+	assert(work_ctx != NULL);
+
+	finish_work_ctx(work_ctx);
+
+	struct merge_queue *mq = &work_ctx->merge_queue;
+	for (size_t i = 0; i < mq->nrecord_sets; i++)
+		free(mq->record_sets[i]);
+	mq->nrecord_sets = 0;
+}
+
+/*
+ * Merges the sorted runs spilled by all threads, folding each session
+ * into the path graph of the evictor, and removes the runs.
+ */
+void
+merge_spilled_sessions(struct work_ctx *work_ctx)
+{
+	assert(work_ctx != NULL);
+
+	struct session_evictor *ev = work_ctx->evictor;
+	ev->nevicted += merge_spill_buffers(work_ctx->spill_buffers,
+	    (size_t)work_ctx->nthreads, work_ctx->memory_limit,
+	    fold_evicted_session, ev);
+
+	for (int tid = 0; tid < work_ctx->nthreads; tid++) {
+		free_spill_buffer(work_ctx->spill_buffers[tid]);
+		free(work_ctx->spill_buffers[tid]);
+		work_ctx->spill_buffers[tid] = NULL;
+	}
+}
+
+/*
+ * Finishes the inputs after all worker threads are done:
+ * the producer threads of streamed inputs are stopped.
+ * The highest watermark is kept as the starting point of the next scan.
+ */
+void
+finish_work_inputs(struct work_ctx *work_ctx)
+{
+	assert(work_ctx != NULL);
+
+	struct work_queue *wq = &work_ctx->work_queue;
+
+	if (wq->nstreams != 0) {
+		finish_block_stream(&wq->stream);
+		for (size_t i = 0; i < wq->nstreams; i++)
+			finish_input_stream(wq->streams[i]);
+	}
+
+	for (int tid = 0; tid < work_ctx->nthreads; tid++) {
+		free(work_ctx->thread_ctx[tid].unit_buf);
+		work_ctx->thread_ctx[tid].unit_buf = NULL;
+		work_ctx->thread_ctx[tid].unit_cap = 0;
+	}
+
+	free(wq->input_chunks);
+	free(wq->streams);
+
+	struct session_evictor *ev = work_ctx->evictor;
+	for (int tid = 0; tid < work_ctx->nthreads; tid++)
+		ev->base_ts = MAX(ev->base_ts, ev->watermarks[tid]);
+}
+
+void
+output_thread_stats(FILE *out, struct work_ctx *work_ctx)
+{
+	assert(out != NULL);
+	assert(work_ctx != NULL);
+
+	struct work_queue *wq = &work_ctx->work_queue;
+
+	/* Streamed blocks are only counted by the threads that claim them. */
+	uint64_t nchunks = 0;
+	for (int tid = 0; tid < work_ctx->nthreads; tid++)
+		nchunks += work_ctx->thread_ctx[tid].nchunks;
+
+	fprintf(out, "chunks: %" PRIu64 " x %zu bytes\n",
+	    nchunks, wq->chunk_size);
+	for (int tid = 0; tid < work_ctx->nthreads; tid++) {
+		struct thread_ctx *thread_ctx = &work_ctx->thread_ctx[tid];
+		fprintf(out, "thread %d: %" PRIu64 " chunks, %" PRIu64 " bytes\n",
+		    tid, thread_ctx->nchunks, thread_ctx->nbytes);
+	}
+}
+
+static void
+init_session_evictor(struct session_evictor *ev, uint64_t timeout_ms)
+{
+	assert(ev != NULL);
+
+	memset(ev, 0, sizeof(*ev));
+	ev->timeout_ms = timeout_ms;
+	ck_spinlock_init(&ev->lock);
+	init_path_graph(&ev->graph, 0);
+}
+
+/*
+ * Writes the output to a temporary file, which then replaces the
+ * output file, so that readers never see a partially written graph.
+ */
+static void
+rewrite_output_file(const char *path, struct path_graph *pg,
+                    struct request_table *rt)
+{
+	assert(path != NULL);
+	assert(pg != NULL);
+	assert(rt != NULL);
+
+	char tmp_path[strlen(path) + sizeof(".tmp")];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *out = fopen(tmp_path, "w");
+	if (out == NULL)
+		ERR("failed to create output file at '%s'", tmp_path);
+	output_dot_graph(out, pg, rt);
+	if (fclose(out) != 0)
+		ERR("failed to write output file at '%s'", tmp_path);
+	if (rename(tmp_path, path) == -1)
+		ERR("failed to replace output file at '%s'", path);
+}
+
+/* Sums up the scan statistics of all threads. */
+static void
+collect_work_stats(struct stats *stats, struct work_ctx *work_ctx)
+{
+	assert(stats != NULL);
+	assert(work_ctx != NULL);
+
+	for (int tid = 0; tid < work_ctx->nthreads; tid++) {
+		struct thread_ctx *thread_ctx = &work_ctx->thread_ctx[tid];
+		stats->nbytes += thread_ctx->nbytes;
+		stats->nlines += thread_ctx->nlines;
+		stats->nskipped_lines += thread_ctx->nskipped_lines;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
 	const char *index_fields = NULL;
 	const char *session_fields = "ipaddr,useragent";
 	const char *truncate_patterns_path = NULL;
+	const char *state_path = NULL;
+	const char *cache_path = NULL;
 	long nthreads = -1;
+	enum field_scanner field_scanner = FIELD_SCANNER_AUTO;
 
-	struct file_view log_view;
+	char **input_paths;
+	size_t ninputs;
+	struct input *inputs;
 	struct truncate_patterns tp;
 	struct line_config lc;
 	struct request_set rs;
+	struct request_set raw_rs;
 	struct request_table rt;
 	struct session_map sm;
+	struct state state;
 	struct work_ctx work_ctx;
+	struct session_evictor evictor;
 
 	/* Post-processing data */
 	struct path_graph pg;
@@ -330,22 +967,59 @@ main(int argc, char **argv)
 	const char *output_path = "-";
 	const char *output_format = "dot-graph";
 	FILE *out = stdout;
+	int thread_stats = 0;
+	uint64_t follow_interval = 0;
+	struct follow follow;
+	int partitioned_sessions = 0;
+	int segment_classes = 0;
+	uint64_t template_cardinality = 0;
+	uint64_t session_timeout = 0;
+	size_t memory_limit = 0;
+	int print_stats = 0;
+	enum stats_format stats_format = STATS_FORMAT_HUMAN;
+	struct stats stats;
+	struct stats_clock stats_clock;
+
+	/* Options without a short equivalent */
+	enum {
+		OPT_CACHE = 256,
+		OPT_FIELD_SCANNER,
+		OPT_THREAD_STATS,
+		OPT_PARTITIONED_SESSIONS,
+		OPT_SEGMENT_CLASSES,
+		OPT_INFER_TEMPLATES,
+		OPT_MEMORY_LIMIT,
+		OPT_SESSION_TIMEOUT,
+		OPT_STATE,
+		OPT_STATS
+	};
 
 	while (1) {
 		int opt_idx = 0;
 		static struct option long_opts[] = {
+			{"cache",             required_argument, 0, OPT_CACHE },
 			{"concurrency",       required_argument, 0, 'C' },
+			{"field-scanner",     required_argument, 0, OPT_FIELD_SCANNER },
+			{"follow",            required_argument, 0, 'F' },
 			{"format",            required_argument, 0, 'f' },
 			{"help",              no_argument,       0, 'h' },
 			{"index",             required_argument, 0, 'i' },
+			{"infer-templates",   required_argument, 0, OPT_INFER_TEMPLATES },
+			{"memory-limit",      required_argument, 0, OPT_MEMORY_LIMIT },
 			{"truncate-patterns", required_argument, 0, 'T' },
 			{"output",            required_argument, 0, 'o' },
+			{"partitioned-sessions", no_argument,    0, OPT_PARTITIONED_SESSIONS },
+			{"segment-classes",   required_argument, 0, OPT_SEGMENT_CLASSES },
 			{"session",           required_argument, 0, 'S' },
+			{"session-timeout",   required_argument, 0, OPT_SESSION_TIMEOUT },
+			{"state",             required_argument, 0, OPT_STATE },
+			{"stats",             optional_argument, 0, OPT_STATS },
+			{"thread-stats",      no_argument,       0, OPT_THREAD_STATS },
 			{"version",           no_argument,       0, 'V' },
 			{0,                   0,                 0,  0  }
 		};
 
-		int c = getopt_long(argc, argv, "C:f:hi:I:T:M:o:S:V", long_opts, &opt_idx);
+		int c = getopt_long(argc, argv, "C:f:F:hi:I:T:M:o:S:V", long_opts, &opt_idx);
 		if (c == -1)
 			break;
 
@@ -363,6 +1037,13 @@ main(int argc, char **argv)
 			else
 				ERRX("invalid output format: %s", optarg);
 			break;
+		case 'F':
+			errno = 0;
+			follow_interval = strtoull(optarg, NULL, 10);
+			if (follow_interval == 0 || follow_interval > UINT32_MAX
+			 || errno != 0)
+				ERRX("invalid follow interval: %s", optarg);
+			break;
 		case 'h':
 			usage();
 			break;
@@ -371,11 +1052,6 @@ main(int argc, char **argv)
 			break;
 		case 'o':
 			output_path = optarg;
-			if (strcmp(output_path, "-") != 0) {
-				out = fopen(output_path, "w");
-				if (out == NULL)
-					ERR("failed to create output file at '%s'", output_path);
-			}
 			break;
 		case 'S':
 			session_fields = optarg;
@@ -386,6 +1062,52 @@ main(int argc, char **argv)
 		case 'V':
 			printf("%s\n", APATHY_VERSION);
 			break;
+		case OPT_CACHE:
+			cache_path = optarg;
+			break;
+		case OPT_FIELD_SCANNER:
+			field_scanner = str_to_field_scanner(optarg);
+			if (field_scanner == FIELD_SCANNER_INVALID)
+				ERRX("invalid field scanner: %s", optarg);
+			break;
+		case OPT_THREAD_STATS:
+			thread_stats = 1;
+			break;
+		case OPT_PARTITIONED_SESSIONS:
+			partitioned_sessions = 1;
+			break;
+		case OPT_INFER_TEMPLATES:
+			errno = 0;
+			template_cardinality = strtoull(optarg, NULL, 10);
+			if (template_cardinality == 0 || errno != 0)
+				ERRX("invalid template cardinality: %s", optarg);
+			break;
+		case OPT_MEMORY_LIMIT:
+			memory_limit = (size_t)parse_size(optarg);
+			break;
+		case OPT_SESSION_TIMEOUT:
+			errno = 0;
+			session_timeout = strtoull(optarg, NULL, 10);
+			if (session_timeout == 0 || session_timeout > UINT32_MAX
+			 || errno != 0)
+				ERRX("invalid session timeout: %s", optarg);
+			break;
+		case OPT_STATE:
+			state_path = optarg;
+			break;
+		case OPT_STATS:
+			print_stats = 1;
+			if (optarg != NULL) {
+				stats_format = str_to_stats_format(optarg);
+				if (stats_format == STATS_FORMAT_INVALID)
+					ERRX("invalid stats format: %s", optarg);
+			}
+			break;
+		case OPT_SEGMENT_CLASSES:
+			segment_classes = str_to_segment_classes(optarg);
+			if (segment_classes == SEGMENT_CLASS_INVALID)
+				ERRX("invalid segment classes: %s", optarg);
+			break;
 		default:
 			return 1;
 		};
@@ -395,44 +1117,212 @@ main(int argc, char **argv)
 	argv += optind;
 	if (argc == 0)
 		ERRX("%s", "missing access log");
-	if (argc > 1)
-		ERRX("%s", "only one access log allowed");
 
-	init_file_view_readonly(&log_view, argv[0]);
+	/* Templates replace requests in place, so they can't be updated. */
+	if (follow_interval != 0 && template_cardinality != 0)
+		ERRX("%s", "--infer-templates can not be used with --follow");
+
+	/* Spilled sessions are only read back once, after the scan. */
+	if (memory_limit != 0 && (follow_interval != 0 || state_path != NULL))
+		ERRX("%s", "--memory-limit can not be used with --follow or --state");
+	if (memory_limit != 0 && partitioned_sessions)
+		ERRX("%s", "--memory-limit can not be used with --partitioned-sessions");
+
+	/* The cache holds the sessions of whole logs, as read in one run. */
+	if (cache_path != NULL
+	 && (follow_interval != 0 || state_path != NULL || memory_limit != 0))
+		ERRX("%s", "--cache can not be used with --follow, --state or --memory-limit");
+
+	/* A followed output file is replaced at each interval instead. */
+	if (strcmp(output_path, "-") != 0 && follow_interval == 0) {
+		out = fopen(output_path, "w");
+		if (out == NULL)
+			ERR("failed to create output file at '%s'", output_path);
+	}
+
+	init_stats(&stats);
+
+	start_stats_phase(&stats_clock);
+	ninputs = expand_input_paths(argv, argc, &input_paths);
+	inputs = calloc(ninputs, sizeof(*inputs));
+	if (inputs == NULL)
+		ERR("%s", "calloc");
+	for (size_t i = 0; i < ninputs; i++)
+		init_input(&inputs[i], input_paths[i]);
+	end_stats_phase(&stats, STATS_PHASE_MMAP, &stats_clock);
+
+	init_field_scanner(field_scanner);
 
 	if (truncate_patterns_path != NULL)
 		init_truncate_patterns(&tp, truncate_patterns_path);
 	else
 		memset(&tp, 0, sizeof(tp));
+	tp.segment_classes |= segment_classes;
 	//debug_truncate_patterns(&tp);
 
-	init_line_config(&lc, &log_view, index_fields, session_fields);
+	start_stats_phase(&stats_clock);
+	init_input_head(&inputs[0]);
+	init_line_config(&lc, &inputs[0].head, index_fields, session_fields);
+	end_stats_phase(&stats, STATS_PHASE_LINE_CONFIG, &stats_clock);
 	//debug_line_config(&lc);
 	init_request_set(&rs);
 	init_session_map(&sm);
 
-	/* Start worker threads */
-	start_work_ctx(&work_ctx, nthreads, &log_view, &tp, &lc, &rs, &sm);
+	/* Cached sessions are stored whole, and only split afterwards. */
+	init_session_evictor(&evictor,
+	    cache_path == NULL ? session_timeout * 1000 : 0);
 
-	/* Wait for worker threads to finish */
-	finish_work_ctx(&work_ctx);
+	/*
+	 * Read the records from the cache, if it is up to date.
+	 * Otherwise, raw requests are scanned into a request set of their
+	 * own, and cached before truncating them.
+	 */
+	int has_lines = 1;
+	uint64_t cache_key = 0;
+	struct truncate_patterns raw_tp;
+	struct truncate_patterns *scan_tp = &tp;
+	struct request_set *scan_rs = &rs;
+	if (cache_path != NULL) {
+		start_stats_phase(&stats_clock);
+		cache_key = hash_cache_key(&lc, inputs, ninputs);
+		has_lines = !load_cache(cache_path, cache_key, &rs, &sm, &tp,
+		    (int)nthreads);
+		end_stats_phase(&stats, STATS_PHASE_CACHE, &stats_clock);
 
-	/* Do post-processing */
-	gen_request_table(&rt, &rs);
-	init_path_graph(&pg, &rt);
-	gen_path_graph(&pg, &rs, &sm);
+		memset(&raw_tp, 0, sizeof(raw_tp));
+		init_request_set(&raw_rs);
+		scan_tp = &raw_tp;
+		scan_rs = &raw_rs;
+	}
+
+	/* Continue from the previous run, if any */
+	if (state_path != NULL) {
+		start_stats_phase(&stats_clock);
+		load_state(&state, state_path,
+		    hash_state_config(&lc, &tp, evictor.timeout_ms), &rs, &sm,
+		    &evictor.graph);
+		resume_inputs(&state, inputs, ninputs);
+		end_stats_phase(&stats, STATS_PHASE_STATE, &stats_clock);
+	}
 
-	/* DEBUG */
-	//debug_request_set(&rs);
-	//debug_request_table(&rt);
-	//debug_session_map(&sm);
-	//debug_path_graph(&pg);
+	/* Start following the logs, if requested */
+	if (follow_interval != 0)
+		init_follow(&follow, inputs, ninputs, follow_interval * 1000);
 
-	/* Write output */
-	if (strcmp(output_format, "dot-graph") == 0)
-		output_dot_graph(out, &pg, &rt);
-	else
-		ERRX("invalid output format: %s", output_format);
+	/*
+	 * Scan the logs, and write the output. When following the logs,
+	 * appended lines are scanned as they arrive, and the output is
+	 * written again at every interval.
+	 */
+	while (1) {
+		if (has_lines) {
+			/* Start worker threads */
+			start_stats_phase(&stats_clock);
+			start_work_ctx(&work_ctx, nthreads, inputs, ninputs, scan_tp,
+			    &lc, scan_rs, &sm, &evictor, partitioned_sessions,
+			    memory_limit);
+
+			/* Wait for worker threads to finish */
+			finish_work_ctx(&work_ctx);
+			finish_work_inputs(&work_ctx);
+			end_stats_phase(&stats, STATS_PHASE_SCAN, &stats_clock);
+			collect_work_stats(&stats, &work_ctx);
+
+			/* Merge thread-local session records, if any */
+			if (partitioned_sessions) {
+				start_stats_phase(&stats_clock);
+				start_merge_ctx(&work_ctx);
+				finish_merge_ctx(&work_ctx);
+				end_stats_phase(&stats, STATS_PHASE_MERGE,
+				    &stats_clock);
+			}
+
+			/* Read back sessions spilled to disk, if any */
+			if (memory_limit != 0) {
+				start_stats_phase(&stats_clock);
+				merge_spilled_sessions(&work_ctx);
+				end_stats_phase(&stats, STATS_PHASE_MERGE,
+				    &stats_clock);
+			}
+			if (thread_stats)
+				output_thread_stats(stderr, &work_ctx);
+
+			/* Write the cache, and truncate the cached requests */
+			if (cache_path != NULL) {
+				start_stats_phase(&stats_clock);
+				save_cache(cache_path, cache_key, &raw_rs, &sm);
+				truncate_cached_requests(&raw_rs, &rs, &sm, &tp);
+				free_request_set(&raw_rs);
+				end_stats_phase(&stats, STATS_PHASE_CACHE,
+				    &stats_clock);
+			}
+		}
+
+		if (follow_interval != 0 && !is_follow_output_due(&follow)) {
+			wait_follow(&follow);
+			has_lines = update_follow(&follow);
+			continue;
+		}
+
+		/* Save the state before templates are merged into the request set */
+		if (state_path != NULL) {
+			start_stats_phase(&stats_clock);
+			record_inputs(&state, inputs, ninputs);
+			save_state(&state, state_path, &rs, &sm,
+			    &evictor.graph);
+			end_stats_phase(&stats, STATS_PHASE_STATE, &stats_clock);
+		}
+
+		/* Do post-processing */
+		if (template_cardinality != 0) {
+			start_stats_phase(&stats_clock);
+			infer_request_templates(&rs, &sm, &evictor.graph,
+			    template_cardinality);
+			end_stats_phase(&stats, STATS_PHASE_TEMPLATES, &stats_clock);
+		}
+
+		start_stats_phase(&stats_clock);
+		gen_request_table(&rt, &rs);
+		end_stats_phase(&stats, STATS_PHASE_REQUEST_TABLE, &stats_clock);
+
+		start_stats_phase(&stats_clock);
+		init_path_graph(&pg, rt.nrequests);
+		merge_path_graph(&pg, &evictor.graph, NULL);
+		gen_path_graph(&pg, &rs, &sm, session_timeout * 1000);
+		end_stats_phase(&stats, STATS_PHASE_PATH_GRAPH, &stats_clock);
+
+		/* DEBUG */
+		//debug_request_set(&rs);
+		//debug_request_table(&rt);
+		//debug_session_map(&sm);
+		//debug_path_graph(&pg);
+
+		/* Write output */
+		start_stats_phase(&stats_clock);
+		if (strcmp(output_format, "dot-graph") != 0)
+			ERRX("invalid output format: %s", output_format);
+		if (follow_interval != 0 && strcmp(output_path, "-") != 0) {
+			rewrite_output_file(output_path, &pg, &rt);
+		} else {
+			output_dot_graph(out, &pg, &rt);
+			fflush(out);
+		}
+		end_stats_phase(&stats, STATS_PHASE_OUTPUT, &stats_clock);
+
+		if (print_stats) {
+			stats.nrequests = rt.nrequests;
+			stats.nsessions = count_session_map_entries(&sm)
+			    + evictor.nevicted;
+			output_stats(stderr, &stats, stats_format);
+		}
+
+		if (follow_interval == 0)
+			break;
+
+		free_path_graph(&pg);
+		free_request_table(&rt);
+		has_lines = update_follow(&follow);
+	}
 
 	return 0;
 }
@@ -444,16 +1334,28 @@ usage(void)
 "apathy %s\n"
 "Access log path analyzer\n"
 "\n"
-"    apathy [OPTIONS] <ACCESS_LOG>\n"
+"    apathy [OPTIONS] <ACCESS_LOG>...\n"
 "\n"
 "FLAGS:\n"
 "    -h, --help       Prints help information\n"
 "    -V, --version    Prints version information\n"
 "\n"
 "OPTIONS:\n"
+"    --cache <cache_file>                    Keep the records parsed from the logs in <cache_file>, and read them\n"
+"                                              from there instead of the logs while the logs are unchanged\n"
+"\n"
 "    -C, --concurrency <num_threads>         Number of worker threads\n"
 "                                              default: number of logical CPU cores, or 4 as a fallback\n"
 "\n"
+"    --field-scanner <scanner>               Implementation used for splitting lines into fields\n"
+"                                              available scanners: auto scalar sse2 avx2 check\n"
+"                                              check: use scalar, verify against the fastest available scanner\n"
+"                                              default: auto (fastest available)\n"
+"\n"
+"    -F, --follow <seconds>                  Keep reading lines appended to the logs, like tail -F,\n"
+"                                              and write the output again every <seconds> seconds\n"
+"                                              an output file is replaced, standard output gets one graph after another\n"
+"\n"
 "    -i, --index <field_indices>             Comma-separated list of field-to-index assignments\n"
 "                                              available fields: rfc3339 date time\n"
 "                                                                request method protocol domain endpoint\n"
@@ -461,17 +1363,52 @@ usage(void)
 "                                              valid index: 1 - $NUMBER_OF_FIELDS\n"
 "                                              example: rfc3339=1,ipaddr=2,request=5,useragent=8\n"
 "\n"
+"    --infer-templates <max_values>          Merge requests into endpoint templates, replacing path segments\n"
+"                                              with more than <max_values> distinct values with $PARAM\n"
+"                                              runs after scanning, so peak memory use is not reduced\n"
+"                                              combined with -T or --segment-classes, runs on truncated requests\n"
+"                                              example: 100\n"
+"\n"
+"    --memory-limit <size>                   Keep session records within <size> bytes of memory, spilling them\n"
+"                                              to sorted runs in $TMPDIR and merging those after scanning\n"
+"                                              suffixes: K M G\n"
+"                                              example: 512M\n"
+"\n"
 "    -T, --truncate-patterns <pattern_file>  File containing URL patterns for merging HTTP requests\n"
 "\n"
 "    -o, --output <output_file>              File for output\n"
 "                                              default: \"-\" (standard output)\n"
 "\n"
+"    --partitioned-sessions                  Buffer sessions per thread, and merge them in parallel after scanning\n"
+"                                              uses more memory, but avoids locking during the scan\n"
+"\n"
+"    --segment-classes <classes>             Comma-separated built-in classes of URL path segments to truncate\n"
+"                                              available classes: uuid int hex b64 all\n"
+"                                              replaced with: $UUID $INT $HEX $B64\n"
+"                                              also enabled by a reserved alias without a pattern in <pattern_file>\n"
+"\n"
 "    -S, --session <session_fields>          Comma-separated fields used to construct a session ID for a request\n"
 "                                              available fields: ipaddr useragent\n"
 "                                              default: ipaddr,useragent\n"
 "\n"
+"    --session-timeout <seconds>             End a session after <seconds> seconds without requests\n"
+"                                              sessions idle for longer are dropped from memory during the scan\n"
+"                                              example: 1800\n"
+"\n"
+"    --state <state_file>                    Keep requests, sessions and read offsets in <state_file>,\n"
+"                                              and only read data appended to the logs since the last run\n"
+"\n"
+"    --stats[=<format>]                      Print per-phase timings, throughput and memory usage to standard error\n"
+"                                              available formats: human json\n"
+"                                              default: human\n"
+"\n"
+"    --thread-stats                          Print per-thread chunk counts to standard error\n"
+"\n"
 "ARGUMENTS:\n"
-"    <ACCESS_LOG>    Access log file containing HTTP request timestamps, IP addresses, methods, URLs and User Agent headers\n",
+"    <ACCESS_LOG>    Access log file containing HTTP request timestamps, IP addresses, methods, URLs and User Agent headers\n"
+"                    may be compressed with gzip or zstd\n"
+"                    \"-\" reads standard input\n"
+"                    multiple logs, directories and glob patterns are read as one log\n",
 	    APATHY_VERSION);
 	exit(EXIT_FAILURE);
 }
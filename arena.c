@@ -0,0 +1,103 @@
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "util.h"
+
+#define ALIGN_ARENA(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void
+init_arena(struct arena *arena)
+{
+	assert(arena != NULL);
+
+	arena->chunks = NULL;
+	arena->pos = NULL;
+	arena->end = NULL;
+	arena->chunk_size = ARENA_MIN_CHUNK_SIZE;
+}
+
+/*
+ * Maps a chunk of chunk_size bytes, and adds it to the arena.
+ *
+ * Chunks of at least ARENA_MAX_CHUNK_SIZE bytes are advised to be
+ * backed by transparent huge pages, which saves TLB misses on large
+ * session maps and request sets if the system has them enabled.
+ */
+static struct arena_chunk *
+map_arena_chunk(struct arena *arena, size_t chunk_size)
+{
+	void *p = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		ERR("%s", "mmap");
+
+#ifdef MADV_HUGEPAGE
+	if (ARENA_MAX_CHUNK_SIZE <= chunk_size)
+		(void)madvise(p, chunk_size, MADV_HUGEPAGE);
+#endif
+
+	struct arena_chunk *chunk = p;
+	chunk->next = arena->chunks;
+	chunk->size = chunk_size;
+	arena->chunks = chunk;
+
+	return chunk;
+}
+
+/*
+ * Returns size bytes of zeroed memory, aligned to ARENA_ALIGN bytes,
+ * that stays valid until the arena is freed.
+ *
+ * Allocations larger than a quarter of the next chunk get a chunk of
+ * their own, so that they do not cut the current chunk short.
+ */
+void *
+alloc_from_arena(struct arena *arena, size_t size)
+{
+	assert(arena != NULL);
+
+	size_t header_size = ALIGN_ARENA(sizeof(struct arena_chunk));
+	assert(size < SIZE_MAX - header_size - ARENA_MIN_CHUNK_SIZE);
+
+	size = ALIGN_ARENA(size);
+	if (arena->chunk_size / 4 < size) {
+		size_t chunk_size = header_size + size;
+		chunk_size += ARENA_MIN_CHUNK_SIZE - 1;
+		chunk_size -= chunk_size % ARENA_MIN_CHUNK_SIZE;
+		return (char *)map_arena_chunk(arena, chunk_size) + header_size;
+	}
+
+	if ((size_t)(arena->end - arena->pos) < size) {
+		struct arena_chunk *chunk = map_arena_chunk(arena,
+		    arena->chunk_size);
+		arena->pos = (char *)chunk + header_size;
+		arena->end = (char *)chunk + chunk->size;
+		if (arena->chunk_size < ARENA_MAX_CHUNK_SIZE)
+			arena->chunk_size *= 2;
+	}
+
+	void *p = arena->pos;
+	arena->pos += size;
+
+	return p;
+}
+
+/* Unmaps every chunk of an arena, leaving it empty but usable. */
+void
+free_arena(struct arena *arena)
+{
+	assert(arena != NULL);
+
+	struct arena_chunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+		if (munmap(chunk, chunk->size) == -1)
+			ERR("%s", "munmap");
+		chunk = next;
+	}
+
+	init_arena(arena);
+}
@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Mapped region of an arena, with the header at its start. */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t              size; /* Mapping size, header included */
+};
+
+/*
+ * Bump allocator for data that lives as long as the structure it
+ * belongs to. Memory is handed out from anonymous mappings, which start
+ * small and double in size up to ARENA_MAX_CHUNK_SIZE. Nothing is freed
+ * individually, and the whole arena is unmapped at once.
+ *
+ * An arena is not thread-safe, so it must be owned by one thread, or
+ * guarded by the lock of whatever owns it.
+ */
+struct arena {
+#define ARENA_MIN_CHUNK_SIZE (64 * 1024)
+#define ARENA_MAX_CHUNK_SIZE (2 * 1024 * 1024) /* One huge page on x86-64 */
+#define ARENA_ALIGN          16
+	struct arena_chunk *chunks;     /* Most recent chunk first */
+	char               *pos;        /* Next free byte in the current chunk */
+	char               *end;        /* End of the current chunk */
+	size_t              chunk_size; /* Size of the next chunk */
+};
+
+void  init_arena(struct arena *);
+void *alloc_from_arena(struct arena *, size_t);
+void  free_arena(struct arena *);
+
+#endif
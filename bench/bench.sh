@@ -0,0 +1,63 @@
+#!/bin/sh
+
+# End-to-end benchmark: runs apathy on a synthetic log at several
+# thread counts, and records the scan throughput in GB/s.
+#
+# Tunables (environment):
+#   BENCH_LOG       log file to use, generated if missing (default: bench/bench.log)
+#   BENCH_SIZE      size of a generated log (default: 1G)
+#   BENCH_GEN_ARGS  extra gen_log options (default: none)
+#   BENCH_THREADS   thread counts (default: 1 2 4 8)
+#   BENCH_RUNS      runs per thread count, the best one is kept (default: 3)
+#   BENCH_ARGS      extra apathy options (default: -T bench/truncate.txt)
+#   BENCH_OUTPUT    file the results are appended to (default: bench_output.txt)
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+BENCH_LOG=${BENCH_LOG:-bench/bench.log}
+BENCH_SIZE=${BENCH_SIZE:-1G}
+BENCH_GEN_ARGS=${BENCH_GEN_ARGS:-}
+BENCH_THREADS=${BENCH_THREADS:-1 2 4 8}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_ARGS=${BENCH_ARGS:--T bench/truncate.txt}
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench_output.txt}
+
+if [ ! -f "$BENCH_LOG" ]; then
+	echo "generating $BENCH_SIZE log at $BENCH_LOG" >&2
+	./bench/gen_log -s "$BENCH_SIZE" $BENCH_GEN_ARGS -o "$BENCH_LOG"
+fi
+
+# Extracts a numeric field from the --stats=json output.
+json_field() {
+	sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p"
+}
+
+{
+	echo "# $(date -u +%Y-%m-%dT%H:%M:%SZ) $(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+	echo "# log: $BENCH_LOG ($(wc -c < "$BENCH_LOG") bytes), args: $BENCH_ARGS"
+	printf "%-8s %10s %12s %12s\n" threads "GB/s" "scan (ms)" "total (ms)"
+} | tee -a "$BENCH_OUTPUT"
+
+for threads in $BENCH_THREADS; do
+	best_bps=0
+	best_scan=0
+	best_total=0
+	run=0
+	while [ "$run" -lt "$BENCH_RUNS" ]; do
+		stats=$(./apathy --stats=json -C "$threads" $BENCH_ARGS \
+		    -o /dev/null "$BENCH_LOG" 2>&1 >/dev/null | grep '^{')
+		bps=$(echo "$stats" | json_field scan_bytes_per_sec)
+		if awk "BEGIN { exit !($bps > $best_bps) }"; then
+			best_bps=$bps
+			best_scan=$(echo "$stats" | sed -n 's/.*"scan":{"wall_ms":\([0-9.]*\).*/\1/p')
+			best_total=$(echo "$stats" | json_field total_wall_ms)
+		fi
+		run=$((run + 1))
+	done
+
+	printf "%-8s %10.3f %12.1f %12.1f\n" "$threads" \
+	    "$(awk "BEGIN { print $best_bps / 1e9 }")" "$best_scan" "$best_total" \
+	    | tee -a "$BENCH_OUTPUT"
+done
@@ -0,0 +1,427 @@
+/*
+ * Synthetic access log generator, for benchmarking.
+ *
+ * Writes lines in one of the formats recognized by init_line_config(),
+ * with tunable session count, request cardinality, popularity skew,
+ * line width and share of requests with truncatable IDs.
+ * The log can also be written BGZF-compressed, as bgzip(1) would.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ZLIB_CONST
+#include <zlib.h>
+
+enum log_format {
+	LOG_FORMAT_ELB = 0, /* rfc3339, ipaddr, ipaddr, "request", "useragent" */
+	LOG_FORMAT_CLOUDFRONT /* Tab-separated date, time, ..., method, domain, endpoint, ... */
+};
+
+struct gen_config {
+	enum log_format format;
+	int             bgzf;          /* Compress the output into BGZF blocks */
+	uint64_t        size;          /* Bytes to write at least */
+	uint64_t        nsessions;
+	uint64_t        nendpoints;
+	double          skew;          /* Zipf exponent of endpoint popularity */
+	uint64_t        width;         /* Approximate line width */
+	double          id_ratio;      /* Share of requests with an ID in the path */
+	uint64_t        seed;
+};
+
+static const char *methods[] = { "GET", "GET", "GET", "POST", "PUT", "DELETE" };
+#define NMETHODS (sizeof(methods) / sizeof(methods[0]))
+
+/* splitmix64 */
+static uint64_t
+next_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double
+next_random_unit(uint64_t *state)
+{
+	return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Cumulative Zipf distribution over n items. */
+static double *
+alloc_zipf_cdf(uint64_t n, double skew)
+{
+	double *cdf = calloc(n, sizeof(*cdf));
+	if (cdf == NULL)
+		err(1, "calloc");
+
+	double sum = 0.0;
+	for (uint64_t i = 0; i < n; i++) {
+		sum += 1.0 / pow(i + 1, skew);
+		cdf[i] = sum;
+	}
+	for (uint64_t i = 0; i < n; i++)
+		cdf[i] /= sum;
+
+	return cdf;
+}
+
+static uint64_t
+sample_zipf(const double *cdf, uint64_t n, uint64_t *state)
+{
+	double u = next_random_unit(state);
+	uint64_t lo = 0, hi = n - 1;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int
+format_path(char *buf, size_t size, uint64_t endpoint, uint64_t *state,
+            double id_ratio)
+{
+	int n = snprintf(buf, size, "/api/v1/resource%" PRIu64, endpoint);
+
+	if (next_random_unit(state) < id_ratio) {
+		uint64_t a = next_random(state);
+		uint64_t b = next_random(state);
+		if (a & 1) {
+			n += snprintf(buf + n, size - n,
+			    "/%08" PRIx64 "-%04" PRIx64 "-%04" PRIx64 "-%04" PRIx64 "-%012" PRIx64,
+			    a >> 32, (a >> 16) & 0xffff, a & 0xffff,
+			    b >> 48, (uint64_t)(b & 0xffffffffffffULL));
+		} else {
+			n += snprintf(buf + n, size - n, "/%" PRIu64, b % 1000000);
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Log output, buffered into BGZF blocks if the log is compressed.
+ * Each block is a gzip member with the block size in an extra field,
+ * so that readers can split the log into independently decompressed
+ * parts.
+ */
+struct gen_output {
+#define BGZF_BLOCK_SIZE_MAX 65536
+#define BGZF_DATA_SIZE_MAX  65280 /* Leaves room for incompressible data */
+#define BGZF_HEADER_SIZE    18
+#define BGZF_TRAILER_SIZE   8
+	FILE          *file;
+	int            bgzf;
+	size_t         size;
+	unsigned char  data[BGZF_DATA_SIZE_MAX];
+};
+
+static void
+put_le(unsigned char *p, uint32_t v, int nbytes)
+{
+	for (int i = 0; i < nbytes; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void
+write_bgzf_block(struct gen_output *out)
+{
+	static const unsigned char header[BGZF_HEADER_SIZE - 2] = {
+		0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, /* gzip, FEXTRA */
+		6, 0, 'B', 'C', 2, 0                   /* BC subfield */
+	};
+	unsigned char block[BGZF_BLOCK_SIZE_MAX];
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+	    8, Z_DEFAULT_STRATEGY) != Z_OK)
+		errx(1, "%s", "deflateInit2");
+
+	zs.next_in = out->data;
+	zs.avail_in = out->size;
+	zs.next_out = block + BGZF_HEADER_SIZE;
+	zs.avail_out = sizeof(block) - BGZF_HEADER_SIZE - BGZF_TRAILER_SIZE;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+		errx(1, "%s", "BGZF block overflow");
+
+	size_t block_size = BGZF_HEADER_SIZE + zs.total_out + BGZF_TRAILER_SIZE;
+	deflateEnd(&zs);
+
+	memcpy(block, header, sizeof(header));
+	put_le(block + BGZF_HEADER_SIZE - 2, block_size - 1, 2);
+	unsigned char *trailer = block + block_size - BGZF_TRAILER_SIZE;
+	put_le(trailer, crc32(0, out->data, out->size), 4);
+	put_le(trailer + 4, out->size, 4);
+
+	fwrite(block, 1, block_size, out->file);
+	out->size = 0;
+}
+
+static void
+write_output(struct gen_output *out, const void *data, size_t size)
+{
+	if (!out->bgzf) {
+		fwrite(data, 1, size, out->file);
+		return;
+	}
+
+	const unsigned char *p = data;
+	while (size != 0) {
+		size_t n = BGZF_DATA_SIZE_MAX - out->size;
+		n = n < size ? n : size;
+		memcpy(out->data + out->size, p, n);
+		out->size += n;
+		p += n;
+		size -= n;
+
+		if (out->size == BGZF_DATA_SIZE_MAX)
+			write_bgzf_block(out);
+	}
+}
+
+/* Writes the last block, and the empty block marking the end of BGZF. */
+static void
+finish_output(struct gen_output *out)
+{
+	if (!out->bgzf)
+		return;
+
+	if (out->size != 0)
+		write_bgzf_block(out);
+	write_bgzf_block(out);
+}
+
+static void
+generate_log(struct gen_output *out, struct gen_config *cfg)
+{
+	uint64_t state = cfg->seed;
+	double *cdf = alloc_zipf_cdf(cfg->nendpoints, cfg->skew);
+
+	/*
+	 * Timestamps start at 2018-12-01T00:00:00Z and advance by 1-10 ms
+	 * per line, so they never go backwards however long the log is.
+	 */
+	uint64_t ts = 1543622400000ULL;
+	uint64_t nwritten = 0;
+	char path[256];
+	char line[8192];
+	char padding[4096];
+	size_t npad = SIZE_MAX; /* Set from the first line */
+	memset(padding, 'x', sizeof(padding));
+
+	while (nwritten < cfg->size) {
+		uint64_t session = next_random(&state) % cfg->nsessions;
+		uint64_t endpoint = sample_zipf(cdf, cfg->nendpoints, &state);
+		const char *method = methods[next_random(&state) % NMETHODS];
+		format_path(path, sizeof(path), endpoint, &state, cfg->id_ratio);
+
+		time_t secs = (time_t)(ts / 1000);
+		unsigned ms = ts % 1000;
+		struct tm tm;
+		char date[16], hms[16];
+		if (gmtime_r(&secs, &tm) == NULL)
+			errx(1, "timestamp out of range: %" PRIu64, ts);
+		strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+		strftime(hms, sizeof(hms), "%H:%M:%S", &tm);
+		unsigned ip_a = (session >> 16) & 0xff;
+		unsigned ip_b = (session >> 8) & 0xff;
+		unsigned ip_c = session & 0xff;
+
+		int n;
+		switch (cfg->format) {
+		case LOG_FORMAT_CLOUDFRONT:
+			n = snprintf(line, sizeof(line),
+			    "%s\t%s\tDUB2\t615\t10.%u.%u.%u\t%s\t"
+			    "foobar.cloudfront.net\t%s\t200\tMozilla/5.0%%20(session%%20%" PRIu64 ")",
+			    date, hms, ip_a, ip_b, ip_c, method, path, session);
+			break;
+		case LOG_FORMAT_ELB:
+		default:
+			n = snprintf(line, sizeof(line),
+			    "%sT%s.%03uZ 10.%u.%u.%u:5000 127.0.0.1:80 "
+			    "\"%s http://my-api%s\" \"Mozilla/5.0 USERAGENT %" PRIu64,
+			    date, hms, ms, ip_a, ip_b, ip_c, method, path,
+			    session);
+			break;
+		}
+
+		/*
+		 * Pad the user agent to reach the requested width. The padding
+		 * is the same on every line, so that it doesn't change
+		 * session IDs.
+		 */
+		if (npad == SIZE_MAX) {
+			npad = 0;
+			if ((uint64_t)n + 2 < cfg->width)
+				npad = cfg->width - n - 2;
+			npad = npad < sizeof(padding) ? npad : sizeof(padding);
+		}
+
+		write_output(out, line, n);
+		write_output(out, padding, npad);
+		if (cfg->format == LOG_FORMAT_ELB)
+			write_output(out, "\"\n", 2);
+		else
+			write_output(out, "\n", 1);
+		nwritten += n + npad + (cfg->format == LOG_FORMAT_ELB ? 2 : 1);
+
+		ts += 1 + next_random(&state) % 10;
+	}
+
+	finish_output(out);
+	free(cdf);
+}
+
+/* Parses a byte count with an optional K, M or G suffix. */
+static uint64_t
+parse_size(const char *s)
+{
+	char *endp;
+	double size = strtod(s, &endp);
+	switch (*endp) {
+	case 'G':
+	case 'g':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'M':
+	case 'm':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'K':
+	case 'k':
+		size *= 1024;
+		break;
+	case '\0':
+		break;
+	default:
+		errx(1, "invalid size: %s", s);
+	}
+
+	if (size <= 0)
+		errx(1, "invalid size: %s", s);
+
+	return size;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"gen_log\n"
+"Synthetic access log generator\n"
+"\n"
+"    gen_log [OPTIONS]\n"
+"\n"
+"OPTIONS:\n"
+"    -f <format>      Log format: elb cloudfront (default: elb)\n"
+"    -c <compression> Output compression: none bgzf (default: none)\n"
+"    -s <size>        Bytes to write, with optional K, M or G suffix (default: 1G)\n"
+"    -u <sessions>    Number of distinct sessions (default: 10000)\n"
+"    -r <endpoints>   Number of distinct endpoints, without IDs (default: 200)\n"
+"    -z <skew>        Zipf exponent of endpoint popularity (default: 1.0)\n"
+"    -w <width>       Approximate line width in bytes (default: 0, no padding)\n"
+"    -i <ratio>       Share of requests with a UUID or integer ID (default: 0.5)\n"
+"    -S <seed>        Random seed (default: 1)\n"
+"    -o <file>        Output file (default: standard output)\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct gen_config cfg = {
+		.format     = LOG_FORMAT_ELB,
+		.bgzf       = 0,
+		.size       = 1024ULL * 1024 * 1024,
+		.nsessions  = 10000,
+		.nendpoints = 200,
+		.skew       = 1.0,
+		.width      = 0,
+		.id_ratio   = 0.5,
+		.seed       = 1
+	};
+	FILE *out = stdout;
+
+	int c;
+	while ((c = getopt(argc, argv, "f:c:s:u:r:z:w:i:S:o:h")) != -1) {
+		switch (c) {
+		case 'f':
+			if (strcmp(optarg, "elb") == 0)
+				cfg.format = LOG_FORMAT_ELB;
+			else if (strcmp(optarg, "cloudfront") == 0)
+				cfg.format = LOG_FORMAT_CLOUDFRONT;
+			else
+				errx(1, "invalid format: %s", optarg);
+			break;
+		case 'c':
+			if (strcmp(optarg, "none") == 0)
+				cfg.bgzf = 0;
+			else if (strcmp(optarg, "bgzf") == 0)
+				cfg.bgzf = 1;
+			else
+				errx(1, "invalid compression: %s", optarg);
+			break;
+		case 's':
+			cfg.size = parse_size(optarg);
+			break;
+		case 'u':
+			cfg.nsessions = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			cfg.nendpoints = strtoull(optarg, NULL, 10);
+			break;
+		case 'z':
+			cfg.skew = strtod(optarg, NULL);
+			break;
+		case 'w':
+			cfg.width = strtoull(optarg, NULL, 10);
+			break;
+		case 'i':
+			cfg.id_ratio = strtod(optarg, NULL);
+			break;
+		case 'S':
+			cfg.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL)
+				err(1, "failed to create output file at '%s'", optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (cfg.nsessions == 0 || cfg.nendpoints == 0)
+		errx(1, "%s", "session and endpoint counts must be positive");
+	if (cfg.skew < 0.0 || cfg.id_ratio < 0.0 || 1.0 < cfg.id_ratio)
+		errx(1, "%s", "invalid skew or ID ratio");
+
+	static struct gen_output output;
+	output.file = out;
+	output.bgzf = cfg.bgzf;
+	generate_log(&output, &cfg);
+
+	if (fclose(out) != 0)
+		err(1, "fclose");
+
+	return 0;
+}
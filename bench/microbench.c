@@ -0,0 +1,616 @@
+/*
+ * Microbenchmarks for the hot kernels of apathy.
+ *
+ * Each kernel is run over the fields of a log, either given with -l or
+ * generated into a temporary file, repeatedly until a minimum time has
+ * passed. Results are reported per operation (one line, field or
+ * request) and per input byte. Kernels with several implementations,
+ * such as the field scanners, are run once per variant, so that they
+ * can be compared side by side.
+ *
+ * Cycles are read from the time stamp counter on x86, so they count
+ * reference cycles, which differ from core cycles under frequency
+ * scaling.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "../field.h"
+#include "../file_view.h"
+#include "../hash.h"
+#include "../request.h"
+#include "../time.h"
+#include "../truncate.h"
+#include "../util.h"
+
+/* Fields of one log line, as needed by the kernels. */
+struct bench_line {
+	const char          *src;
+	size_t               size;
+	struct field_view    fvs[NFIELD_TYPES]; /* By field type, src NULL if missing */
+	struct request_info  ri;
+	char                *raw_request;       /* Null-terminated method and URL */
+	size_t               raw_request_size;
+};
+
+struct bench_input {
+	struct file_view   log_view;
+	struct line_config lc;
+	size_t             nlines;
+	struct bench_line *lines;
+};
+
+struct bench_opts {
+	double      min_ms;  /* Minimum run time per kernel */
+	const char *filter;  /* Only run kernels containing this string */
+};
+
+/* One pass of a kernel over the input. Returns a value to keep the work alive. */
+typedef uint64_t (*bench_fn)(struct bench_input *, void *);
+
+static volatile uint64_t bench_sink;
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint64_t
+now_cycles(void)
+{
+#if HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void
+run_bench(struct bench_opts *opts, struct bench_input *in, const char *kernel,
+          const char *variant, bench_fn fn, void *arg, uint64_t nops,
+          uint64_t nbytes)
+{
+	if (opts->filter != NULL && strstr(kernel, opts->filter) == NULL)
+		return;
+	if (nops == 0) {
+		printf("%-24s %-10s %12s\n", kernel, variant, "(no input)");
+		return;
+	}
+
+	/* Warm up caches and lazily built state. */
+	bench_sink += fn(in, arg);
+
+	uint64_t npasses = 0;
+	double start_ms = now_ms();
+	uint64_t start_cycles = now_cycles();
+	double elapsed_ms;
+	do {
+		bench_sink += fn(in, arg);
+		npasses++;
+		elapsed_ms = now_ms() - start_ms;
+	} while (elapsed_ms < opts->min_ms);
+	uint64_t cycles = now_cycles() - start_cycles;
+
+	double total_ops = (double)nops * npasses;
+	double total_bytes = (double)nbytes * npasses;
+	double ns_per_op = elapsed_ms * 1e6 / total_ops;
+	double mb_per_sec = total_bytes / (elapsed_ms / 1e3) / 1e6;
+
+	printf("%-24s %-10s %12.2f", kernel, variant, ns_per_op);
+	if (HAVE_TSC && 0 < total_bytes)
+		printf(" %12.3f", cycles / total_bytes);
+	else
+		printf(" %12s", "-");
+	printf(" %12.1f\n", mb_per_sec);
+}
+
+/*
+ * Kernels
+ */
+
+static uint64_t
+bench_get_fields(struct bench_input *in, void *arg)
+{
+	(void)arg;
+	uint64_t sum = 0;
+	struct field_view fvs[NALL_FIELDS_MAX];
+	for (size_t i = 0; i < in->nlines; i++) {
+		const char *endp;
+		sum += get_fields(fvs, NALL_FIELDS_MAX, in->lines[i].src, 1, &endp);
+	}
+
+	return sum;
+}
+
+static uint64_t
+bench_get_scan_fields(struct bench_input *in, void *arg)
+{
+	(void)arg;
+	uint64_t sum = 0;
+	struct field_view fvs[NALL_FIELDS_MAX];
+	int max_fields = in->lc.nscan_fields + 1;
+	for (size_t i = 0; i < in->nlines; i++) {
+		const char *endp;
+		sum += get_fields(fvs, max_fields, in->lines[i].src, 1, &endp);
+	}
+
+	return sum;
+}
+
+static uint64_t
+bench_hash64_update(struct bench_input *in, void *arg)
+{
+	enum field_type type = *(enum field_type *)arg;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < in->nlines; i++) {
+		struct field_view *fv = &in->lines[i].fvs[type];
+		if (fv->src != NULL)
+			sum += hash64_update(hash64_init(), fv->src, fv->len);
+	}
+
+	return sum;
+}
+
+static uint64_t
+bench_hash64_update_ipaddr(struct bench_input *in, void *arg)
+{
+	(void)arg;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < in->nlines; i++) {
+		struct field_view *fv = &in->lines[i].fvs[FIELD_IPADDR];
+		if (fv->src != NULL)
+			sum += hash64_update_ipaddr(hash64_init(), fv->src);
+	}
+
+	return sum;
+}
+
+static uint64_t
+bench_time(struct bench_input *in, void *arg)
+{
+	enum field_type type = *(enum field_type *)arg;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < in->nlines; i++) {
+		const char *src = in->lines[i].fvs[type].src;
+		if (src == NULL)
+			continue;
+
+		switch (type) {
+		case FIELD_RFC3339:
+			sum += rfc3339_to_ms(src);
+			break;
+		case FIELD_RFC3339_NO_MS:
+			sum += rfc3339_no_ms_to_ms(src);
+			break;
+		case FIELD_DATE:
+			sum += date_to_ms(src);
+			break;
+		case FIELD_TIME:
+			sum += time_to_ms(src);
+			break;
+		case FIELD_IPADDR:
+		case FIELD_USERAGENT:
+		case FIELD_REQUEST:
+		case FIELD_METHOD:
+		case FIELD_PROTOCOL:
+		case FIELD_DOMAIN:
+		case FIELD_ENDPOINT:
+		case FIELD_UNKNOWN:
+		default:
+			assert(0 && "NOTREACHED");
+			break;
+		}
+	}
+
+	return sum;
+}
+
+static uint64_t
+bench_truncate_raw_request(struct bench_input *in, void *arg)
+{
+	struct truncate_patterns *tp = arg;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < in->nlines; i++) {
+		struct bench_line *line = &in->lines[i];
+		char trunc_buf[line->raw_request_size * SEGMENT_ALIAS_GROWTH_MAX
+		    + tp->max_alias_size * REQUEST_NTRUNCS_MAX + 1];
+		sum += truncate_raw_request(trunc_buf, sizeof(trunc_buf) - 1,
+		    line->raw_request, line->raw_request_size, tp);
+	}
+
+	return sum;
+}
+
+struct request_set_bench {
+	struct request_set        rs;
+	struct truncate_patterns *tp;
+};
+
+static uint64_t
+bench_add_request_set_entry(struct bench_input *in, void *arg)
+{
+	struct request_set_bench *rsb = arg;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < in->nlines; i++)
+		sum += add_request_set_entry(&rsb->rs, &in->lines[i].ri, rsb->tp);
+
+	return sum;
+}
+
+/*
+ * Input
+ */
+
+/* Creates a temporary file, and stores its path into *pathp. */
+static int
+open_tmp_file(const char *name, char **pathp)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL)
+		tmpdir = "/tmp";
+
+	size_t path_size = strlen(tmpdir) + strlen(name) + 16;
+	char *path = malloc(path_size);
+	if (path == NULL)
+		err(1, "malloc");
+	snprintf(path, path_size, "%s/%s.XXXXXX", tmpdir, name);
+
+	int fd = mkstemp(path);
+	if (fd == -1)
+		err(1, "mkstemp");
+
+	*pathp = path;
+	return fd;
+}
+
+/* Writes a synthetic log in the ELB format into a temporary file. */
+static char *
+gen_bench_log(size_t nlines)
+{
+	static const char *methods[] = { "GET", "GET", "POST", "PUT", "DELETE" };
+
+	char *path;
+	int fd = open_tmp_file("microbench_log", &path);
+	FILE *out = fdopen(fd, "w");
+	if (out == NULL)
+		err(1, "fdopen");
+
+	uint32_t x = 1;
+	for (size_t i = 0; i < nlines; i++) {
+		char url[128];
+		/* xorshift32 */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		switch (x % 7) {
+		case 0:
+			snprintf(url, sizeof(url), "/login");
+			break;
+		case 1:
+			snprintf(url, sizeof(url), "/health");
+			break;
+		case 2:
+			snprintf(url, sizeof(url), "/search");
+			break;
+		case 3:
+			snprintf(url, sizeof(url), "/api/v1/items");
+			break;
+		case 4:
+			snprintf(url, sizeof(url), "/api/v1/users/%08x-%04x-%04x-%04x-%012x",
+			    x, x >> 16, x & 0xffff, (x >> 8) & 0xffff, x * 2654435761u);
+			break;
+		case 5:
+			snprintf(url, sizeof(url), "/token/%08x-%04x-%04x-%04x-%012x/data",
+			    x, x >> 16, x & 0xffff, (x >> 8) & 0xffff, x * 2654435761u);
+			break;
+		default:
+			snprintf(url, sizeof(url), "/api/v1/orders/%u", x);
+			break;
+		}
+
+		unsigned session = x % 5000;
+		fprintf(out, "2018-12-01T%02zu:%02zu:%02zu.%03zuZ "
+		    "10.0.%u.%u:5000 127.0.0.1:80 \"%s http://my-api%s\" "
+		    "\"Mozilla/5.0 USERAGENT %u\"\n",
+		    (i / 3600000) % 24, (i / 60000) % 60, (i / 1000) % 60, i % 1000,
+		    session >> 8, session & 0xff,
+		    methods[(x >> 3) % (sizeof(methods) / sizeof(methods[0]))],
+		    url, session);
+	}
+
+	if (fclose(out) != 0)
+		err(1, "fclose");
+
+	return path;
+}
+
+static void
+init_raw_request(struct bench_line *line)
+{
+	struct request_info *ri = &line->ri;
+	char buf[4096];
+	int n;
+
+	if (ri->request != NULL) {
+		const char *s = ri->request;
+		size_t method_size = strcspn(s, " ");
+		size_t url_size = strcspn(s + method_size + 1, "?\" \n");
+		n = snprintf(buf, sizeof(buf), "%.*s", (int)(method_size + 1 + url_size), s);
+	} else if (ri->method != NULL && ri->domain != NULL && ri->endpoint != NULL) {
+		n = snprintf(buf, sizeof(buf), "%.*s %.*s%.*s",
+		    (int)strcspn(ri->method, " \t"), ri->method,
+		    (int)strcspn(ri->domain, " \t"), ri->domain,
+		    (int)strcspn(ri->endpoint, " \t"), ri->endpoint);
+	} else {
+		n = 0;
+		buf[0] = '\0';
+	}
+
+	n = MIN(n, (int)sizeof(buf) - 1);
+	line->raw_request = strdup(buf);
+	if (line->raw_request == NULL)
+		err(1, "strdup");
+	line->raw_request_size = n;
+}
+
+static void
+init_bench_input(struct bench_input *in, const char *path)
+{
+	init_file_view_readonly(&in->log_view, path);
+	init_line_config(&in->lc, &in->log_view, NULL, "ipaddr,useragent");
+
+	struct line_config *lc = &in->lc;
+	const char *src = in->log_view.src;
+	const char *end = src + in->log_view.size;
+
+	size_t caplines = 1024;
+	in->nlines = 0;
+	in->lines = calloc(caplines, sizeof(*in->lines));
+	if (in->lines == NULL)
+		err(1, "calloc");
+
+	while (src < end && *src != '\0') {
+		const char *eol = memchr(src, '\n', end - src);
+		size_t size = eol != NULL ? (size_t)(eol - src) : strlen(src);
+
+		struct field_view fvs[NALL_FIELDS_MAX];
+		const char *endp;
+		size_t nfields = get_fields(fvs, NALL_FIELDS_MAX, src, 1, &endp);
+		if (nfields == lc->nall_fields) {
+			if (in->nlines == caplines) {
+				caplines *= 2;
+				in->lines = realloc(in->lines, caplines * sizeof(*in->lines));
+				if (in->lines == NULL)
+					err(1, "realloc");
+			}
+
+			struct bench_line *line = &in->lines[in->nlines++];
+			memset(line, 0, sizeof(*line));
+			line->src = src;
+			line->size = size;
+			for (size_t i = 0; i < lc->nscan_field_info; i++) {
+				struct field_info *fi = &lc->scan_field_info[i];
+				line->fvs[fi->type] = fvs[fi->index];
+			}
+			line->ri.request  = line->fvs[FIELD_REQUEST].src;
+			line->ri.method   = line->fvs[FIELD_METHOD].src;
+			line->ri.protocol = line->fvs[FIELD_PROTOCOL].src;
+			line->ri.domain   = line->fvs[FIELD_DOMAIN].src;
+			line->ri.endpoint = line->fvs[FIELD_ENDPOINT].src;
+			init_raw_request(line);
+		}
+
+		if (eol == NULL)
+			break;
+		src = eol + 1;
+	}
+}
+
+/* Writes truncate patterns into a temporary file, and loads them. */
+static void
+init_bench_truncate_patterns(struct truncate_patterns *tp, const char *patterns)
+{
+	char *path;
+	int fd = open_tmp_file("microbench_patterns", &path);
+	if (write(fd, patterns, strlen(patterns)) != (ssize_t)strlen(patterns))
+		err(1, "write");
+	close(fd);
+
+	init_truncate_patterns(tp, path);
+	unlink(path);
+	free(path);
+}
+
+static uint64_t
+sum_field_bytes(struct bench_input *in, enum field_type type)
+{
+	uint64_t nbytes = 0;
+	for (size_t i = 0; i < in->nlines; i++) {
+		struct field_view *fv = &in->lines[i].fvs[type];
+		if (fv->src == NULL)
+			continue;
+		if (type == FIELD_IPADDR)
+			nbytes += strcspn(fv->src, ": \t\n\v\r");
+		else
+			nbytes += fv->len;
+	}
+
+	return nbytes;
+}
+
+static uint64_t
+count_fields(struct bench_input *in, enum field_type type)
+{
+	uint64_t n = 0;
+	for (size_t i = 0; i < in->nlines; i++)
+		n += in->lines[i].fvs[type].src != NULL;
+
+	return n;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"microbench\n"
+"Microbenchmarks for apathy kernels\n"
+"\n"
+"    microbench [OPTIONS]\n"
+"\n"
+"OPTIONS:\n"
+"    -l <log>      Access log used as input (default: synthetic log)\n"
+"    -n <lines>    Number of synthetic log lines (default: 100000)\n"
+"    -t <ms>       Minimum run time per kernel in milliseconds (default: 200)\n"
+"    -k <kernel>   Only run kernels whose name contains <kernel>\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *log_path = NULL;
+	size_t nlines = 100000;
+	struct bench_opts opts = {
+		.min_ms = 200.0,
+		.filter = NULL
+	};
+
+	int c;
+	while ((c = getopt(argc, argv, "l:n:t:k:h")) != -1) {
+		switch (c) {
+		case 'l':
+			log_path = optarg;
+			break;
+		case 'n':
+			nlines = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			opts.min_ms = strtod(optarg, NULL);
+			break;
+		case 'k':
+			opts.filter = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			break;
+		}
+	}
+
+	char *tmp_path = NULL;
+	if (log_path == NULL) {
+		tmp_path = gen_bench_log(nlines);
+		log_path = tmp_path;
+	}
+
+	struct bench_input in;
+	init_field_scanner(FIELD_SCANNER_SCALAR);
+	init_bench_input(&in, log_path);
+	if (tmp_path != NULL)
+		unlink(tmp_path);
+
+	uint64_t nline_bytes = 0;
+	uint64_t nrequest_bytes = 0;
+	for (size_t i = 0; i < in.nlines; i++) {
+		nline_bytes += in.lines[i].size + 1;
+		nrequest_bytes += in.lines[i].raw_request_size;
+	}
+
+	printf("input: %s, %zu lines, %" PRIu64 " bytes\n\n", log_path,
+	    in.nlines, nline_bytes);
+	printf("%-24s %-10s %12s %12s %12s\n", "kernel", "variant", "ns/op",
+	    "cycles/byte", "MB/s");
+
+	/* Field scanners, up to the best one supported */
+	static const struct {
+		enum field_scanner scanner;
+		const char        *name;
+	} scanners[] = {
+		{ FIELD_SCANNER_SCALAR, "scalar" },
+		{ FIELD_SCANNER_SSE2,   "sse2"   },
+		{ FIELD_SCANNER_AVX2,   "avx2"   }
+	};
+	enum field_scanner best = best_field_scanner();
+	for (size_t s = 0; s < sizeof(scanners) / sizeof(scanners[0]); s++) {
+		init_field_scanner(scanners[s].scanner);
+		run_bench(&opts, &in, "get_fields", scanners[s].name,
+		    bench_get_fields, NULL, in.nlines, nline_bytes);
+		run_bench(&opts, &in, "get_fields/scan", scanners[s].name,
+		    bench_get_scan_fields, NULL, in.nlines, nline_bytes);
+		if (scanners[s].scanner == best)
+			break;
+	}
+	init_field_scanner(FIELD_SCANNER_AUTO);
+
+	/* Hashes */
+	enum field_type ua = FIELD_USERAGENT;
+	run_bench(&opts, &in, "hash64_update", "useragent",
+	    bench_hash64_update, &ua, count_fields(&in, ua),
+	    sum_field_bytes(&in, ua));
+	run_bench(&opts, &in, "hash64_update_ipaddr", "ipaddr",
+	    bench_hash64_update_ipaddr, NULL, count_fields(&in, FIELD_IPADDR),
+	    sum_field_bytes(&in, FIELD_IPADDR));
+
+	/* Timestamp parsers, for the time fields present in the log */
+	static enum field_type time_fields[] = {
+		FIELD_RFC3339, FIELD_RFC3339_NO_MS, FIELD_DATE, FIELD_TIME
+	};
+	for (size_t t = 0; t < sizeof(time_fields) / sizeof(time_fields[0]); t++) {
+		enum field_type type = time_fields[t];
+		uint64_t nops = count_fields(&in, type);
+		if (nops == 0)
+			continue;
+		run_bench(&opts, &in, "time", field_type_str(type), bench_time,
+		    &type, nops, sum_field_bytes(&in, type));
+	}
+
+	/* Truncation */
+	struct truncate_patterns tp_none, tp_regex, tp_builtin;
+	memset(&tp_none, 0, sizeof(tp_none));
+	init_bench_truncate_patterns(&tp_regex,
+	    "$UUID = [0-9a-fA-F]{8}\\-[0-9a-fA-F]{4}\\-[0-9a-fA-F]{4}\\-[0-9a-fA-F]{4}\\-[0-9a-fA-F]{12}\n");
+	init_bench_truncate_patterns(&tp_builtin, "$UUID\n");
+
+	static const struct {
+		const char *name;
+	} tp_names[] = { { "none" }, { "regex" }, { "builtin" } };
+	struct truncate_patterns *tps[] = { &tp_none, &tp_regex, &tp_builtin };
+
+	for (size_t v = 0; v < sizeof(tps) / sizeof(tps[0]); v++) {
+		run_bench(&opts, &in, "truncate_raw_request", tp_names[v].name,
+		    bench_truncate_raw_request, tps[v], in.nlines, nrequest_bytes);
+	}
+
+	/* Request set, in steady state after the warm-up pass */
+	for (size_t v = 0; v < sizeof(tps) / sizeof(tps[0]); v++) {
+		struct request_set_bench rsb;
+		init_request_set(&rsb.rs);
+		rsb.tp = tps[v];
+		run_bench(&opts, &in, "add_request_set_entry", tp_names[v].name,
+		    bench_add_request_set_entry, &rsb, in.nlines, nrequest_bytes);
+	}
+
+	return 0;
+}
@@ -0,0 +1,429 @@
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <ck_pr.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "file_view.h"
+#include "hash.h"
+#include "util.h"
+
+#define CACHE_MAGIC   "APATHYCC"
+#define CACHE_VERSION 1
+
+/* Raw requests or sessions claimed by a loader thread at a time. */
+#define CACHE_LOAD_BATCH 4096
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+/* Columns of a mapped cache file, loaded by a pool of threads. */
+struct cache_loader {
+	const uint64_t           *offsets;
+	const char               *data;
+	const char               *sids;         /* session_id_t, but only 8-byte aligned */
+	const uint64_t           *session_ends;
+	const uint64_t           *ts;
+	const uint32_t           *raw_rids;
+	uint64_t                  nrequests;
+	uint64_t                  nsessions;
+	struct request_set       *rs;
+	struct session_map       *sm;
+	struct truncate_patterns *tp;
+	request_id_t             *rid_map;      /* Raw request index to request ID */
+	uint64_t                  next_request; /* Index of next unclaimed raw request */
+	uint64_t                  next_session; /* Index of next unclaimed session */
+};
+
+static uint64_t
+hash_u64(uint64_t hash, uint64_t v)
+{
+	return hash64_update(hash, (const char *)&v, sizeof(v));
+}
+
+/*
+ * Hashes the path, size and modification time of each log, along with
+ * the fields read from each line, so that a cache is only used for
+ * the logs it was written from.
+ */
+uint64_t
+hash_cache_key(struct line_config *lc, struct input *inputs, size_t ninputs)
+{
+	assert(lc != NULL);
+	assert(inputs != NULL);
+
+	uint64_t hash = hash_line_config(hash64_init(), lc);
+	hash = hash_u64(hash, CACHE_VERSION);
+	hash = hash_u64(hash, sizeof(session_id_t));
+
+	for (size_t i = 0; i < ninputs; i++) {
+		struct input *input = &inputs[i];
+		if (input->fd != -1)
+			ERRX("can not cache '%s', only log files can be cached",
+			     input->path);
+
+		char *path = realpath(input->path, NULL);
+		if (path == NULL)
+			ERR("failed to resolve path of '%s'", input->path);
+
+		struct stat sb;
+		if (stat(path, &sb) == -1)
+			ERR("failed to read file status for %s", path);
+
+		hash = hash64_update(hash, path, strlen(path) + 1);
+		hash = hash_u64(hash, (uint64_t)sb.st_size);
+		hash = hash_u64(hash, (uint64_t)sb.st_mtim.tv_sec);
+		hash = hash_u64(hash, (uint64_t)sb.st_mtim.tv_nsec);
+
+		free(path);
+	}
+
+	return hash;
+}
+
+static void *
+run_request_loader(void *ctx)
+{
+	struct cache_loader *cl = ctx;
+
+	while (1) {
+		uint64_t start = ck_pr_faa_64(&cl->next_request, CACHE_LOAD_BATCH);
+		if (cl->nrequests <= start)
+			break;
+
+		uint64_t end = MIN(start + CACHE_LOAD_BATCH, cl->nrequests);
+		for (uint64_t i = start; i < end; i++) {
+			const char *raw = cl->data + cl->offsets[i];
+			size_t raw_size = cl->offsets[i + 1] - cl->offsets[i];
+			cl->rid_map[i] = add_raw_request(cl->rs, raw, raw_size,
+			    cl->tp);
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+static void *
+run_session_loader(void *ctx)
+{
+	struct cache_loader *cl = ctx;
+
+	/* Sessions are copied into the session map, so one buffer will do. */
+	size_t caprequests = 0;
+	struct session_request *requests = NULL;
+
+	while (1) {
+		uint64_t start = ck_pr_faa_64(&cl->next_session, CACHE_LOAD_BATCH);
+		if (cl->nsessions <= start)
+			break;
+
+		uint64_t end = MIN(start + CACHE_LOAD_BATCH, cl->nsessions);
+		for (uint64_t s = start; s < end; s++) {
+			uint64_t row = s == 0 ? 0 : cl->session_ends[s - 1];
+			size_t nrows = cl->session_ends[s] - row;
+
+			if (caprequests < nrows) {
+				free(requests);
+				caprequests = MAX(nrows, 2 * caprequests);
+				requests = calloc(caprequests, sizeof(*requests));
+				if (requests == NULL)
+					ERR("%s", "calloc");
+			}
+
+			for (size_t r = 0; r < nrows; r++, row++) {
+				uint32_t raw_rid = cl->raw_rids[row];
+				if (cl->nrequests <= raw_rid)
+					ERRX("%s", "corrupt cache file");
+				requests[r].rid = cl->rid_map[raw_rid];
+				requests[r].ts = cl->ts[row];
+			}
+
+			session_id_t sid;
+			memcpy(&sid, cl->sids + s * sizeof(sid), sizeof(sid));
+			add_session_map_entry(cl->sm, sid, requests, nrows);
+		}
+	}
+
+	free(requests);
+	pthread_exit(NULL);
+}
+
+/* Runs a loader function in nthreads threads, and waits for them. */
+static void
+run_cache_loaders(struct cache_loader *cl, void *(*fn)(void *), int nthreads)
+{
+	pthread_t threads[nthreads];
+	for (int tid = 0; tid < nthreads; tid++) {
+		if (pthread_create(&threads[tid], NULL, fn, cl) != 0)
+			ERR("%s", "pthread_create");
+	}
+
+	for (int tid = 0; tid < nthreads; tid++) {
+		if (pthread_join(threads[tid], NULL) != 0)
+			ERR("%s", "pthread_join");
+	}
+}
+
+/*
+ * Checks that the columns of a cache file add up to its size,
+ * and sets up a loader for them.
+ */
+static void
+init_cache_loader(struct cache_loader *cl, struct file_view *fv)
+{
+	const struct cache_header *header = (const struct cache_header *)fv->src;
+	uint64_t size = fv->size;
+
+	/* Each column is smaller than the file, so none of these overflow. */
+	if (size / 8 < header->nrequests || size < header->data_size
+	 || size / (sizeof(session_id_t) + 8) < header->nsessions
+	 || size / 12 < header->nrows)
+		ERRX("corrupt cache file at '%s'", fv->path);
+
+	uint64_t offsets_pos = sizeof(*header);
+	uint64_t data_pos = offsets_pos + 8 * (header->nrequests + 1);
+	uint64_t sids_pos = data_pos + ALIGN8(header->data_size);
+	uint64_t session_ends_pos = sids_pos
+	    + sizeof(session_id_t) * header->nsessions;
+	uint64_t ts_pos = session_ends_pos + 8 * header->nsessions;
+	uint64_t raw_rids_pos = ts_pos + 8 * header->nrows;
+	if (raw_rids_pos + 4 * header->nrows != size)
+		ERRX("corrupt cache file at '%s'", fv->path);
+
+	cl->offsets      = (const uint64_t *)(void *)(fv->src + offsets_pos);
+	cl->data         = fv->src + data_pos;
+	cl->sids         = fv->src + sids_pos;
+	cl->session_ends = (const uint64_t *)(void *)(fv->src + session_ends_pos);
+	cl->ts           = (const uint64_t *)(void *)(fv->src + ts_pos);
+	cl->raw_rids     = (const uint32_t *)(void *)(fv->src + raw_rids_pos);
+	cl->nrequests    = header->nrequests;
+	cl->nsessions    = header->nsessions;
+	cl->next_request = 0;
+	cl->next_session = 0;
+
+	for (uint64_t i = 0; i < header->nrequests; i++) {
+		if (cl->offsets[i + 1] < cl->offsets[i]
+		 || REQUEST_LEN_MAX < cl->offsets[i + 1] - cl->offsets[i])
+			ERRX("corrupt cache file at '%s'", fv->path);
+	}
+	if (cl->offsets[0] != 0 || cl->offsets[header->nrequests] != header->data_size)
+		ERRX("corrupt cache file at '%s'", fv->path);
+
+	uint64_t row = 0;
+	for (uint64_t s = 0; s < header->nsessions; s++) {
+		if (cl->session_ends[s] <= row)
+			ERRX("corrupt cache file at '%s'", fv->path);
+		row = cl->session_ends[s];
+	}
+	if (row != header->nrows)
+		ERRX("corrupt cache file at '%s'", fv->path);
+}
+
+/*
+ * Loads the requests and sessions of a cache file into an empty request
+ * set and session map, truncating the requests with the given patterns.
+ * Returns 0 if there is no cache file, or if it was written for other
+ * logs or another line config.
+ */
+int
+load_cache(const char *path, uint64_t key, struct request_set *rs,
+           struct session_map *sm, struct truncate_patterns *tp, int nthreads)
+{
+	assert(path != NULL);
+	assert(rs != NULL);
+	assert(sm != NULL);
+	assert(tp != NULL);
+
+	struct stat sb;
+	if (stat(path, &sb) == -1) {
+		if (errno == ENOENT)
+			return 0;
+		ERR("failed to read file status for %s", path);
+	}
+
+	struct file_view fv;
+	init_file_view_readonly(&fv, path);
+
+	const struct cache_header *header = (const struct cache_header *)fv.src;
+	if (fv.size < sizeof(*header)
+	 || memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0
+	 || header->version != CACHE_VERSION
+	 || header->key != key) {
+		free_file_view(&fv);
+		return 0;
+	}
+
+	struct cache_loader cl;
+	init_cache_loader(&cl, &fv);
+	cl.rs = rs;
+	cl.sm = sm;
+	cl.tp = tp;
+
+	cl.rid_map = calloc(MAX(cl.nrequests, 1), sizeof(*cl.rid_map));
+	if (cl.rid_map == NULL)
+		ERR("%s", "calloc");
+
+	if (nthreads <= 0) {
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0)
+			nthreads = 4;
+	}
+
+	/* All requests must be mapped before the sessions refer to them. */
+	run_cache_loaders(&cl, run_request_loader, nthreads);
+	run_cache_loaders(&cl, run_session_loader, nthreads);
+
+	free(cl.rid_map);
+	free_file_view(&fv);
+
+	return 1;
+}
+
+static void
+write_cache(FILE *f, const char *path, const void *data, size_t size)
+{
+	if (size != 0 && fwrite(data, size, 1, f) != 1)
+		ERR("failed to write cache file at '%s'", path);
+}
+
+static void
+write_cache_u64(FILE *f, const char *path, uint64_t v)
+{
+	write_cache(f, path, &v, sizeof(v));
+}
+
+/*
+ * Writes the raw requests of a request set, and the sessions referring
+ * to them, to a cache file. The file is written next to its final path,
+ * and then moved into place.
+ */
+void
+save_cache(const char *path, uint64_t key, struct request_set *raw_rs,
+           struct session_map *sm)
+{
+	assert(path != NULL);
+	assert(raw_rs != NULL);
+	assert(sm != NULL);
+
+	struct request_table rt;
+	gen_request_table(&rt, raw_rs);
+
+	if (UINT32_MAX < rt.nrequests) {
+		WARNX("too many distinct requests, not writing cache file at '%s'",
+		      path);
+		free_request_table(&rt);
+		return;
+	}
+
+	struct cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.key = key;
+	header.nrequests = rt.nrequests;
+	for (size_t i = 0; i < rt.nrequests; i++)
+		header.data_size += strlen(rt.requests[i]);
+
+	struct session_map_iter iter;
+	struct session_map_entry entry;
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry)) {
+		header.nsessions++;
+		header.nrows += entry.nrequests;
+	}
+
+	char tmp_path[strlen(path) + sizeof(".tmp")];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL)
+		ERR("failed to create cache file at '%s'", tmp_path);
+
+	write_cache(f, tmp_path, &header, sizeof(header));
+
+	uint64_t offset = 0;
+	write_cache_u64(f, tmp_path, offset);
+	for (size_t i = 0; i < rt.nrequests; i++) {
+		offset += strlen(rt.requests[i]);
+		write_cache_u64(f, tmp_path, offset);
+	}
+	for (size_t i = 0; i < rt.nrequests; i++)
+		write_cache(f, tmp_path, rt.requests[i], strlen(rt.requests[i]));
+
+	static const char padding[8];
+	write_cache(f, tmp_path, padding, ALIGN8(offset) - offset);
+
+	/* The sessions are visited in the same order for each column. */
+	free_session_map_iter(&iter);
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry))
+		write_cache(f, tmp_path, &entry.sid, sizeof(entry.sid));
+
+	uint64_t row = 0;
+	free_session_map_iter(&iter);
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry)) {
+		row += entry.nrequests;
+		write_cache_u64(f, tmp_path, row);
+	}
+
+	free_session_map_iter(&iter);
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry)) {
+		for (size_t r = 0; r < entry.nrequests; r++)
+			write_cache_u64(f, tmp_path, entry.requests[r].ts);
+	}
+
+	free_session_map_iter(&iter);
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry)) {
+		for (size_t r = 0; r < entry.nrequests; r++) {
+			uint32_t raw_rid = (uint32_t)entry.requests[r].rid;
+			write_cache(f, tmp_path, &raw_rid, sizeof(raw_rid));
+		}
+	}
+	free_session_map_iter(&iter);
+
+	if (fclose(f) != 0)
+		ERR("failed to write cache file at '%s'", tmp_path);
+	if (rename(tmp_path, path) == -1)
+		ERR("failed to replace cache file at '%s'", path);
+
+	free_request_table(&rt);
+}
+
+/*
+ * Truncates the raw requests of a scan into a request set, and makes
+ * the sessions refer to the truncated requests instead.
+ */
+void
+truncate_cached_requests(struct request_set *raw_rs, struct request_set *rs,
+                         struct session_map *sm, struct truncate_patterns *tp)
+{
+	assert(raw_rs != NULL);
+	assert(rs != NULL);
+	assert(sm != NULL);
+	assert(tp != NULL);
+
+	struct request_table rt;
+	gen_request_table(&rt, raw_rs);
+
+	request_id_t *rid_map = calloc(MAX(rt.nrequests, 1), sizeof(*rid_map));
+	if (rid_map == NULL)
+		ERR("%s", "calloc");
+
+	for (size_t i = 0; i < rt.nrequests; i++)
+		rid_map[i] = add_raw_request(rs, rt.requests[i],
+		    strlen(rt.requests[i]), tp);
+
+	remap_session_map_requests(sm, rid_map);
+
+	free(rid_map);
+	free_request_table(&rt);
+}
@@ -0,0 +1,44 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "field.h"
+#include "input.h"
+#include "request.h"
+#include "session.h"
+#include "truncate.h"
+
+/*
+ * Columnar cache of the records parsed from the logs, for analyzing
+ * the same logs again without parsing them.
+ *
+ * Requests are cached as they appear in the logs, so that later runs
+ * may truncate them with other patterns. All columns are aligned to
+ * 8 bytes, and are read straight from the mapped cache file:
+ *
+ *     header       magic, version, key and column lengths
+ *     offsets      uint64_t[nrequests + 1], of each raw request in data
+ *     data         raw requests, back to back
+ *     sids         session_id_t[nsessions], session IDs
+ *     session_ends uint64_t[nsessions], end of each session in the rows
+ *     ts           uint64_t[nrows], request timestamps, grouped by session
+ *     raw_rids     uint32_t[nrows], index of each raw request
+ */
+struct cache_header {
+	char     magic[8];
+	uint64_t version;
+	uint64_t key;       /* Hash of the logs and the line config */
+	uint64_t nrequests;
+	uint64_t data_size;
+	uint64_t nsessions;
+	uint64_t nrows;
+};
+
+uint64_t hash_cache_key(struct line_config *, struct input *, size_t);
+int      load_cache(const char *, uint64_t, struct request_set *, struct session_map *, struct truncate_patterns *, int);
+void     save_cache(const char *, uint64_t, struct request_set *, struct session_map *);
+void     truncate_cached_requests(struct request_set *, struct request_set *, struct session_map *, struct truncate_patterns *);
+
+#endif
@@ -82,26 +82,16 @@ void
 debug_request_set(struct request_set *rs)
 {
 	printf("----- BEGIN REQUEST SET -----\n");
-	uint64_t min_bucket_count = HASH_COUNT(rs->handles[0]);
-	uint64_t max_bucket_count = HASH_COUNT(rs->handles[0]);
-	uint64_t total_count = 0;
-	for (size_t i = 1; i < REQUEST_SET_NBUCKETS; i++) {
-		size_t bucket_count = HASH_COUNT(rs->handles[i]);
-		total_count += bucket_count;
-		if (bucket_count < min_bucket_count)
-			min_bucket_count = bucket_count;
-		if (max_bucket_count < bucket_count)
-			max_bucket_count = bucket_count;
-	}
-	printf("min_bucket_count: %" PRIu64 "\n", min_bucket_count);
-	printf("max_bucket_count: %" PRIu64 "\n", max_bucket_count);
-	printf("avg_bucket_count: %lf\n", (double)total_count / REQUEST_SET_NBUCKETS);
-	printf("total_count: %" PRIu64 "\n", total_count);
-	for (size_t i = 0; i < REQUEST_SET_NBUCKETS; i++) {
-		struct request_set_entry *entry, *tmp;
-		HASH_ITER(hh, rs->handles[i], entry, tmp) {
-			printf("%5" PRIu64 " %p \"%s\"\n", entry->rid, entry->data, entry->data);
-		}
+	struct request_set_table *table = rs->requests.table;
+	printf("cap: %zu\n", table->cap);
+	printf("nrequests: %" PRIu64 "\n", rs->requests.nentries);
+	printf("load: %lf\n", (double)rs->requests.nentries / (double)table->cap);
+	printf("nraw_requests: %" PRIu64 "\n", rs->raw_requests.nentries);
+	for (size_t i = 0; i < table->cap; i++) {
+		struct request_set_entry *entry = table->slots[i];
+		if (entry == NULL)
+			continue;
+		printf("%5" PRIu64 " %p \"%s\"\n", entry->rid, entry->data, entry->data);
 	}
 	printf("----- END REQUEST SET -----\n");
 }
@@ -119,36 +109,44 @@ void
 debug_session_map(struct session_map *sm)
 {
 	printf("----- BEGIN SESSION MAP -----\n");
-	uint64_t min_bucket_count = HASH_COUNT(sm->handles[0]);
-	uint64_t max_bucket_count = HASH_COUNT(sm->handles[0]);
+	uint64_t min_shard_count = sm->shards[0].nentries;
+	uint64_t max_shard_count = sm->shards[0].nentries;
 	uint64_t total_count = 0;
-	for (size_t i = 1; i < SESSION_MAP_NBUCKETS; i++) {
-		size_t bucket_count = HASH_COUNT(sm->handles[i]);
-		total_count += bucket_count;
-		if (bucket_count < min_bucket_count)
-			min_bucket_count = bucket_count;
-		if (max_bucket_count < bucket_count)
-			max_bucket_count = bucket_count;
+	uint64_t total_nslots = 0;
+	for (size_t i = 0; i < SESSION_MAP_NSHARDS; i++) {
+		size_t shard_count = sm->shards[i].nentries;
+		total_count += shard_count;
+		total_nslots += sm->shards[i].nslots;
+		if (shard_count < min_shard_count)
+			min_shard_count = shard_count;
+		if (max_shard_count < shard_count)
+			max_shard_count = shard_count;
 	}
-	printf("min_bucket_count: %" PRIu64 "\n", min_bucket_count);
-	printf("max_bucket_count: %" PRIu64 "\n", max_bucket_count);
-	printf("avg_bucket_count: %lf\n", (double)total_count / SESSION_MAP_NBUCKETS);
+	printf("min_shard_count: %" PRIu64 "\n", min_shard_count);
+	printf("max_shard_count: %" PRIu64 "\n", max_shard_count);
+	printf("avg_shard_count: %lf\n", (double)total_count / SESSION_MAP_NSHARDS);
 	printf("total_count: %" PRIu64 "\n", total_count);
+	printf("total_nslots: %" PRIu64 "\n", total_nslots);
 	size_t session_idx = 0;
-	for (size_t bucket_idx = 0; bucket_idx < SESSION_MAP_NBUCKETS; bucket_idx++) {
-		struct session_map_entry *entry, *tmp;
-		HASH_ITER(hh, sm->handles[bucket_idx], entry, tmp) {
-			printf("[%zu]:\n", session_idx);
-			printf("    sid: %016" PRIx64 "\n", entry->sid);
-			printf("    nrequests: %zu\n", entry->nrequests);
-			printf("    requests: %p\n", entry->requests);
-			for (size_t i = 0; i < entry->nrequests; i++) {
-				printf("        %" PRIu64 " %" PRIuRID "\n",
-				       entry->requests[i].ts / 1000, entry->requests[i].rid);
-			}
-			session_idx++;
+	struct session_map_iter iter;
+	struct session_map_entry entry;
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry)) {
+		printf("[%zu]:\n", session_idx);
+#ifdef SESSION_ID_128
+		printf("    sid: %016" PRIx64 "%016" PRIx64 "\n",
+		       (uint64_t)(entry.sid >> 64), (uint64_t)entry.sid);
+#else
+		printf("    sid: %016" PRIx64 "\n", entry.sid);
+#endif
+		printf("    nrequests: %zu\n", entry.nrequests);
+		for (size_t i = 0; i < entry.nrequests; i++) {
+			printf("        %" PRIu64 " %" PRIuRID "\n",
+			       entry.requests[i].ts / 1000, entry.requests[i].rid);
 		}
+		session_idx++;
 	}
+	free_session_map_iter(&iter);
 	printf("----- END SESSION MAP -----\n");
 }
 
@@ -99,8 +99,10 @@ output_dot_graph(FILE *out, struct path_graph *pg, struct request_table *rt)
 	uint64_t subgraph_id = 0;
 	while (v < pg->capvertices) {
 		vertex = &pg->vertices[v];
-		if (is_null_vertex(vertex))
+		if (is_null_vertex(vertex)) {
+			v++;
 			continue;
+		}
 
 		if (open_subgraph) {
 			fprintf(out,
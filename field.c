@@ -1,9 +1,11 @@
 #include <assert.h>
 #include <regex.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "field.h"
+#include "hash.h"
 #include "regex.h"
 #include "util.h"
 
@@ -71,8 +73,8 @@ static const char *FIELD_PATTERNS[NFIELD_TYPES] = {
  *
  * TODO: use strspn(3), strcspn(3)
  */
-size_t
-get_fields(struct field_view *fvs, int max_fields, const char *src,
+static size_t
+get_fields_scalar(struct field_view *fvs, int max_fields, const char *src,
            int skip_line_seek, const char **endp)
 {
 	assert(fvs != NULL);
@@ -181,6 +183,455 @@ fill_fields:
 	}
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+#define FIELD_SCANNER_X86 1
+#else
+#define FIELD_SCANNER_X86 0
+#endif
+
+#if FIELD_SCANNER_X86
+#include <immintrin.h>
+
+/*
+ * Block-oriented field scanning.
+ *
+ * Instead of running every byte through the state machine above,
+ * the vectorized scanners classify one aligned 64-byte block at a time
+ * into bit masks, one bit per byte, and then jump directly from one
+ * interesting byte to the next with a count-trailing-zeros.
+ *
+ * Blocks are always loaded from 64-byte aligned addresses, so a load
+ * never crosses a page boundary, and thus never faults even when it
+ * reads past the terminating '\0' of the memory-mapped log.
+ */
+#define FIELD_BLOCK_SIZE 64
+
+struct field_block_masks {
+	uint64_t ws;    /* ' ', '\t', '\v' */
+	uint64_t quote; /* '"' */
+	uint64_t end;   /* '\n', '\0' */
+};
+
+typedef void (*classify_block_fn)(const char *, struct field_block_masks *);
+
+struct field_block {
+	const char              *base;  /* Aligned start of current block */
+	struct field_block_masks masks;
+	classify_block_fn        classify;
+};
+
+enum field_block_sel {
+	FIELD_BLOCK_SEL_END,
+	FIELD_BLOCK_SEL_NON_WS,
+	FIELD_BLOCK_SEL_STANDALONE_END,
+	FIELD_BLOCK_SEL_QUOTED_END
+};
+
+__attribute__((target("sse2")))
+static void
+classify_block_sse2(const char *block, struct field_block_masks *masks)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab   = _mm_set1_epi8('\t');
+	const __m128i vtab  = _mm_set1_epi8('\v');
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i nl    = _mm_set1_epi8('\n');
+	const __m128i nul   = _mm_setzero_si128();
+
+	masks->ws = 0;
+	masks->quote = 0;
+	masks->end = 0;
+
+	for (int i = 0; i < FIELD_BLOCK_SIZE; i += 16) {
+		__m128i v = _mm_load_si128((const __m128i *)(const void *)(block + i));
+		__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, vtab)));
+		__m128i end = _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+		    _mm_cmpeq_epi8(v, nul));
+
+		masks->ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << i;
+		masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+		    _mm_cmpeq_epi8(v, quote)) << i;
+		masks->end |= (uint64_t)(uint16_t)_mm_movemask_epi8(end) << i;
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+classify_block_avx2(const char *block, struct field_block_masks *masks)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i tab   = _mm256_set1_epi8('\t');
+	const __m256i vtab  = _mm256_set1_epi8('\v');
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i nl    = _mm256_set1_epi8('\n');
+	const __m256i nul   = _mm256_setzero_si256();
+
+	masks->ws = 0;
+	masks->quote = 0;
+	masks->end = 0;
+
+	for (int i = 0; i < FIELD_BLOCK_SIZE; i += 32) {
+		__m256i v = _mm256_load_si256((const __m256i *)(const void *)(block + i));
+		__m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+		    _mm256_cmpeq_epi8(v, vtab)));
+		__m256i end = _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+		    _mm256_cmpeq_epi8(v, nul));
+
+		masks->ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << i;
+		masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(v, quote)) << i;
+		masks->end |= (uint64_t)(uint32_t)_mm256_movemask_epi8(end) << i;
+	}
+}
+
+static void
+load_field_block(struct field_block *fb, const char *s)
+{
+	fb->base = (const char *)((uintptr_t)s & ~(uintptr_t)(FIELD_BLOCK_SIZE - 1));
+	fb->classify(fb->base, &fb->masks);
+}
+
+/*
+ * Returns a pointer to the first byte at or after s that belongs to
+ * the byte class selected by sel. Always terminates, since every
+ * class includes the '\0' byte.
+ */
+static const char *
+seek_field_block(struct field_block *fb, const char *s, enum field_block_sel sel)
+{
+	while (1) {
+		if (fb->base + FIELD_BLOCK_SIZE <= s)
+			load_field_block(fb, s);
+
+		uint64_t mask;
+		switch (sel) {
+		case FIELD_BLOCK_SEL_END:
+			mask = fb->masks.end;
+			break;
+		case FIELD_BLOCK_SEL_NON_WS:
+			mask = ~fb->masks.ws;
+			break;
+		case FIELD_BLOCK_SEL_STANDALONE_END:
+			mask = fb->masks.ws | fb->masks.end;
+			break;
+		case FIELD_BLOCK_SEL_QUOTED_END:
+			mask = fb->masks.quote | fb->masks.end;
+			break;
+		default:
+			assert(0 && "NOTREACHED");
+			mask = 0;
+			break;
+		}
+
+		mask >>= (size_t)(s - fb->base);
+		if (mask != 0)
+			return s + __builtin_ctzll(mask);
+
+		s = fb->base + FIELD_BLOCK_SIZE;
+	}
+}
+
+/*
+ * Same as get_fields_scalar(), but with the byte classification done
+ * by fb->classify one block at a time.
+ */
+static size_t
+get_fields_block(struct field_view *fvs, int max_fields, const char *src,
+                 int skip_line_seek, const char **endp, classify_block_fn classify)
+{
+	assert(fvs != NULL);
+	assert(0 < max_fields);
+	assert(src != NULL);
+	assert(endp != NULL);
+
+	struct field_block fb = { .classify = classify };
+	load_field_block(&fb, src);
+
+	int nfields = 0;
+	const char *s = src;
+
+	if (!skip_line_seek)
+		s = seek_field_block(&fb, s, FIELD_BLOCK_SEL_END) + 1;
+
+	while (1) {
+		if (nfields == max_fields) {
+			*endp = s;
+			return nfields;
+		}
+
+		s = seek_field_block(&fb, s, FIELD_BLOCK_SEL_NON_WS);
+
+		const char *e;
+		struct field_view *fv = &fvs[nfields];
+		switch (*s) {
+		case '\0':
+			*endp = NULL;
+			return nfields;
+		case '\n':
+			*endp = s;
+			return nfields;
+		case '"':
+			s++;
+			fv->src = s;
+			nfields++;
+			if (nfields == max_fields) {
+				fv->len = 0;
+				*endp = s;
+				return nfields;
+			}
+
+			e = seek_field_block(&fb, s, FIELD_BLOCK_SEL_QUOTED_END);
+			fv->len = e - s;
+			if (*e == '"') {
+				s = e + 1;
+				continue;
+			}
+			break;
+		default:
+			fv->src = s;
+			nfields++;
+			if (nfields == max_fields) {
+				fv->len = 1;
+				*endp = s + 1;
+				return nfields;
+			}
+
+			e = seek_field_block(&fb, s + 1, FIELD_BLOCK_SEL_STANDALONE_END);
+			fv->len = e - s;
+			if (*e != '\n' && *e != '\0') {
+				s = e + 1;
+				continue;
+			}
+			break;
+		}
+
+		*endp = *e == '\0' ? NULL : e;
+		return nfields;
+	}
+}
+
+static size_t
+get_fields_sse2(struct field_view *fvs, int max_fields, const char *src,
+                int skip_line_seek, const char **endp)
+{
+	return get_fields_block(fvs, max_fields, src, skip_line_seek, endp,
+	    classify_block_sse2);
+}
+
+static size_t
+get_fields_avx2(struct field_view *fvs, int max_fields, const char *src,
+                int skip_line_seek, const char **endp)
+{
+	return get_fields_block(fvs, max_fields, src, skip_line_seek, endp,
+	    classify_block_avx2);
+}
+#endif
+
+typedef size_t (*get_fields_fn)(struct field_view *, int, const char *, int, const char **);
+
+static get_fields_fn get_fields_impl = get_fields_scalar;
+static get_fields_fn get_fields_check_impl = get_fields_scalar;
+
+/*
+ * Runs both the scalar scanner and the best available accelerated
+ * scanner on the same input, and exits if their results differ.
+ */
+static size_t
+get_fields_check(struct field_view *fvs, int max_fields, const char *src,
+                 int skip_line_seek, const char **endp)
+{
+	assert(max_fields <= NALL_FIELDS_MAX + 1);
+
+	struct field_view check_fvs[NALL_FIELDS_MAX + 1];
+	const char *check_endp;
+
+	size_t nfields = get_fields_scalar(fvs, max_fields, src, skip_line_seek, endp);
+	size_t check_nfields = get_fields_check_impl(check_fvs, max_fields, src,
+	    skip_line_seek, &check_endp);
+
+	int ok = nfields == check_nfields && *endp == check_endp;
+	for (size_t i = 0; ok && i < nfields; i++) {
+		ok = fvs[i].src == check_fvs[i].src
+		  && fvs[i].len == check_fvs[i].len;
+	}
+
+	if (!ok)
+		ERRX("field scanner mismatch on line at %p: %zu fields vs %zu",
+		    (const void *)src, nfields, check_nfields);
+
+	return nfields;
+}
+
+/* Returns the fastest scanner supported by the CPU. */
+enum field_scanner
+best_field_scanner(void)
+{
+#if FIELD_SCANNER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return FIELD_SCANNER_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return FIELD_SCANNER_SSE2;
+#endif
+	return FIELD_SCANNER_SCALAR;
+}
+
+static get_fields_fn
+field_scanner_fn(enum field_scanner scanner)
+{
+	switch (scanner) {
+	case FIELD_SCANNER_SCALAR:
+		return get_fields_scalar;
+#if FIELD_SCANNER_X86
+	case FIELD_SCANNER_SSE2:
+		return get_fields_sse2;
+	case FIELD_SCANNER_AVX2:
+		return get_fields_avx2;
+#else
+	case FIELD_SCANNER_SSE2:
+	case FIELD_SCANNER_AVX2:
+		return NULL;
+#endif
+	case FIELD_SCANNER_CHECK:
+		return get_fields_check;
+	case FIELD_SCANNER_AUTO:
+	case FIELD_SCANNER_INVALID:
+	default:
+		return NULL;
+	}
+}
+
+enum field_scanner
+str_to_field_scanner(const char *s)
+{
+	static const struct {
+		const char *name;
+		enum field_scanner scanner;
+	} table[] = {
+	    { "auto",   FIELD_SCANNER_AUTO   },
+	    { "scalar", FIELD_SCANNER_SCALAR },
+	    { "sse2",   FIELD_SCANNER_SSE2   },
+	    { "avx2",   FIELD_SCANNER_AVX2   },
+	    { "check",  FIELD_SCANNER_CHECK  }
+	};
+
+	for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+		if (strcmp(table[i].name, s) == 0)
+			return table[i].scanner;
+	}
+
+	return FIELD_SCANNER_INVALID;
+}
+
+/*
+ * Selects the implementation used by get_fields().
+ * FIELD_SCANNER_AUTO picks the widest scanner supported by the CPU.
+ */
+void
+init_field_scanner(enum field_scanner scanner)
+{
+	enum field_scanner best = best_field_scanner();
+
+	if (scanner == FIELD_SCANNER_AUTO)
+		scanner = best;
+
+	if (scanner == FIELD_SCANNER_AVX2 && best != FIELD_SCANNER_AVX2)
+		ERRX("%s", "AVX2 field scanner not supported on this CPU");
+	if (scanner == FIELD_SCANNER_SSE2 && best == FIELD_SCANNER_SCALAR)
+		ERRX("%s", "SSE2 field scanner not supported on this CPU");
+
+	get_fields_impl = field_scanner_fn(scanner);
+	get_fields_check_impl = field_scanner_fn(best);
+	assert(get_fields_impl != NULL);
+	assert(get_fields_check_impl != NULL);
+}
+
+/*
+ * Splits one line into fields with the scanner selected by
+ * init_field_scanner(). See get_fields_scalar() for details.
+ */
+size_t
+get_fields(struct field_view *fvs, int max_fields, const char *src,
+           int skip_line_seek, const char **endp)
+{
+	return get_fields_impl(fvs, max_fields, src, skip_line_seek, endp);
+}
+
+void
+init_field_cursor(struct field_cursor *fc, struct line_config *lc,
+                  const char *src, const char *end, int skip_line_seek)
+{
+	assert(fc != NULL);
+	assert(lc != NULL);
+	assert(src != NULL);
+	assert(end != NULL);
+	assert(0 < lc->nscan_fields && lc->nscan_fields <= lc->nall_fields);
+
+	fc->src = src;
+	fc->end = end;
+	fc->skip_line_seek = skip_line_seek;
+	fc->lc = lc;
+}
+
+/*
+ * Reads the next line at the cursor, and fills *fvs with the fields
+ * listed in the scan field info of the line config, in the same order.
+ *
+ * The line is tokenized only until it is known to have as many fields
+ * as the first line; the rest of the line is skipped with memchr(3).
+ * Because of this, lines with extra columns past the ones we need are
+ * not rejected, but lines with missing columns still are.
+ *
+ * Returns 1 if all scan fields were found, or 0 if the line should be
+ * skipped. Sets fc->src to NULL once the end of the area is reached.
+ */
+int
+next_scan_fields(struct field_cursor *fc, struct field_view *fvs)
+{
+	assert(fc != NULL);
+	assert(fc->src != NULL);
+	assert(fvs != NULL);
+
+	struct line_config *lc = fc->lc;
+	struct field_view line_fvs[NALL_FIELDS_MAX + 1];
+	const char *endp;
+
+	/*
+	 * Ask for every field of a well-formed line, so that a short line
+	 * is read to its end and rejected below. If we need every column,
+	 * ask for one field more, so that the last needed field is always
+	 * read to its end, and a wider line can be told apart.
+	 */
+	int max_fields = lc->nall_fields;
+	if (lc->nscan_fields == lc->nall_fields)
+		max_fields++;
+
+	size_t nfields = get_fields(line_fvs, max_fields, fc->src,
+	    fc->skip_line_seek, &endp);
+	fc->skip_line_seek = 0;
+
+	if (nfields == (size_t)max_fields) {
+		/* Skip the columns we don't need. */
+		fc->src = memchr(endp, '\n', fc->end - endp);
+
+		/* If we need every column, the line is wider than expected. */
+		if (lc->nscan_fields == lc->nall_fields)
+			return 0;
+	} else {
+		/* We saw the whole line, so we can check its width. */
+		fc->src = endp;
+		if (nfields != lc->nall_fields)
+			return 0;
+	}
+
+	for (size_t i = 0; i < lc->nscan_field_info; i++)
+		fvs[i] = line_fvs[lc->scan_field_info[i].index];
+
+	return 1;
+}
+
 const char *
 field_type_str(enum field_type ftype)
 {
@@ -330,6 +781,11 @@ init_scan_fields(struct line_config *lc)
 
 	if (is_field_set(lc, FIELD_PROTOCOL))
 		set_scan_field(lc, FIELD_PROTOCOL);
+
+	for (size_t i = 0; i < lc->nscan_field_info; i++) {
+		size_t nfields = lc->scan_field_info[i].index + 1;
+		lc->nscan_fields = MAX(lc->nscan_fields, nfields);
+	}
 }
 
 static void override_line_config(struct line_config *, const char *);
@@ -387,7 +843,8 @@ init_line_config(struct line_config *lc, struct file_view *log_view,
 	*lc = (struct line_config){
 	    .nall_fields       = 0,
 	    .ntotal_field_info = 0,
-	    .nscan_field_info  = 0
+	    .nscan_field_info  = 0,
+	    .nscan_fields      = 0
 	};
 
 	static const struct field_info null_field_info = {
@@ -506,3 +963,29 @@ override_line_config(struct line_config *lc, const char *index_fields)
 		lc->ntotal_field_info++;
 	}
 }
+
+/*
+ * Adds the fields read from each line, and whether they are part of
+ * the session ID, to a hash.
+ */
+uint64_t
+hash_line_config(uint64_t hash, struct line_config *lc)
+{
+	assert(lc != NULL);
+
+	uint64_t v = lc->nscan_field_info;
+	hash = hash64_update(hash, (const char *)&v, sizeof(v));
+	for (size_t i = 0; i < lc->nscan_field_info; i++) {
+		struct field_info *fi = &lc->scan_field_info[i];
+		uint64_t vs[3] = {
+			fi->type,
+			(uint64_t)fi->index,
+			(uint64_t)fi->is_session
+		};
+		for (size_t j = 0; j < 3; j++)
+			hash = hash64_update(hash, (const char *)&vs[j],
+			    sizeof(vs[j]));
+	}
+
+	return hash;
+}
@@ -1,6 +1,8 @@
 #ifndef FIELD_H
 #define FIELD_H
 
+#include <stdint.h>
+
 #include "file_view.h"
 #include "regex.h"
 
@@ -24,6 +26,17 @@ enum field_type {
 	FIELD_UNKNOWN
 };
 
+/* Implementations of get_fields(), see init_field_scanner(). */
+enum field_scanner {
+	FIELD_SCANNER_AUTO = 0,
+	FIELD_SCANNER_SCALAR,
+	FIELD_SCANNER_SSE2,
+	FIELD_SCANNER_AVX2,
+	FIELD_SCANNER_CHECK, /* Scalar, cross-checked against the best accelerated scanner */
+
+	FIELD_SCANNER_INVALID
+};
+
 struct field_view {
 	int         len;
 	const char *src;
@@ -49,12 +62,27 @@ struct line_config {
 
 	size_t nscan_field_info;
 	struct field_info scan_field_info[NFIELD_TYPES];
+	size_t nscan_fields; /* Highest scan field index plus one */
+};
+
+/* Line cursor over a memory area, see next_scan_fields(). */
+struct field_cursor {
+	const char         *src; /* Current position, or NULL at the end */
+	const char         *end; /* End of the memory area */
+	int                 skip_line_seek;
+	struct line_config *lc;
 };
 
+void        init_field_scanner(enum field_scanner);
+enum        field_scanner best_field_scanner(void);
+enum        field_scanner str_to_field_scanner(const char *);
 size_t      get_fields(struct field_view *, int, const char *, int , const char **);
+void        init_field_cursor(struct field_cursor *, struct line_config *, const char *, const char *, int);
+int         next_scan_fields(struct field_cursor *, struct field_view *);
 enum        field_type infer_field_type(struct line_config *, struct field_view *);
 const char *field_type_str(enum field_type);
 void        amend_line_config(struct line_config *, enum field_type, size_t);
 void        init_line_config(struct line_config *, struct file_view *, const char *, const char *);
+uint64_t    hash_line_config(uint64_t, struct line_config *);
 
 #endif
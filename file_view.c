@@ -9,17 +9,13 @@
 #include "util.h"
 
 static void *
-mmap_file(const char *path, size_t *sizep, int prot)
+mmap_fd(int fd, const char *path, size_t *sizep, int prot)
 {
 	assert(path != NULL);
 	assert(sizep != NULL);
 
 	struct stat sb;
 
-	int fd = open(path, O_RDONLY);
-	if (fd == -1)
-		ERR( "failed to open file at '%s'", path);
-
 	if (fstat(fd, &sb) == -1)
 		ERR( "failed to read file status for %s", path);
 
@@ -31,6 +27,19 @@ mmap_file(const char *path, size_t *sizep, int prot)
 	return p;
 }
 
+static void *
+mmap_file(const char *path, size_t *sizep, int prot)
+{
+	assert(path != NULL);
+	assert(sizep != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		ERR( "failed to open file at '%s'", path);
+
+	return mmap_fd(fd, path, sizep, prot);
+}
+
 void
 init_file_view_readonly(struct file_view *file_view, const char *path)
 {
@@ -44,3 +53,18 @@ init_file_view_readwrite(struct file_view *file_view, const char *path)
 	file_view->src = mmap_file(path, &file_view->size, PROT_READ | PROT_WRITE);
 	file_view->path = path;
 }
+
+/* Maps the current contents of an open file, which may still grow. */
+void
+init_file_view_fd(struct file_view *file_view, int fd, const char *path)
+{
+	file_view->src = mmap_fd(fd, path, &file_view->size, PROT_READ);
+	file_view->path = path;
+}
+
+void
+free_file_view(struct file_view *file_view)
+{
+	if (munmap(file_view->src, file_view->size + 1) == -1)
+		ERR("failed to unmap %s", file_view->path);
+}
@@ -9,5 +9,7 @@ struct file_view {
 
 void init_file_view_readonly(struct file_view *, const char *);
 void init_file_view_readwrite(struct file_view *, const char *);
+void init_file_view_fd(struct file_view *, int, const char *);
+void free_file_view(struct file_view *);
 
 #endif
@@ -0,0 +1,271 @@
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "follow.h"
+#include "util.h"
+
+static uint64_t
+get_follow_clock_ms(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		ERR("%s", "clock_gettime");
+
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * Opens the file at the path of a followed input.
+ * Returns 0 if there is no file at the path, such as in the middle
+ * of a rotation.
+ */
+static int
+open_follow_input(struct follow_input *fi)
+{
+	struct input *input = fi->input;
+
+	int fd = open(input->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		ERR("failed to open file at '%s'", input->path);
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1)
+		ERR("failed to read file status for %s", input->path);
+
+	fi->fd = fd;
+	fi->dev = sb.st_dev;
+	fi->ino = sb.st_ino;
+
+	return 1;
+}
+
+/* Maps the current contents of a followed input. */
+static void
+remap_follow_input(struct follow_input *fi)
+{
+	struct input *input = fi->input;
+
+	free_file_view(&input->view);
+	init_file_view_fd(&input->view, fi->fd, input->path);
+	input->head = input->view;
+}
+
+/* Returns 1 if the path of a followed input now refers to another file. */
+static int
+is_follow_input_rotated(struct follow_input *fi)
+{
+	struct stat sb;
+	if (stat(fi->input->path, &sb) == -1)
+		return 0;
+
+	return sb.st_dev != fi->dev || sb.st_ino != fi->ino;
+}
+
+#ifdef __linux__
+/*
+ * Watches the directories of the followed inputs, which report
+ * both appends to the files and new files replacing them.
+ */
+static void
+init_follow_inotify(struct follow *follow)
+{
+	follow->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (follow->inotify_fd == -1) {
+		WARN("%s", "inotify_init1, checking logs at each output instead");
+		return;
+	}
+
+	for (size_t i = 0; i < follow->ninputs; i++) {
+		char *path = strdup(follow->inputs[i].input->path);
+		if (path == NULL)
+			ERR("%s", "strdup");
+
+		const char *dir = dirname(path);
+		uint32_t mask = IN_MODIFY | IN_CREATE | IN_MOVED_TO;
+		if (inotify_add_watch(follow->inotify_fd, dir, mask) == -1)
+			ERR("failed to watch directory '%s'", dir);
+
+		free(path);
+	}
+}
+#endif
+
+/*
+ * Starts following the uncompressed log files among the inputs,
+ * writing output every interval_ms milliseconds.
+ */
+void
+init_follow(struct follow *follow, struct input *inputs, size_t ninputs,
+            uint64_t interval_ms)
+{
+	assert(follow != NULL);
+	assert(inputs != NULL);
+	assert(0 < interval_ms);
+
+	follow->all_inputs     = inputs;
+	follow->nall_inputs    = ninputs;
+	follow->ninputs        = 0;
+	follow->inotify_fd     = -1;
+	follow->interval_ms    = interval_ms;
+	follow->next_output_ms = 0;
+
+	follow->inputs = calloc(ninputs, sizeof(*follow->inputs));
+	if (follow->inputs == NULL)
+		ERR("%s", "calloc");
+
+	for (size_t i = 0; i < ninputs; i++) {
+		struct input *input = &inputs[i];
+		if (input->type != INPUT_MAPPED || input->fd != -1)
+			continue;
+
+		struct follow_input *fi = &follow->inputs[follow->ninputs];
+		fi->input = input;
+		if (!open_follow_input(fi))
+			ERR("failed to open file at '%s'", input->path);
+		follow->ninputs++;
+
+		/* Scan the file as it is now, up to its last complete line. */
+		remap_follow_input(fi);
+		trim_input_partial_line(input);
+	}
+
+	if (follow->ninputs == 0)
+		ERRX("%s", "no uncompressed log files to follow");
+
+#ifdef __linux__
+	init_follow_inotify(follow);
+#endif
+}
+
+/*
+ * Returns 1 if it is time to write output, and schedules the next one.
+ */
+int
+is_follow_output_due(struct follow *follow)
+{
+	assert(follow != NULL);
+
+	uint64_t now_ms = get_follow_clock_ms();
+	if (now_ms < follow->next_output_ms)
+		return 0;
+
+	follow->next_output_ms = now_ms + follow->interval_ms;
+	return 1;
+}
+
+/*
+ * Waits until a followed log may have changed, or until it is time
+ * to write output.
+ */
+void
+wait_follow(struct follow *follow)
+{
+	assert(follow != NULL);
+
+	uint64_t now_ms = get_follow_clock_ms();
+	if (follow->next_output_ms <= now_ms)
+		return;
+
+	int timeout_ms = (int)MIN(follow->next_output_ms - now_ms, INT32_MAX);
+	struct pollfd pfd = {
+		.fd     = follow->inotify_fd,
+		.events = POLLIN
+	};
+
+	/* Without inotify, this only sleeps. */
+	int rc = poll(&pfd, follow->inotify_fd == -1 ? 0 : 1, timeout_ms);
+	if (rc == -1 && errno != EINTR)
+		ERR("%s", "poll");
+
+	/* Events only wake us up, so they are just drained. */
+	if (0 < rc) {
+		char buf[4096];
+		while (0 < read(follow->inotify_fd, buf, sizeof(buf)))
+			continue;
+	}
+}
+
+/*
+ * Sets the scan range of a followed input to the lines appended since
+ * the last scan. Returns 1 if there are any.
+ */
+static int
+update_follow_input(struct follow_input *fi)
+{
+	struct input *input = fi->input;
+
+	struct stat sb;
+	if (fstat(fi->fd, &sb) == -1)
+		ERR("failed to read file status for %s", input->path);
+
+	input->scan_start = input->scan_end;
+	if ((size_t)sb.st_size < input->scan_end) {
+		WARNX("%s was truncated, reading it from the start",
+		      input->path);
+		input->scan_start = 0;
+	}
+
+	if ((size_t)sb.st_size != input->view.size)
+		remap_follow_input(fi);
+	trim_input_partial_line(input);
+
+	/*
+	 * Switch to the new file only after the old one has been read
+	 * to its end, so that no lines are lost in the rotation.
+	 * A partial line at the end of the old file is read as it is,
+	 * since it will not be written to anymore.
+	 */
+	if (input->scan_start == input->scan_end
+	 && is_follow_input_rotated(fi)) {
+		int old_fd = fi->fd;
+		if (input->scan_end < input->view.size)
+			input->scan_end = input->view.size;
+		else if (open_follow_input(fi)) {
+			close(old_fd);
+			remap_follow_input(fi);
+			input->scan_start = 0;
+			input->scan_end = 0;
+			trim_input_partial_line(input);
+		}
+	}
+
+	input->skip = input->scan_start == input->scan_end;
+	return !input->skip;
+}
+
+/*
+ * Prepares the inputs for scanning the lines appended since the
+ * last scan. Inputs that are not followed are skipped, since they
+ * have been read in full already.
+ * Returns 1 if there is anything to scan.
+ */
+int
+update_follow(struct follow *follow)
+{
+	assert(follow != NULL);
+
+	for (size_t i = 0; i < follow->nall_inputs; i++)
+		follow->all_inputs[i].skip = 1;
+
+	int has_lines = 0;
+	for (size_t i = 0; i < follow->ninputs; i++)
+		has_lines |= update_follow_input(&follow->inputs[i]);
+
+	return has_lines;
+}
@@ -0,0 +1,46 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "input.h"
+
+/* Uncompressed log file being followed. */
+struct follow_input {
+	struct input *input;
+	int           fd;  /* Open file, still readable after a rotation */
+	dev_t         dev;
+	ino_t         ino;
+};
+
+/*
+ * Watches uncompressed log files for appended lines, like tail -F,
+ * and schedules output at a fixed interval.
+ *
+ * After each wakeup, the scan range of each followed input is moved
+ * past the lines scanned so far, up to the last complete line.
+ * A log that is rotated is read to its end, after which the new file
+ * at the same path is read from the start. A log that is truncated
+ * in place is also read again from the start.
+ *
+ * Other inputs are only read once.
+ */
+struct follow {
+	struct input        *all_inputs;
+	size_t               nall_inputs;
+	size_t               ninputs;
+	struct follow_input *inputs;
+	int                  inotify_fd;     /* -1 if not available */
+	uint64_t             interval_ms;    /* Time between outputs */
+	uint64_t             next_output_ms; /* Monotonic time of next output */
+};
+
+void init_follow(struct follow *, struct input *, size_t, uint64_t);
+int  is_follow_output_due(struct follow *);
+void wait_follow(struct follow *);
+int  update_follow(struct follow *);
+
+#endif
@@ -1,33 +1,132 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "hash.h"
 
 /*
- * We use the FNV-1a hash algorithm for constructing session IDs
- * due to its simplicity.
+ * We use a hash in the style of wyhash for session IDs and requests.
+ * It reads 16 bytes per step, or 48 bytes in three independent lanes
+ * for longer inputs such as user agents, and mixes them with 64x64 to
+ * 128-bit multiplications.
  *
- * http://www.isthe.com/chongo/tech/comp/fnv/
+ * https://github.com/wangyi-fudan/wyhash
  *
- * TODO: use GCC optimization with shifts, inline
+ * Hashes are chained by using the previous hash as the seed, so that
+ * several fields can be hashed into one value.
  */
-#define FNV_PRIME64 1099511628211ULL
-#define FNV_BASIS64 14695981039346656037ULL
+static const uint64_t hash_secret[4] = {
+	0x2d358dccaa6c78a5ULL,
+	0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL,
+	0x4d5a2da51de1aa47ULL
+};
+
+#define HASH64_BASIS 14695981039346656037ULL
+
+/* Multiplies a and b, leaving the low and high halves of the result in them. */
+static void
+mum64(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, la = (uint32_t)*a;
+	uint64_t hb = *b >> 32, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32);
+	uint64_t c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t
+mix64(uint64_t a, uint64_t b)
+{
+	mum64(&a, &b);
+	return a ^ b;
+}
+
+static uint64_t
+read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t
+read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
 uint64_t
 hash64_init(void)
 {
-	return FNV_BASIS64;
+	return HASH64_BASIS;
 }
 
 uint64_t
 hash64_update(uint64_t hash, const char *s, size_t len)
 {
-	for (size_t i = 0; i < len; i++) {
-		/* TODO: use GCC optimization with shifts */
-		hash ^= s[i];
-		hash *= FNV_PRIME64;
+	const unsigned char *p = (const unsigned char *)s;
+	uint64_t seed = hash ^ mix64(hash ^ hash_secret[0], hash_secret[1]);
+	uint64_t a, b;
+
+	if (len <= 16) {
+		if (4 <= len) {
+			size_t off = (len >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + off);
+			b = (read32(p + len - 4) << 32) | read32(p + len - 4 - off);
+		} else if (0 < len) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8)
+			    | p[len - 1];
+			b = 0;
+		} else {
+			a = 0;
+			b = 0;
+		}
+	} else {
+		size_t i = len;
+		if (48 < i) {
+			uint64_t seed1 = seed;
+			uint64_t seed2 = seed;
+			do {
+				seed = mix64(read64(p) ^ hash_secret[1],
+				    read64(p + 8) ^ seed);
+				seed1 = mix64(read64(p + 16) ^ hash_secret[2],
+				    read64(p + 24) ^ seed1);
+				seed2 = mix64(read64(p + 32) ^ hash_secret[3],
+				    read64(p + 40) ^ seed2);
+				p += 48;
+				i -= 48;
+			} while (48 < i);
+			seed ^= seed1 ^ seed2;
+		}
+
+		while (16 < i) {
+			seed = mix64(read64(p) ^ hash_secret[1], read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		/* The last 16 bytes, overlapping the previous step if needed */
+		a = read64(p + i - 16);
+		b = read64(p + i - 8);
 	}
-	return hash;
+
+	a ^= hash_secret[1];
+	b ^= seed;
+	mum64(&a, &b);
+	return mix64(a ^ hash_secret[0] ^ len, b ^ hash_secret[1]);
 }
 
 /*
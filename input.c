@@ -0,0 +1,1026 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_view.h"
+#include "input.h"
+#include "stream.h"
+#include "util.h"
+
+/*
+ * Compressed and streamed input.
+ *
+ * A compressed log is mapped into memory as is, and decompressed
+ * by the worker threads in one of two ways:
+ *
+ *   - If it consists of independently compressed parts, such as the
+ *     blocks of a BGZF (bgzip) file or the frames of a multi-frame zstd
+ *     file, the parts are grouped into units of about INPUT_UNIT_SIZE
+ *     bytes, and each thread decompresses and scans the units it claims.
+ *
+ *   - Otherwise, a single producer thread decompresses the log into
+ *     line-aligned blocks, which the worker threads scan as they arrive.
+ *
+ * Logs that cannot be mapped, such as standard input or named pipes,
+ * are always streamed, whether they are compressed or not.
+ */
+
+#define INPUT_HEAD_SIZE (64 * 1024)
+
+#define GZIP_MAGIC0 0x1f
+#define GZIP_MAGIC1 0x8b
+#define ZSTD_MAGIC  0xfd2fb528
+
+static enum input_compression
+detect_compression(const char *src, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)src;
+
+	if (2 <= size && p[0] == GZIP_MAGIC0 && p[1] == GZIP_MAGIC1)
+		return INPUT_COMPRESSION_GZIP;
+
+	if (4 <= size) {
+		uint32_t magic = (uint32_t)p[0]
+		    | (uint32_t)p[1] << 8
+		    | (uint32_t)p[2] << 16
+		    | (uint32_t)p[3] << 24;
+		if (magic == ZSTD_MAGIC)
+			return INPUT_COMPRESSION_ZSTD;
+	}
+
+	return INPUT_COMPRESSION_NONE;
+}
+
+/*
+ * Reads from fd into buf, retrying on interrupts.
+ * Returns 0 at the end of input.
+ */
+static size_t
+read_fd(int fd, const char *path, char *buf, size_t size)
+{
+	while (1) {
+		ssize_t n = read(fd, buf, size);
+		if (0 <= n)
+			return (size_t)n;
+		if (errno != EINTR)
+			ERR("failed to read %s", path);
+	}
+}
+
+/*
+ * Buffers at least min bytes of unconsumed input, if the input
+ * has that many left. Returns the number of buffered bytes.
+ */
+static size_t
+fill_decompressor(struct decompressor *d, size_t min)
+{
+	assert(min <= DECOMPRESSOR_INBUF_SIZE);
+
+	if (d->fd == -1 || min <= d->in_size)
+		return d->in_size;
+
+	memmove(d->inbuf, d->in, d->in_size);
+	d->in = d->inbuf;
+	while (d->in_size < min) {
+		size_t n = read_fd(d->fd, d->path, d->inbuf + d->in_size,
+		    DECOMPRESSOR_INBUF_SIZE - d->in_size);
+		if (n == 0)
+			break;
+		d->in_size += n;
+	}
+
+	return d->in_size;
+}
+
+static void
+consume_decompressor(struct decompressor *d, size_t n)
+{
+	assert(n <= d->in_size);
+
+	d->in += n;
+	d->in_size -= n;
+}
+
+static void
+start_decompressor(struct decompressor *d)
+{
+	switch (d->compression) {
+	case INPUT_COMPRESSION_GZIP:
+		/* Window size with 16 added for a gzip header */
+		if (inflateInit2(&d->zs, MAX_WBITS + 16) != Z_OK)
+			ERRX("%s", "inflateInit2");
+		break;
+	case INPUT_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+		d->zds = ZSTD_createDStream();
+		if (d->zds == NULL)
+			ERRX("%s", "ZSTD_createDStream");
+		if (ZSTD_isError(ZSTD_initDStream(d->zds)))
+			ERRX("%s", "ZSTD_initDStream");
+		d->zpending = 0;
+#else
+		ERRX("no zstd support for %s, rebuild with WITH_ZSTD=1", d->path);
+#endif
+		break;
+	case INPUT_COMPRESSION_NONE:
+		/* Only data from a file descriptor is passed through. */
+		assert(d->fd != -1);
+		break;
+	}
+}
+
+/* Starts decompressing a compressed memory area. */
+static void
+init_decompressor(struct decompressor *d, enum input_compression compression,
+                  const char *path, const char *src, size_t size)
+{
+	assert(d != NULL);
+	assert(path != NULL);
+	assert(src != NULL);
+
+	memset(d, 0, sizeof(*d));
+	d->compression = compression;
+	d->path = path;
+	d->in = src;
+	d->in_size = size;
+	d->fd = -1;
+
+	start_decompressor(d);
+}
+
+/*
+ * Starts reading fd, detecting its compression from the first bytes.
+ * The file descriptor is not closed afterwards.
+ */
+static void
+init_fd_decompressor(struct decompressor *d, const char *path, int fd)
+{
+	assert(d != NULL);
+	assert(path != NULL);
+
+	memset(d, 0, sizeof(*d));
+	d->path = path;
+	d->fd = fd;
+
+	d->inbuf = malloc(DECOMPRESSOR_INBUF_SIZE);
+	if (d->inbuf == NULL)
+		ERR("%s", "malloc");
+	d->in = d->inbuf;
+
+	size_t n = fill_decompressor(d, 4);
+	d->compression = detect_compression(d->in, n);
+
+	start_decompressor(d);
+}
+
+static void
+free_decompressor(struct decompressor *d)
+{
+	assert(d != NULL);
+
+	switch (d->compression) {
+	case INPUT_COMPRESSION_GZIP:
+		inflateEnd(&d->zs);
+		break;
+	case INPUT_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+		ZSTD_freeDStream(d->zds);
+#endif
+		break;
+	case INPUT_COMPRESSION_NONE:
+		break;
+	}
+
+	free(d->inbuf);
+}
+
+/*
+ * Inflates gzip data, continuing across concatenated members.
+ * Trailing data that is not another member is ignored.
+ */
+static size_t
+read_gzip(struct decompressor *d, char *dst, size_t dst_size)
+{
+	z_stream *zs = &d->zs;
+
+	uInt avail = (uInt)MIN(dst_size, UINT_MAX);
+	zs->next_out = (Bytef *)dst;
+	zs->avail_out = avail;
+
+	while (zs->avail_out != 0 && !d->done) {
+		fill_decompressor(d, 1);
+		zs->next_in = (const Bytef *)d->in;
+		zs->avail_in = (uInt)MIN(d->in_size, UINT_MAX);
+
+		int rc = inflate(zs, Z_NO_FLUSH);
+		consume_decompressor(d, (const char *)zs->next_in - d->in);
+		switch (rc) {
+		case Z_OK:
+			break;
+		case Z_STREAM_END:
+			if (fill_decompressor(d, 2) == 0) {
+				d->done = 1;
+			} else if (d->in_size < 2
+			        || (unsigned char)d->in[0] != GZIP_MAGIC0
+			        || (unsigned char)d->in[1] != GZIP_MAGIC1) {
+				WARNX("ignoring trailing data in %s", d->path);
+				d->done = 1;
+			} else if (inflateReset(zs) != Z_OK)
+				ERRX("%s", "inflateReset");
+			break;
+		case Z_BUF_ERROR:
+			/* No progress was possible, so input is missing. */
+			if (d->in_size == 0)
+				ERRX("truncated gzip data in %s", d->path);
+			break;
+		default:
+			ERRX("corrupt gzip data in %s: %s", d->path,
+			    zs->msg != NULL ? zs->msg : zError(rc));
+		}
+	}
+
+	return avail - zs->avail_out;
+}
+
+#ifdef HAVE_ZSTD
+static size_t
+read_zstd(struct decompressor *d, char *dst, size_t dst_size)
+{
+	ZSTD_outBuffer out = { dst, dst_size, 0 };
+
+	while (out.pos < out.size && !d->done) {
+		if (fill_decompressor(d, 1) == 0 && d->zpending == 0) {
+			d->done = 1;
+			break;
+		}
+
+		ZSTD_inBuffer in = { d->in, d->in_size, 0 };
+		size_t prev_out = out.pos;
+		size_t rc = ZSTD_decompressStream(d->zds, &out, &in);
+		if (ZSTD_isError(rc))
+			ERRX("corrupt zstd data in %s: %s", d->path,
+			    ZSTD_getErrorName(rc));
+
+		consume_decompressor(d, in.pos);
+		d->zpending = rc;
+		if (in.pos == 0 && prev_out == out.pos)
+			ERRX("truncated zstd data in %s", d->path);
+	}
+
+	return out.pos;
+}
+#endif
+
+/* Passes uncompressed data through, without buffering. */
+static size_t
+read_plain(struct decompressor *d, char *dst, size_t dst_size)
+{
+	if (d->in_size != 0) {
+		size_t n = MIN(dst_size, d->in_size);
+		memcpy(dst, d->in, n);
+		consume_decompressor(d, n);
+		return n;
+	}
+
+	size_t n = read_fd(d->fd, d->path, dst, dst_size);
+	d->done = n == 0;
+
+	return n;
+}
+
+/*
+ * Decompresses at most dst_size bytes into dst.
+ * Returns 0 at the end of the compressed data.
+ */
+static size_t
+read_decompressor(void *ctx, char *dst, size_t dst_size)
+{
+	assert(ctx != NULL);
+	assert(dst != NULL);
+
+	struct decompressor *d = ctx;
+	if (d->done)
+		return 0;
+
+	switch (d->compression) {
+	case INPUT_COMPRESSION_GZIP:
+		return read_gzip(d, dst, dst_size);
+	case INPUT_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+		return read_zstd(d, dst, dst_size);
+#else
+		break;
+#endif
+	case INPUT_COMPRESSION_NONE:
+		return read_plain(d, dst, dst_size);
+	}
+
+	assert(0 && "NOTREACHED");
+	return 0;
+}
+
+/*
+ * Returns the size of a BGZF block at p, or 0 if p does not start
+ * with a gzip member carrying the BC extra subfield.
+ */
+static size_t
+get_bgzf_block_size(const unsigned char *p, size_t size)
+{
+#define BGZF_HEADER_SIZE  12
+#define BGZF_TRAILER_SIZE 8
+	if (size < BGZF_HEADER_SIZE
+	 || p[0] != GZIP_MAGIC0
+	 || p[1] != GZIP_MAGIC1
+	 || p[2] != 8          /* Deflate */
+	 || (p[3] & 4) == 0)   /* FEXTRA */
+		return 0;
+
+	size_t xlen = (size_t)p[10] | (size_t)p[11] << 8;
+	if (size < BGZF_HEADER_SIZE + xlen)
+		return 0;
+
+	const unsigned char *x = p + BGZF_HEADER_SIZE;
+	const unsigned char *xend = x + xlen;
+	while (4 <= xend - x) {
+		size_t slen = (size_t)x[2] | (size_t)x[3] << 8;
+		if ((size_t)(xend - x - 4) < slen)
+			return 0;
+
+		if (x[0] == 'B' && x[1] == 'C' && slen == 2) {
+			size_t bsize = ((size_t)x[4] | (size_t)x[5] << 8) + 1;
+			if (bsize < BGZF_HEADER_SIZE + xlen + BGZF_TRAILER_SIZE
+			 || size < bsize)
+				return 0;
+			return bsize;
+		}
+
+		x += 4 + slen;
+	}
+
+	return 0;
+}
+
+/*
+ * Groups the blocks of a BGZF file into units.
+ * Returns the number of units, or 0 if the file is not BGZF.
+ */
+static size_t
+split_bgzf_units(struct input *input)
+{
+	const unsigned char *src = (const unsigned char *)input->view.src;
+	size_t size = input->view.size;
+
+	/* Each block has at least a header and a trailer. */
+	size_t capunits = size / (BGZF_HEADER_SIZE + BGZF_TRAILER_SIZE) + 1;
+	struct input_unit *units = calloc(capunits, sizeof(*units));
+	if (units == NULL)
+		ERR("%s", "calloc");
+
+	size_t nunits = 0;
+	struct input_unit *unit = NULL;
+	for (size_t offset = 0; offset < size; ) {
+		size_t bsize = get_bgzf_block_size(src + offset, size - offset);
+		if (bsize == 0) {
+			free(units);
+			return 0;
+		}
+
+		const unsigned char *t = src + offset + bsize - 4;
+		size_t isize = (size_t)t[0]
+		    | (size_t)t[1] << 8
+		    | (size_t)t[2] << 16
+		    | (size_t)t[3] << 24;
+
+		if (unit == NULL || INPUT_UNIT_SIZE <= unit->size_hint) {
+			unit = &units[nunits++];
+			unit->src = input->view.src + offset;
+		}
+		unit->src_size += bsize;
+		unit->size_hint += isize;
+
+		offset += bsize;
+	}
+
+	input->units = units;
+	return nunits;
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * Groups the frames of a zstd file into units.
+ * Frames without a known decompressed size get a unit of their own.
+ * Returns the number of units, or 0 if the frames cannot be told apart.
+ */
+static size_t
+split_zstd_units(struct input *input)
+{
+	const char *src = input->view.src;
+	size_t size = input->view.size;
+
+	size_t nframes = 0;
+	for (size_t offset = 0; offset < size; nframes++) {
+		size_t frame_size = ZSTD_findFrameCompressedSize(src + offset,
+		    size - offset);
+		if (ZSTD_isError(frame_size))
+			return 0;
+		offset += frame_size;
+	}
+
+	struct input_unit *units = calloc(nframes, sizeof(*units));
+	if (units == NULL)
+		ERR("%s", "calloc");
+
+	size_t nunits = 0;
+	struct input_unit *unit = NULL;
+	for (size_t offset = 0; offset < size; ) {
+		size_t frame_size = ZSTD_findFrameCompressedSize(src + offset,
+		    size - offset);
+		unsigned long long content_size = ZSTD_getFrameContentSize(
+		    src + offset, frame_size);
+		int known = content_size != ZSTD_CONTENTSIZE_UNKNOWN
+		         && content_size != ZSTD_CONTENTSIZE_ERROR;
+
+		if (unit == NULL || !known || unit->size_hint == 0
+		 || INPUT_UNIT_SIZE <= unit->size_hint) {
+			unit = &units[nunits++];
+			unit->src = src + offset;
+		}
+		unit->src_size += frame_size;
+		unit->size_hint = known ? unit->size_hint + content_size : 0;
+
+		offset += frame_size;
+	}
+
+	input->units = units;
+	return nunits;
+}
+#endif
+
+static void
+add_input_path(char ***pathsp, size_t *npathsp, size_t *cappathsp, char *path)
+{
+	if (*npathsp == *cappathsp) {
+		size_t new_cap = *cappathsp == 0 ? 16 : 2 * *cappathsp;
+		char **new_paths = realloc(*pathsp, new_cap * sizeof(*new_paths));
+		if (new_paths == NULL)
+			ERR("%s", "realloc");
+		*pathsp = new_paths;
+		*cappathsp = new_cap;
+	}
+
+	(*pathsp)[(*npathsp)++] = path;
+}
+
+static int
+cmp_input_paths(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Appends the files of a directory to *pathsp, in name order.
+ * Hidden files and subdirectories are skipped.
+ */
+static void
+add_directory_paths(const char *dir_path, char ***pathsp, size_t *npathsp,
+                    size_t *cappathsp)
+{
+	DIR *dir = opendir(dir_path);
+	if (dir == NULL)
+		ERR("failed to open directory at '%s'", dir_path);
+
+	size_t first = *npathsp;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		size_t path_size = strlen(dir_path) + 1 + strlen(de->d_name) + 1;
+		char *path = malloc(path_size);
+		if (path == NULL)
+			ERR("%s", "malloc");
+		snprintf(path, path_size, "%s/%s", dir_path, de->d_name);
+
+		struct stat sb;
+		if (stat(path, &sb) == -1)
+			ERR("failed to read file status for %s", path);
+		if (S_ISDIR(sb.st_mode)) {
+			free(path);
+			continue;
+		}
+
+		add_input_path(pathsp, npathsp, cappathsp, path);
+	}
+	closedir(dir);
+
+	qsort(*pathsp + first, *npathsp - first, sizeof(**pathsp), cmp_input_paths);
+}
+
+/*
+ * Expands the access log arguments into a list of paths, stored
+ * into *pathsp. A directory is replaced by the files in it, and a glob
+ * pattern that is not a file name by itself, by the files it matches.
+ *
+ * Returns the number of paths.
+ */
+size_t
+expand_input_paths(char **args, size_t nargs, char ***pathsp)
+{
+	assert(args != NULL);
+	assert(pathsp != NULL);
+
+	char **paths = NULL;
+	size_t npaths = 0;
+	size_t cappaths = 0;
+	int stdin_seen = 0;
+
+	for (size_t i = 0; i < nargs; i++) {
+		char *arg = args[i];
+		struct stat sb;
+
+		if (strcmp(arg, "-") == 0) {
+			if (stdin_seen)
+				ERRX("%s", "standard input given more than once");
+			stdin_seen = 1;
+			add_input_path(&paths, &npaths, &cappaths, arg);
+		} else if (stat(arg, &sb) == 0) {
+			if (S_ISDIR(sb.st_mode))
+				add_directory_paths(arg, &paths, &npaths, &cappaths);
+			else
+				add_input_path(&paths, &npaths, &cappaths, arg);
+		} else if (strpbrk(arg, "*?[") != NULL) {
+			glob_t g;
+			int rc = glob(arg, 0, NULL, &g);
+			if (rc == GLOB_NOMATCH)
+				ERRX("no files match '%s'", arg);
+			if (rc != 0)
+				ERRX("failed to expand '%s'", arg);
+
+			/* glob(3) sorts its matches. */
+			for (size_t j = 0; j < g.gl_pathc; j++) {
+				char *path = strdup(g.gl_pathv[j]);
+				if (path == NULL)
+					ERR("%s", "strdup");
+				add_input_path(&paths, &npaths, &cappaths, path);
+			}
+			globfree(&g);
+		} else
+			ERR("failed to read file status for %s", arg);
+	}
+
+	if (npaths == 0)
+		ERRX("%s", "no access logs found");
+
+	*pathsp = paths;
+	return npaths;
+}
+
+/* Reads the start of the decompressed input into input->head. */
+static void
+read_input_head(struct input *input, struct decompressor *d)
+{
+	char *head = calloc(INPUT_HEAD_SIZE + STREAM_BLOCK_PADDING, 1);
+	if (head == NULL)
+		ERR("%s", "calloc");
+
+	size_t size = 0;
+	while (size < INPUT_HEAD_SIZE) {
+		size_t n = read_decompressor(d, head + size,
+		    INPUT_HEAD_SIZE - size);
+		if (n == 0)
+			break;
+		size += n;
+	}
+
+	head[size] = '\0';
+	input->head.src = head;
+	input->head.size = size;
+	input->head.path = input->path;
+	input->head_offset = 0;
+}
+
+/*
+ * Opens the log at path for streaming if it cannot be mapped,
+ * such as standard input ("-") or a named pipe.
+ * Returns 0 if the log is a regular file.
+ */
+static int
+open_input_stream(struct input *input, const char *path)
+{
+	int fd;
+	if (strcmp(path, "-") == 0) {
+		fd = STDIN_FILENO;
+		input->path = "standard input";
+	} else {
+		struct stat sb;
+		if (stat(path, &sb) == -1)
+			ERR("failed to read file status for %s", path);
+		if (S_ISREG(sb.st_mode))
+			return 0;
+
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+			ERR("failed to open file at '%s'", path);
+	}
+
+	input->fd = fd;
+	input->type = INPUT_STREAM;
+	init_fd_decompressor(&input->decompressor, input->path, fd);
+	input->compression = input->decompressor.compression;
+
+	return 1;
+}
+
+/*
+ * Maps the log at path into memory, or opens it for streaming,
+ * and if it is compressed, decides how it is decompressed.
+ */
+void
+init_input(struct input *input, const char *path)
+{
+	assert(input != NULL);
+	assert(path != NULL);
+
+	memset(input, 0, sizeof(*input));
+	input->path = path;
+	input->fd = -1;
+	if (open_input_stream(input, path))
+		return;
+
+	init_file_view_readonly(&input->view, path);
+	input->compression = detect_compression(input->view.src,
+	    input->view.size);
+
+	switch (input->compression) {
+	case INPUT_COMPRESSION_NONE:
+		input->type = INPUT_MAPPED;
+		input->scan_end = input->view.size;
+		return;
+	case INPUT_COMPRESSION_GZIP:
+		input->nunits = split_bgzf_units(input);
+		break;
+	case INPUT_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+		input->nunits = split_zstd_units(input);
+#else
+		ERRX("no zstd support for %s, rebuild with WITH_ZSTD=1", path);
+#endif
+		break;
+	}
+
+	/* A single unit is better streamed, to bound memory use. */
+	if (input->nunits < 2) {
+		free(input->units);
+		input->units = NULL;
+		input->nunits = 0;
+		input->type = INPUT_STREAM;
+		init_decompressor(&input->decompressor, input->compression,
+		    input->path, input->view.src, input->view.size);
+		return;
+	}
+
+	input->type = INPUT_UNITS;
+	ck_spinlock_init(&input->stitch_lock);
+}
+
+/*
+ * Sets input->head to the start of the decompressed input,
+ * for inferring the line config.
+ * A streamed input reads its head before anything else.
+ */
+void
+init_input_head(struct input *input)
+{
+	assert(input != NULL);
+
+	struct decompressor d;
+
+	switch (input->type) {
+	case INPUT_MAPPED:
+		input->head = input->view;
+		break;
+	case INPUT_UNITS:
+		init_decompressor(&d, input->compression, input->path,
+		    input->view.src, input->view.size);
+		read_input_head(input, &d);
+		free_decompressor(&d);
+		break;
+	case INPUT_STREAM:
+		read_input_head(input, &input->decompressor);
+		break;
+	}
+}
+
+/*
+ * Ends the scan range of a mapped input at its last complete line,
+ * leaving a partial line that may still be written to for later.
+ */
+void
+trim_input_partial_line(struct input *input)
+{
+	assert(input != NULL);
+	assert(input->type == INPUT_MAPPED);
+
+	size_t size = input->view.size;
+	while (input->scan_start < size && input->view.src[size - 1] != '\n')
+		size--;
+
+	input->scan_end = size;
+}
+
+/*
+ * Reads a streamed input, starting with the head that was read
+ * for inferring the line config, if any.
+ */
+size_t
+read_input_stream(void *ctx, char *dst, size_t dst_size)
+{
+	assert(ctx != NULL);
+
+	struct input *input = ctx;
+	assert(input->type == INPUT_STREAM);
+
+	if (input->head_offset < input->head.size) {
+		size_t n = MIN(dst_size, input->head.size - input->head_offset);
+		memcpy(dst, input->head.src + input->head_offset, n);
+		input->head_offset += n;
+		return n;
+	}
+
+	return read_decompressor(&input->decompressor, dst, dst_size);
+}
+
+/* Frees the decompressor of a streamed input, once it has been read. */
+void
+finish_input_stream(struct input *input)
+{
+	assert(input != NULL);
+	assert(input->type == INPUT_STREAM);
+
+	free_decompressor(&input->decompressor);
+	if (input->fd != -1 && input->fd != STDIN_FILENO)
+		close(input->fd);
+}
+
+static char *
+copy_fragment(const char *src, size_t size)
+{
+	char *fragment = malloc(size + 1);
+	if (fragment == NULL)
+		ERR("%s", "malloc");
+	memcpy(fragment, src, size);
+	fragment[size] = '\0';
+
+	return fragment;
+}
+
+/*
+ * Decompresses unit i into *bufp, growing it and *capp as needed,
+ * and saves the partial lines at both ends of the unit for
+ * stitch_input_unit(). The whole lines in between, if any,
+ * are stored to *startp and *endp.
+ */
+void
+load_input_unit(struct input *input, size_t i, char **bufp, size_t *capp,
+                const char **startp, const char **endp)
+{
+	assert(input != NULL);
+	assert(input->type == INPUT_UNITS);
+	assert(i < input->nunits);
+	assert(bufp != NULL);
+	assert(capp != NULL);
+	assert(startp != NULL);
+	assert(endp != NULL);
+
+	struct input_unit *unit = &input->units[i];
+
+	struct decompressor d;
+	init_decompressor(&d, input->compression, input->path,
+	    unit->src, unit->src_size);
+
+	/*
+	 * Room for the terminator and the padding of field scanners,
+	 * plus a byte so that a unit of the expected size does not
+	 * fill the buffer.
+	 */
+	size_t reserved = 1 + STREAM_BLOCK_PADDING;
+	size_t want = MAX(unit->size_hint, INPUT_UNIT_SIZE) + reserved + 1;
+
+	size_t size = 0;
+	while (1) {
+		if (*capp < want) {
+			char *buf = realloc(*bufp, want);
+			if (buf == NULL)
+				ERR("%s", "realloc");
+			*bufp = buf;
+			*capp = want;
+		}
+
+		size_t n = read_decompressor(&d, *bufp + size,
+		    *capp - reserved - size);
+		if (n == 0)
+			break;
+
+		size += n;
+		if (size + reserved == *capp)
+			want = 2 * *capp;
+	}
+	free_decompressor(&d);
+
+	char *buf = *bufp;
+	buf[size] = '\0';
+
+	const char *first_nl = memchr(buf, '\n', size);
+	if (first_nl == NULL) {
+		unit->head = copy_fragment(buf, size);
+		unit->head_size = size;
+		unit->has_newline = 0;
+		*startp = *endp = buf + size;
+		return;
+	}
+
+	const char *last_nl = buf + size - 1;
+	while (*last_nl != '\n')
+		last_nl--;
+
+	unit->head_size = first_nl - buf;
+	unit->head = copy_fragment(buf, unit->head_size);
+	unit->tail_size = buf + size - (last_nl + 1);
+	unit->tail = copy_fragment(last_nl + 1, unit->tail_size);
+	unit->has_newline = 1;
+
+	*startp = first_nl + 1;
+	*endp = last_nl + 1;
+}
+
+/* Line made of the partial lines of units first to last. */
+struct unit_line {
+	size_t first;
+	size_t last;
+	int    from_tail; /* If not, the line starts at the start of the input */
+	int    at_eof;    /* If not, the line ends at the head of the last unit */
+};
+
+/*
+ * Finds the start of the line that continues into unit i from the left,
+ * across any units without a newline.
+ * Returns 0 if a unit on the way has not been loaded yet.
+ */
+static int
+find_unit_line_start(struct input *input, size_t i, struct unit_line *line)
+{
+	while (0 < i) {
+		struct input_unit *unit = &input->units[i - 1];
+		if (!unit->loaded)
+			return 0;
+
+		i--;
+		if (unit->has_newline) {
+			line->first = i;
+			line->from_tail = 1;
+			return 1;
+		}
+	}
+
+	line->first = 0;
+	line->from_tail = 0;
+	return 1;
+}
+
+/*
+ * Finds the end of the line that continues out of unit i to the right,
+ * across any units without a newline.
+ * Returns 0 if a unit on the way has not been loaded yet.
+ */
+static int
+find_unit_line_end(struct input *input, size_t i, struct unit_line *line)
+{
+	while (i + 1 < input->nunits) {
+		struct input_unit *unit = &input->units[i + 1];
+		if (!unit->loaded)
+			return 0;
+
+		i++;
+		if (unit->has_newline) {
+			line->last = i;
+			line->at_eof = 0;
+			return 1;
+		}
+	}
+
+	line->last = i;
+	line->at_eof = 1;
+	return 1;
+}
+
+/*
+ * Copies the partial lines of a line to buf, with a newline after it,
+ * and frees them. An empty line at the end of the input is left out.
+ * Returns the number of bytes copied, or only counts them if buf is NULL.
+ */
+static size_t
+copy_unit_line(struct input *input, struct unit_line *line, char *buf)
+{
+	size_t size = 0;
+	for (size_t i = line->first; i <= line->last; i++) {
+		struct input_unit *unit = &input->units[i];
+		char **fragment = &unit->head;
+		size_t fragment_size = unit->head_size;
+		if (i == line->first && line->from_tail) {
+			fragment = &unit->tail;
+			fragment_size = unit->tail_size;
+		}
+
+		if (buf != NULL) {
+			memcpy(buf + size, *fragment, fragment_size);
+			free(*fragment);
+			*fragment = NULL;
+		}
+		size += fragment_size;
+	}
+
+	if (size == 0 && line->at_eof)
+		return 0;
+
+	if (buf != NULL)
+		buf[size] = '\n';
+
+	return size + 1;
+}
+
+/*
+ * Marks unit i as loaded, after load_input_unit() and a scan of its
+ * whole lines, and joins the partial lines saved by load_input_unit()
+ * into the lines crossing the ends of unit i, if all of their units
+ * have been loaded. Each such line is joined exactly once, by whichever
+ * thread loads the last of its units.
+ * The lines are stored into *bufp, growing it and *capp as needed.
+ *
+ * Returns the size of the lines.
+ */
+size_t
+stitch_input_unit(struct input *input, size_t i, char **bufp, size_t *capp)
+{
+	assert(input != NULL);
+	assert(input->type == INPUT_UNITS);
+	assert(i < input->nunits);
+	assert(bufp != NULL);
+	assert(capp != NULL);
+
+	struct input_unit *unit = &input->units[i];
+	struct unit_line lines[2];
+	size_t nlines = 0;
+
+	ck_spinlock_lock(&input->stitch_lock);
+	unit->loaded = 1;
+
+	struct unit_line *line = &lines[nlines];
+	if (unit->has_newline) {
+		/* The line ending at the head, and the one starting at the tail */
+		if (find_unit_line_start(input, i, line)) {
+			line->last = i;
+			line->at_eof = 0;
+			line = &lines[++nlines];
+		}
+		if (find_unit_line_end(input, i, line)) {
+			line->first = i;
+			line->from_tail = 1;
+			nlines++;
+		}
+	} else if (find_unit_line_start(input, i, line)
+	        && find_unit_line_end(input, i, line)) {
+		/* The line crossing the whole unit */
+		nlines++;
+	}
+
+	size_t want = 1 + STREAM_BLOCK_PADDING;
+	for (size_t j = 0; j < nlines; j++)
+		want += copy_unit_line(input, &lines[j], NULL);
+
+	if (*capp < want) {
+		char *buf = realloc(*bufp, want);
+		if (buf == NULL)
+			ERR("%s", "realloc");
+		*bufp = buf;
+		*capp = want;
+	}
+
+	char *buf = *bufp;
+	size_t size = 0;
+	for (size_t j = 0; j < nlines; j++)
+		size += copy_unit_line(input, &lines[j], buf + size);
+	buf[size] = '\0';
+
+	ck_spinlock_unlock(&input->stitch_lock);
+
+	return size;
+}
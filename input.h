@@ -0,0 +1,100 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZLIB_CONST
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <ck_spinlock.h>
+
+#include "file_view.h"
+
+enum input_compression {
+	INPUT_COMPRESSION_NONE = 0,
+	INPUT_COMPRESSION_GZIP,
+	INPUT_COMPRESSION_ZSTD
+};
+
+/* How the workers get their share of an input. */
+enum input_type {
+	INPUT_MAPPED = 0, /* Chunks of the mapped file */
+	INPUT_UNITS,      /* Independently decompressed units */
+	INPUT_STREAM      /* Blocks from a serial decompressor */
+};
+
+/*
+ * Part of a compressed input that can be decompressed on its own,
+ * such as a run of BGZF blocks or zstd frames.
+ *
+ * The partial lines at both ends of a unit are saved when it is
+ * scanned, and joined with those of the neighboring units as soon as
+ * those have been scanned too.
+ */
+struct input_unit {
+#define INPUT_UNIT_SIZE (2 * 1024 * 1024) /* Decompressed size to aim for */
+	const char *src;
+	size_t      src_size;
+	size_t      size_hint;   /* Decompressed size, or 0 if unknown */
+	char       *head;        /* Data before the first newline */
+	size_t      head_size;
+	char       *tail;        /* Data after the last newline */
+	size_t      tail_size;
+	int         has_newline; /* If not, the whole unit is in head */
+	int         loaded;      /* Set under the stitch lock of the input */
+};
+
+/*
+ * Incremental decompressor, reading either a compressed memory area,
+ * or a file descriptor through a fixed-size buffer.
+ * Data read from a file descriptor may also be uncompressed.
+ */
+struct decompressor {
+#define DECOMPRESSOR_INBUF_SIZE (128 * 1024)
+	enum input_compression compression;
+	const char            *path;
+	const char            *in;      /* Unconsumed input */
+	size_t                 in_size;
+	int                    fd;      /* -1 if all input is in memory */
+	char                  *inbuf;
+	int                    done;
+	z_stream               zs;
+#ifdef HAVE_ZSTD
+	ZSTD_DStream          *zds;
+	size_t                 zpending; /* Nonzero if a frame is unfinished */
+#endif
+};
+
+struct input {
+	const char             *path;
+	enum input_type         type;
+	enum input_compression  compression;
+	struct file_view        view;  /* Mapped file, compressed or not */
+	struct file_view        head;  /* Decompressed start, for inferring the line config */
+	size_t                  head_offset; /* Part of head already streamed */
+	int                     fd;    /* Streamed file, or -1 if mapped */
+	size_t                  scan_start; /* Range of a mapped log to scan */
+	size_t                  scan_end;
+	int                     skip;  /* Unchanged since the last run */
+
+	size_t                  nunits;
+	struct input_unit      *units;
+	ck_spinlock_t           stitch_lock; /* Held while joining partial lines */
+
+	struct decompressor     decompressor; /* For streamed inputs */
+};
+
+size_t expand_input_paths(char **, size_t, char ***);
+void   init_input(struct input *, const char *);
+void   init_input_head(struct input *);
+void   trim_input_partial_line(struct input *);
+size_t read_input_stream(void *, char *, size_t);
+void   finish_input_stream(struct input *);
+void   load_input_unit(struct input *, size_t, char **, size_t *, const char **, const char **);
+size_t stitch_input_unit(struct input *, size_t, char **, size_t *);
+
+#endif
@@ -1,19 +1,38 @@
 #include <assert.h>
+#include <stdlib.h>
 
 #include "path_graph.h"
 #include "request.h"
 #include "session.h"
 #include "util.h"
 
+/* Makes room for vertices of request IDs below cap. */
 static void
-amend_path_graph_vertex(struct path_graph *pg, uint64_t depth,
-                        request_id_t rid, request_id_t edge_rid,
-			uint64_t ts, uint64_t edge_ts)
+reserve_path_graph(struct path_graph *pg, size_t cap)
+{
+	if (cap <= pg->capvertices)
+		return;
+
+	size_t new_capvertices = MAX(cap, 2 * pg->capvertices);
+	struct path_graph_vertex *new_vertices = realloc(pg->vertices,
+	    new_capvertices * sizeof(*new_vertices));
+	if (new_vertices == NULL)
+		ERR("%s", "realloc");
+
+	for (size_t v = pg->capvertices; v < new_capvertices; v++)
+		new_vertices[v] = NULL_VERTEX;
+
+	pg->vertices = new_vertices;
+	pg->capvertices = new_capvertices;
+}
+
+/* Returns the vertex of a request, creating it if needed. */
+static struct path_graph_vertex *
+get_path_graph_vertex(struct path_graph *pg, request_id_t rid, uint64_t depth)
 {
-	assert(pg != NULL);
 	assert(rid != REQUEST_ID_INVAL);
 
-	struct path_graph_edge *edge;
+	reserve_path_graph(pg, rid + 1);
 	struct path_graph_vertex *vertex = &pg->vertices[rid];
 
 	if (is_null_vertex(vertex)) {
@@ -22,46 +41,38 @@ amend_path_graph_vertex(struct path_graph *pg, uint64_t depth,
 		if (vertex->edges == NULL)
 			ERR("%s", "calloc");
 		vertex->lim_nedges = PATH_GRAPH_VERTEX_INIT_LIM_NEDGES;
-
-		if (edge_rid != REQUEST_ID_INVAL) {
-			edge = &vertex->edges[0];
-			edge->rid = edge_rid;
-			edge->nhits = 1;
-			edge->duration_cma = (double)edge_ts - (double)ts;
-			vertex->nedges = 1;
-			vertex->total_nhits_out++;
-			pg->total_nedges++;
-			pg->total_edge_nhits++;
-		}
-
-		vertex->total_nhits_in++;
 		vertex->min_depth = depth;
-		pg->total_nhits++;
 		pg->nvertices++;
-
-		return;
 	}
 
-	vertex->total_nhits_in++;
 	vertex->min_depth = MIN(depth, vertex->min_depth);
-	pg->total_nhits++;
 
-	if (edge_rid == REQUEST_ID_INVAL)
-		return;
+	return vertex;
+}
+
+/*
+ * Adds nhits hits with an average duration of duration_cma
+ * to an edge from a vertex, creating the edge if needed.
+ */
+static void
+add_path_graph_edge(struct path_graph *pg, struct path_graph_vertex *vertex,
+                    request_id_t edge_rid, uint64_t nhits, double duration_cma)
+{
+	struct path_graph_edge *edge;
+
+	vertex->total_nhits_out += nhits;
+	pg->total_edge_nhits += nhits;
 
 	/* See if edge request already exists, if yes, increment hit count */
 	size_t edge_idx;
 	for (edge_idx = 0; edge_idx < vertex->nedges; edge_idx++) {
 		edge = &vertex->edges[edge_idx];
 		if (edge->rid == edge_rid) {
-			double duration = (double)edge_ts - (double)ts;
-			double duration_cma = edge->duration_cma;
 			edge->duration_cma =
-			    (duration + (double)edge->nhits * duration_cma)
-			    / ((double)edge->nhits + 1);
-			edge->nhits++;
-			vertex->total_nhits_out++;
-			pg->total_edge_nhits++;
+			    ((double)edge->nhits * edge->duration_cma
+			     + (double)nhits * duration_cma)
+			    / ((double)edge->nhits + (double)nhits);
+			edge->nhits += nhits;
 			return;
 		}
 	}
@@ -82,13 +93,29 @@ amend_path_graph_vertex(struct path_graph *pg, uint64_t depth,
 	edge_idx = vertex->nedges;
 	edge = &vertex->edges[edge_idx];
 	edge->rid = edge_rid;
-	edge->nhits = 1;
-	edge->duration_cma = (double)edge_ts - (double)ts;
+	edge->nhits = nhits;
+	edge->duration_cma = duration_cma;
 
 	vertex->nedges++;
-	vertex->total_nhits_out++;
 	pg->total_nedges++;
-	pg->total_edge_nhits++;
+}
+
+static void
+amend_path_graph_vertex(struct path_graph *pg, uint64_t depth,
+                        request_id_t rid, request_id_t edge_rid,
+			uint64_t ts, uint64_t edge_ts)
+{
+	assert(pg != NULL);
+	assert(rid != REQUEST_ID_INVAL);
+
+	struct path_graph_vertex *vertex = get_path_graph_vertex(pg, rid, depth);
+	vertex->total_nhits_in++;
+	pg->total_nhits++;
+
+	if (edge_rid == REQUEST_ID_INVAL)
+		return;
+
+	add_path_graph_edge(pg, vertex, edge_rid, 1, (double)edge_ts - (double)ts);
 }
 
 static int
@@ -97,10 +124,11 @@ cmp_session_request(const void *p1, const void *p2)
 	const struct session_request *r1 = p1;
 	const struct session_request *r2 = p2;
 
-	if (r1->ts == r2->ts)
-		return 0;
-	else
-		return r1->ts > r2->ts;
+	if (r1->ts != r2->ts)
+		return r1->ts < r2->ts ? -1 : 1;
+	if (r1->rid != r2->rid)
+		return r1->rid < r2->rid ? -1 : 1;
+	return 0;
 }
 
 static int
@@ -135,23 +163,23 @@ cmp_path_graph_edge_by_hits(const void *p1, const void *p2)
 		return e1->nhits < e2->nhits;
 }
 
+/*
+ * Initializes an empty path graph, with room for vertices of
+ * nrequests requests. More room is made as needed.
+ */
 void
-init_path_graph(struct path_graph *pg, struct request_table *rt)
+init_path_graph(struct path_graph *pg, size_t nrequests)
 {
 	assert(pg != NULL);
-	assert(rt != NULL);
 
 	pg->total_nedges = 0;
 	pg->total_nhits = 0;
 	pg->total_edge_nhits = 0;
 	pg->nvertices = 0;
-	pg->capvertices = rt->nrequests;
-	pg->vertices = calloc(pg->capvertices, sizeof(*pg->vertices));
-	if (pg->vertices == NULL)
-		ERR("%s", "calloc");
+	pg->capvertices = 0;
+	pg->vertices = NULL;
 
-	for (size_t v = 0; v < pg->capvertices; v++)
-		pg->vertices[v] = NULL_VERTEX;
+	reserve_path_graph(pg, nrequests);
 }
 
 int
@@ -161,43 +189,104 @@ is_null_vertex(struct path_graph_vertex *v)
 	return v->rid == REQUEST_ID_INVAL;
 }
 
+/*
+ * Adds the path of one session to the graph.
+ * With a nonzero timeout, the session is split where the time between
+ * two requests exceeds the timeout, and each part starts over at
+ * depth 1, as if it was a session of its own.
+ */
 void
-gen_path_graph(struct path_graph *pg, struct request_set *rs,
-               struct session_map *sm)
+add_path_graph_session(struct path_graph *pg, struct session_map_entry *entry,
+                       uint64_t timeout_ms)
 {
 	assert(pg != NULL);
-	assert(rs != NULL);
-	assert(sm != NULL);
+	assert(entry != NULL);
 
-	/* Generate request path edges */
-	for (size_t bucket_idx = 0; bucket_idx < SESSION_MAP_NBUCKETS;
-	     bucket_idx++) {
-		struct session_map_entry *entry, *tmp;
-		HASH_ITER(hh, sm->handles[bucket_idx], entry, tmp) {
-			qsort(entry->requests, entry->nrequests,
-			    sizeof(*entry->requests), cmp_session_request);
-			uint64_t depth = 1;
-			for (size_t r = 0, e = 1; r < entry->nrequests; r++, e++) {
-				struct session_request *node_req = &entry->requests[r];
-				request_id_t rid = node_req->rid;
-				uint64_t ts = node_req->ts;
-
-				struct session_request *edge_req = NULL;
-				request_id_t edge_rid = REQUEST_ID_INVAL;
-				uint64_t edge_ts = 0;
-				if (e < entry->nrequests) {
-					edge_req = &entry->requests[e];
-					edge_rid = edge_req->rid;
-					edge_ts = edge_req->ts;
-				}
-				amend_path_graph_vertex(pg, depth, rid, edge_rid,
-				    ts, edge_ts);
-				depth = rid == edge_rid ? depth : depth + 1;
-			}
+	qsort(entry->requests, entry->nrequests, sizeof(*entry->requests),
+	    cmp_session_request);
+
+	uint64_t depth = 1;
+	for (size_t r = 0, e = 1; r < entry->nrequests; r++, e++) {
+		struct session_request *node_req = &entry->requests[r];
+		request_id_t rid = node_req->rid;
+		uint64_t ts = node_req->ts;
+
+		struct session_request *edge_req = NULL;
+		request_id_t edge_rid = REQUEST_ID_INVAL;
+		uint64_t edge_ts = 0;
+		if (e < entry->nrequests
+		 && (timeout_ms == 0 || entry->requests[e].ts - ts <= timeout_ms)) {
+			edge_req = &entry->requests[e];
+			edge_rid = edge_req->rid;
+			edge_ts = edge_req->ts;
+		}
+		amend_path_graph_vertex(pg, depth, rid, edge_rid, ts, edge_ts);
+
+		if (edge_rid == REQUEST_ID_INVAL)
+			depth = 1;
+		else if (rid != edge_rid)
+			depth++;
+	}
+}
+
+/*
+ * Adds the vertices and edges of an unsorted graph to another one,
+ * mapping each request ID through rid_map, unless it is NULL.
+ */
+void
+merge_path_graph(struct path_graph *dst, struct path_graph *src,
+                 const request_id_t *rid_map)
+{
+	assert(dst != NULL);
+	assert(src != NULL);
+
+	for (size_t v = 0; v < src->capvertices; v++) {
+		struct path_graph_vertex *src_vertex = &src->vertices[v];
+		if (is_null_vertex(src_vertex))
+			continue;
+
+		request_id_t rid = src_vertex->rid;
+		if (rid_map != NULL)
+			rid = rid_map[rid];
+
+		struct path_graph_vertex *vertex = get_path_graph_vertex(dst,
+		    rid, src_vertex->min_depth);
+		vertex->total_nhits_in += src_vertex->total_nhits_in;
+		dst->total_nhits += src_vertex->total_nhits_in;
+
+		for (size_t e = 0; e < src_vertex->nedges; e++) {
+			struct path_graph_edge *edge = &src_vertex->edges[e];
+			request_id_t edge_rid = edge->rid;
+			if (rid_map != NULL)
+				edge_rid = rid_map[edge_rid];
+			add_path_graph_edge(dst, vertex, edge_rid, edge->nhits,
+			    edge->duration_cma);
+		}
+	}
+}
+
+/*
+ * Sorts vertices and edges by hit counts, for output.
+ * After this, vertices are no longer indexed by request ID.
+ */
+void
+sort_path_graph(struct path_graph *pg)
+{
+	assert(pg != NULL);
+
+	/* Move vertices to the front, in case some requests have none */
+	size_t nvertices = 0;
+	for (size_t v = 0; v < pg->capvertices; v++) {
+		if (is_null_vertex(&pg->vertices[v]))
+			continue;
+		if (v != nvertices) {
+			pg->vertices[nvertices] = pg->vertices[v];
+			pg->vertices[v] = NULL_VERTEX;
 		}
+		nvertices++;
 	}
+	assert(nvertices == pg->nvertices);
 
-	/* Sort vertices and edges by hit counts */
 	qsort(pg->vertices, pg->nvertices, sizeof(*pg->vertices),
 	    cmp_path_graph_vertex_by_hits);
 	for (size_t v = 0; v < pg->nvertices; v++) {
@@ -206,3 +295,32 @@ gen_path_graph(struct path_graph *pg, struct request_set *rs,
 		    cmp_path_graph_edge_by_hits);
 	}
 }
+
+void
+gen_path_graph(struct path_graph *pg, struct request_set *rs,
+               struct session_map *sm, uint64_t timeout_ms)
+{
+	assert(pg != NULL);
+	assert(rs != NULL);
+	assert(sm != NULL);
+
+	/* Generate request path edges */
+	struct session_map_iter iter;
+	struct session_map_entry entry;
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry))
+		add_path_graph_session(pg, &entry, timeout_ms);
+	free_session_map_iter(&iter);
+
+	sort_path_graph(pg);
+}
+
+void
+free_path_graph(struct path_graph *pg)
+{
+	assert(pg != NULL);
+
+	for (size_t v = 0; v < pg->capvertices; v++)
+		free(pg->vertices[v].edges);
+	free(pg->vertices);
+}
@@ -42,8 +42,12 @@ struct path_graph {
 	uint64_t total_edge_nhits;          /* Total number of edge hits */
 };
 
-void init_path_graph(struct path_graph *, struct request_table *);
+void init_path_graph(struct path_graph *, size_t);
 int  is_null_vertex(struct path_graph_vertex *);
-void gen_path_graph(struct path_graph *, struct request_set *, struct session_map *);
+void add_path_graph_session(struct path_graph *, struct session_map_entry *, uint64_t);
+void merge_path_graph(struct path_graph *, struct path_graph *, const request_id_t *);
+void sort_path_graph(struct path_graph *);
+void gen_path_graph(struct path_graph *, struct request_set *, struct session_map *, uint64_t);
+void free_path_graph(struct path_graph *);
 
 #endif
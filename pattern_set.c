@@ -0,0 +1,493 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pattern_set.h"
+#include "util.h"
+
+/* Set of bytes, one bit per byte value. */
+struct byte_class {
+	uint64_t bits[4];
+};
+
+/* One automaton position of a pattern. */
+struct pattern_position {
+	struct byte_class class;
+	int               optional;
+	int               loop;
+};
+
+/* Intermediate form of one pattern. */
+struct pattern_positions {
+	size_t                  npositions;
+	struct pattern_position positions[PATTERN_SET_NPOSITIONS_MAX];
+	int                     bol; /* Anchored with '^' */
+	int                     eol; /* Anchored with '$' */
+};
+
+static void
+add_byte(struct byte_class *bc, unsigned char c)
+{
+	bc->bits[c / 64] |= 1ULL << (c % 64);
+}
+
+static int
+has_byte(const struct byte_class *bc, unsigned char c)
+{
+	return (bc->bits[c / 64] >> (c % 64)) & 1;
+}
+
+static void
+invert_byte_class(struct byte_class *bc)
+{
+	for (size_t i = 0; i < 4; i++)
+		bc->bits[i] = ~bc->bits[i];
+}
+
+/*
+ * Parses a POSIX character class name, such as "alpha" in "[:alpha:]".
+ * Returns 0 if the name is not known.
+ */
+static int
+add_named_class(struct byte_class *bc, const char *name, size_t name_size)
+{
+	static const struct {
+		const char *name;
+		int       (*fn)(int);
+	} table[] = {
+	    { "alnum",  isalnum  },
+	    { "alpha",  isalpha  },
+	    { "blank",  isblank  },
+	    { "cntrl",  iscntrl  },
+	    { "digit",  isdigit  },
+	    { "graph",  isgraph  },
+	    { "lower",  islower  },
+	    { "print",  isprint  },
+	    { "punct",  ispunct  },
+	    { "space",  isspace  },
+	    { "upper",  isupper  },
+	    { "xdigit", isxdigit }
+	};
+
+	for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+		if (strlen(table[i].name) != name_size
+		 || strncmp(table[i].name, name, name_size) != 0)
+			continue;
+
+		for (int c = 1; c < 256; c++) {
+			if (table[i].fn(c))
+				add_byte(bc, c);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a bracket expression starting right after '['.
+ * Returns a pointer past the closing ']', or NULL if unsupported.
+ *
+ * As in POSIX, backslashes have no special meaning inside brackets.
+ */
+static const char *
+parse_bracket(const char *s, struct byte_class *bc)
+{
+	int negate = 0;
+	if (*s == '^') {
+		negate = 1;
+		s++;
+	}
+
+	if (*s == ']') {
+		add_byte(bc, ']');
+		s++;
+	}
+
+	while (*s != ']') {
+		if (*s == '\0')
+			return NULL;
+
+		if (s[0] == '[' && s[1] == ':') {
+			const char *name = s + 2;
+			const char *name_end = strstr(name, ":]");
+			if (name_end == NULL)
+				return NULL;
+			if (!add_named_class(bc, name, name_end - name))
+				return NULL;
+			s = name_end + 2;
+			continue;
+		}
+
+		/* Collating symbols and equivalence classes */
+		if (s[0] == '[' && (s[1] == '.' || s[1] == '='))
+			return NULL;
+
+		unsigned char lo = s[0];
+		if (s[1] == '-' && s[2] != ']' && s[2] != '\0') {
+			unsigned char hi = s[2];
+			if (hi == '[' || hi < lo)
+				return NULL;
+			for (unsigned c = lo; c <= hi; c++)
+				add_byte(bc, c);
+			s += 3;
+			continue;
+		}
+
+		add_byte(bc, lo);
+		s++;
+	}
+
+	if (negate) {
+		invert_byte_class(bc);
+		/* With REG_NEWLINE, non-matching lists never match a newline. */
+		bc->bits['\n' / 64] &= ~(1ULL << ('\n' % 64));
+	}
+	bc->bits[0] &= ~1ULL;
+
+	return s + 1;
+}
+
+/*
+ * Parses a bound such as "{2}", "{2,}" or "{2,4}" starting at '{'.
+ * Returns a pointer past the closing '}', or NULL if unsupported.
+ */
+static const char *
+parse_bound(const char *s, int *minp, int *maxp)
+{
+	assert(*s == '{');
+	s++;
+
+	if (!isdigit((unsigned char)*s))
+		return NULL;
+
+	char *endp;
+	long min = strtol(s, &endp, 10);
+	long max = min;
+	s = endp;
+
+	if (*s == ',') {
+		s++;
+		if (*s == '}') {
+			max = -1;
+		} else {
+			if (!isdigit((unsigned char)*s))
+				return NULL;
+			max = strtol(s, &endp, 10);
+			s = endp;
+		}
+	}
+
+	if (*s != '}')
+		return NULL;
+	if (PATTERN_SET_NPOSITIONS_MAX < min || PATTERN_SET_NPOSITIONS_MAX < max)
+		return NULL;
+	if (max != -1 && max < min)
+		return NULL;
+
+	*minp = min;
+	*maxp = max;
+
+	return s + 1;
+}
+
+static int
+add_positions(struct pattern_positions *pp, const struct byte_class *bc,
+              int min, int max)
+{
+	size_t nadd = (max == -1) ? MAX(min, 1) : (size_t)max;
+	if (PATTERN_SET_NPOSITIONS_MAX - pp->npositions < nadd)
+		return 0;
+
+	for (size_t i = 0; i < nadd; i++) {
+		struct pattern_position *pos = &pp->positions[pp->npositions++];
+		pos->class = *bc;
+		pos->optional = (int)i >= min;
+		pos->loop = max == -1 && i == nadd - 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Compiles a pattern into a chain of positions.
+ * Returns 0 if the pattern uses unsupported syntax, or if it can
+ * match an empty string.
+ */
+static int
+parse_pattern(struct pattern_positions *pp, const char *s)
+{
+	pp->npositions = 0;
+	pp->bol = 0;
+	pp->eol = 0;
+
+	if (*s == '^') {
+		pp->bol = 1;
+		s++;
+	}
+
+	while (*s != '\0') {
+		struct byte_class bc;
+		memset(&bc, 0, sizeof(bc));
+
+		switch (*s) {
+		case '$':
+			if (s[1] != '\0')
+				return 0;
+			pp->eol = 1;
+			s++;
+			continue;
+		case '^':
+		case '(':
+		case ')':
+		case '|':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			return 0;
+		case '.':
+			invert_byte_class(&bc);
+			bc.bits[0] &= ~((1ULL << '\n') | 1ULL);
+			s++;
+			break;
+		case '[':
+			s = parse_bracket(s + 1, &bc);
+			if (s == NULL)
+				return 0;
+			break;
+		case '\\':
+			/* Back-references and GNU extensions such as \w */
+			if (s[1] == '\0' || isalnum((unsigned char)s[1]))
+				return 0;
+			add_byte(&bc, s[1]);
+			s += 2;
+			break;
+		default:
+			add_byte(&bc, *s);
+			s++;
+			break;
+		}
+
+		int min = 1, max = 1;
+		switch (*s) {
+		case '*':
+			min = 0;
+			max = -1;
+			s++;
+			break;
+		case '+':
+			min = 1;
+			max = -1;
+			s++;
+			break;
+		case '?':
+			min = 0;
+			max = 1;
+			s++;
+			break;
+		case '{':
+			s = parse_bound(s, &min, &max);
+			if (s == NULL)
+				return 0;
+			break;
+		default:
+			break;
+		}
+
+		/* Stacked repetitions, such as "a*?" */
+		if (*s == '*' || *s == '+' || *s == '?' || *s == '{')
+			return 0;
+
+		if (!add_positions(pp, &bc, min, max))
+			return 0;
+	}
+
+	for (size_t i = 0; i < pp->npositions; i++) {
+		if (!pp->positions[i].optional)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+set_bit(uint64_t *bits, size_t i)
+{
+	bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static uint64_t *
+alloc_bits(size_t nwords)
+{
+	uint64_t *bits = calloc(nwords, sizeof(*bits));
+	if (bits == NULL)
+		ERR("%s", "calloc");
+	return bits;
+}
+
+void
+init_pattern_set(struct pattern_set *ps, const char **patterns, size_t npatterns)
+{
+	assert(ps != NULL);
+	assert(patterns != NULL || npatterns == 0);
+
+	memset(ps, 0, sizeof(*ps));
+	ps->npatterns = npatterns;
+	ps->supported = calloc(MAX(npatterns, 1), sizeof(*ps->supported));
+	if (ps->supported == NULL)
+		ERR("%s", "calloc");
+
+	struct pattern_positions *pps = calloc(MAX(npatterns, 1), sizeof(*pps));
+	if (pps == NULL)
+		ERR("%s", "calloc");
+
+	for (size_t p = 0; p < npatterns; p++) {
+		ps->supported[p] = parse_pattern(&pps[p], patterns[p]);
+		if (ps->supported[p])
+			ps->npositions += pps[p].npositions;
+	}
+
+	size_t nwords = PATTERN_SET_NWORDS(MAX(ps->npositions, 1));
+	ps->nwords = nwords;
+	ps->position_patterns = calloc(MAX(ps->npositions, 1),
+	    sizeof(*ps->position_patterns));
+	if (ps->position_patterns == NULL)
+		ERR("%s", "calloc");
+	ps->class_masks = alloc_bits(256 * nwords);
+	ps->first       = alloc_bits(nwords);
+	ps->first_bol   = alloc_bits(nwords);
+	ps->inner       = alloc_bits(nwords);
+	ps->optional    = alloc_bits(nwords);
+	ps->loop        = alloc_bits(nwords);
+	ps->last        = alloc_bits(nwords);
+	ps->last_eol    = alloc_bits(nwords);
+
+	size_t base = 0;
+	for (size_t p = 0; p < npatterns; p++) {
+		if (!ps->supported[p])
+			continue;
+
+		struct pattern_positions *pp = &pps[p];
+		uint64_t *first = pp->bol ? ps->first_bol : ps->first;
+		uint64_t *last = pp->eol ? ps->last_eol : ps->last;
+
+		size_t last_required = 0;
+		for (size_t i = 0; i < pp->npositions; i++) {
+			if (!pp->positions[i].optional)
+				last_required = i;
+		}
+
+		int in_first = 1;
+		size_t run = 0;
+		for (size_t i = 0; i < pp->npositions; i++) {
+			struct pattern_position *pos = &pp->positions[i];
+			size_t bit = base + i;
+
+			ps->position_patterns[bit] = p;
+			for (int c = 0; c < 256; c++) {
+				if (has_byte(&pos->class, c))
+					set_bit(&ps->class_masks[c * nwords], bit);
+			}
+
+			if (in_first)
+				set_bit(first, bit);
+			if (!pos->optional)
+				in_first = 0;
+			if (i != 0)
+				set_bit(ps->inner, bit);
+			if (pos->loop)
+				set_bit(ps->loop, bit);
+			if (last_required <= i)
+				set_bit(last, bit);
+
+			if (pos->optional) {
+				set_bit(ps->optional, bit);
+				run++;
+				ps->max_optional_run = MAX(ps->max_optional_run, run);
+			} else {
+				run = 0;
+			}
+		}
+
+		base += pp->npositions;
+	}
+
+	free(pps);
+}
+
+int
+is_pattern_supported(struct pattern_set *ps, size_t p)
+{
+	assert(p < ps->npatterns);
+	return ps->supported[p];
+}
+
+/*
+ * Finds all supported patterns that match somewhere in s.
+ * Stores the result as a bit set of pattern indices into *matched,
+ * which must hold PATTERN_SET_NWORDS(npatterns) words.
+ *
+ * Each step computes the positions that may be entered next: the first
+ * positions of each pattern, and the successors of the current ones,
+ * skipping over optional positions. Those accepting the next byte
+ * become the current positions.
+ */
+void
+match_pattern_set(struct pattern_set *ps, const char *s, size_t n,
+                  uint64_t *matched)
+{
+	assert(ps != NULL);
+	assert(s != NULL);
+	assert(matched != NULL);
+
+	size_t nwords = ps->nwords;
+	uint64_t cur[nwords];
+	uint64_t next[nwords];
+
+	memset(cur, 0, sizeof(cur));
+	memset(matched, 0, PATTERN_SET_NWORDS(ps->npatterns) * sizeof(*matched));
+
+	if (ps->npositions == 0)
+		return;
+
+	for (size_t i = 0; i < n; i++) {
+		const uint64_t *class_mask = &ps->class_masks[(unsigned char)s[i] * nwords];
+		int bol = i == 0 || s[i - 1] == '\n';
+		int eol = i + 1 == n || s[i + 1] == '\n';
+
+		uint64_t carry = 0;
+		for (size_t w = 0; w < nwords; w++) {
+			next[w] = (((cur[w] << 1) | carry) & ps->inner[w]) | ps->first[w];
+			if (bol)
+				next[w] |= ps->first_bol[w];
+			carry = cur[w] >> 63;
+		}
+
+		for (size_t r = 0; r < ps->max_optional_run; r++) {
+			carry = 0;
+			for (size_t w = 0; w < nwords; w++) {
+				uint64_t skip = next[w] & ps->optional[w];
+				next[w] |= ((skip << 1) | carry) & ps->inner[w];
+				carry = skip >> 63;
+			}
+		}
+
+		for (size_t w = 0; w < nwords; w++) {
+			next[w] = (next[w] | (cur[w] & ps->loop[w])) & class_mask[w];
+
+			uint64_t ends = next[w] & ps->last[w];
+			if (eol)
+				ends |= next[w] & ps->last_eol[w];
+
+			while (ends != 0) {
+				size_t bit = w * 64 + __builtin_ctzll(ends);
+				set_bit(matched, ps->position_patterns[bit]);
+				ends &= ends - 1;
+			}
+
+			cur[w] = next[w];
+		}
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef PATTERN_SET_H
+#define PATTERN_SET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PATTERN_SET_NWORDS(n) (((n) + 63) / 64)
+
+/*
+ * Set of regular expressions, matched against a string in one pass.
+ *
+ * Each supported pattern is a sequence of character classes with
+ * repetition counts, such as "[0-9a-f]{8}\-[0-9a-f]{4}", which is
+ * compiled to a chain of automaton positions. The positions of all
+ * patterns are simulated together as bit sets, one bit per position.
+ *
+ * Patterns using groups, alternation or back-references are marked
+ * as unsupported, and must be matched by other means.
+ */
+struct pattern_set {
+#define PATTERN_SET_NPOSITIONS_MAX 1024 /* Per pattern */
+	size_t    npatterns;
+	size_t    npositions;
+	size_t    nwords;            /* Words in one position bit set */
+	size_t    max_optional_run;  /* Longest chain of optional positions */
+	int      *supported;         /* Pattern index to support flag */
+	int      *position_patterns; /* Position to pattern index */
+	uint64_t *class_masks;       /* Positions accepting each byte, 256 bit sets */
+	uint64_t *first;             /* Positions a match may start from */
+	uint64_t *first_bol;         /* Same as above, but only at line start ('^') */
+	uint64_t *inner;             /* Positions that may be entered from the previous one */
+	uint64_t *optional;          /* Positions that may be skipped */
+	uint64_t *loop;              /* Positions that may repeat */
+	uint64_t *last;              /* Positions a match may end at */
+	uint64_t *last_eol;          /* Same as above, but only at line end ('$') */
+};
+
+void init_pattern_set(struct pattern_set *, const char **, size_t);
+int  is_pattern_supported(struct pattern_set *, size_t);
+void match_pattern_set(struct pattern_set *, const char *, size_t, uint64_t *);
+
+#endif
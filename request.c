@@ -1,13 +1,20 @@
 #include <assert.h>
+#include <ck_pr.h>
 #include <ck_spinlock.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "hash.h"
 #include "request.h"
 #include "truncate.h"
 #include "util.h"
 
+/*
+ * Returns the size of the method and URL at the start of a request field,
+ * which we use as is, straight from the log.
+ */
 static size_t
-init_raw_request_from_src(const char *src, char *raw_buf, size_t raw_size)
+get_raw_request_size(const char *src, size_t raw_size)
 {
 	/* Compute request field length */
 	const char *s = src;
@@ -22,9 +29,6 @@ init_raw_request_from_src(const char *src, char *raw_buf, size_t raw_size)
 		WARNX("truncating request over %zu bytes long", raw_size);
 	req_size = MIN(req_size, raw_size);
 
-	memcpy(raw_buf, src, req_size);
-	raw_buf[req_size] = '\0';
-
 	return req_size;
 }
 
@@ -72,9 +76,276 @@ init_raw_request_from_fields(struct request_info *ri, char *raw_buf, size_t raw_
 	return req_size;
 }
 
+/* Marks a sealed empty slot in a table that is being resized. */
+static struct request_set_entry request_set_moved_entry;
+#define REQUEST_SET_MOVED (&request_set_moved_entry)
+
+static struct request_set_table *
+alloc_request_set_table(size_t cap)
+{
+	assert(cap != 0 && (cap & (cap - 1)) == 0);
+
+	struct request_set_table *table = calloc(1, sizeof(*table));
+	if (table == NULL)
+		ERR("%s", "calloc");
+
+	table->slots = calloc(cap, sizeof(*table->slots));
+	if (table->slots == NULL)
+		ERR("%s", "calloc");
+
+	table->cap = cap;
+	table->mask = cap - 1;
+
+	return table;
+}
+
+static struct request_set_entry *
+alloc_request_set_entry(struct request_set *rs, const char *data, size_t size,
+                        uint64_t hash)
+{
+	ck_spinlock_lock(&rs->arena_lock);
+	struct request_set_entry *entry = alloc_from_arena(&rs->arena,
+	    sizeof(*entry) + size + 1);
+	ck_spinlock_unlock(&rs->arena_lock);
+
+	entry->data = (char *)(entry + 1);
+	memcpy(entry->data, data, size);
+	entry->size = size;
+	entry->hash = hash;
+	entry->rid = REQUEST_ID_INVAL;
+
+	return entry;
+}
+
+static int
+is_request_set_entry(struct request_set_entry *entry, const char *data,
+                     size_t size, uint64_t hash)
+{
+	return entry->hash == hash
+	    && entry->size == size
+	    && memcmp(entry->data, data, size) == 0;
+}
+
+/*
+ * Returns the request ID of an entry. The thread that inserted the
+ * entry allocates the ID right after insertion, so we may have to
+ * wait for it for a brief moment.
+ */
+static request_id_t
+get_request_set_entry_rid(struct request_set_entry *entry)
+{
+	request_id_t rid;
+	while ((rid = ck_pr_load_64(&entry->rid)) == REQUEST_ID_INVAL)
+		ck_pr_stall();
+
+	return rid;
+}
+
+/*
+ * Replaces the table of an index with one twice the size,
+ * unless some other thread has already done it.
+ *
+ * Every empty slot in the old table is sealed before moving on,
+ * so threads trying to insert into the old table will notice it,
+ * and retry with the new table once it has been published.
+ * The old table is left as is until the request set is freed, since
+ * other threads may still be reading it.
+ */
+static void
+resize_request_set_index(struct request_set_index *index,
+                         struct request_set_table *table)
+{
+	ck_spinlock_lock(&index->resize_lock);
+
+	if (ck_pr_load_ptr(&index->table) != table) {
+		ck_spinlock_unlock(&index->resize_lock);
+		return;
+	}
+
+	assert(table->cap < SIZE_MAX / 2);
+	struct request_set_table *new_table = alloc_request_set_table(2 * table->cap);
+	new_table->prev = table;
+
+	for (size_t i = 0; i < table->cap; i++) {
+		struct request_set_entry *entry;
+		while ((entry = ck_pr_load_ptr(&table->slots[i])) == NULL) {
+			if (ck_pr_cas_ptr(&table->slots[i], NULL, REQUEST_SET_MOVED))
+				break;
+		}
+
+		if (entry == NULL)
+			continue;
+
+		assert(entry != REQUEST_SET_MOVED);
+		ck_pr_fence_load();
+
+		size_t idx = entry->hash & new_table->mask;
+		while (new_table->slots[idx] != NULL)
+			idx = (idx + 1) & new_table->mask;
+		new_table->slots[idx] = entry;
+	}
+
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&index->table, new_table);
+
+	ck_spinlock_unlock(&index->resize_lock);
+}
+
+/*
+ * Looks up an entry without inserting anything.
+ * Returns NULL if the entry was not found, or if the table is
+ * being resized.
+ */
+static struct request_set_entry *
+find_request_set_entry(struct request_set_index *index, const char *data,
+                       size_t size, uint64_t hash)
+{
+	struct request_set_table *table = ck_pr_load_ptr(&index->table);
+	ck_pr_fence_load();
+
+	size_t idx = hash & table->mask;
+	for (size_t nprobes = 0; nprobes < table->cap; nprobes++) {
+		struct request_set_entry *entry = ck_pr_load_ptr(&table->slots[idx]);
+		if (entry == NULL || entry == REQUEST_SET_MOVED)
+			break;
+
+		ck_pr_fence_load();
+		if (is_request_set_entry(entry, data, size, hash))
+			return entry;
+
+		idx = (idx + 1) & table->mask;
+	}
+
+	return NULL;
+}
+
+/*
+ * Finds the entry for some data, or inserts a new one if it has not
+ * been seen before. New entries get the request ID rid, or a new one
+ * from the request set if rid is REQUEST_ID_INVAL.
+ */
+static struct request_set_entry *
+intern_request_set_entry(struct request_set *rs, struct request_set_index *index,
+                         const char *data, size_t size, uint64_t hash,
+                         request_id_t rid)
+{
+	struct request_set_entry *new_entry = NULL;
+
+	while (1) {
+		struct request_set_table *table = ck_pr_load_ptr(&index->table);
+		ck_pr_fence_load();
+
+		size_t idx = hash & table->mask;
+		size_t nprobes = 0;
+		while (nprobes < table->cap) {
+			struct request_set_entry *entry = ck_pr_load_ptr(&table->slots[idx]);
+			if (entry == REQUEST_SET_MOVED)
+				break;
+
+			if (entry != NULL) {
+				ck_pr_fence_load();
+				/* A new entry that lost the race stays unused in the arena. */
+				if (is_request_set_entry(entry, data, size, hash))
+					return entry;
+
+				idx = (idx + 1) & table->mask;
+				nprobes++;
+				continue;
+			}
+
+			if (new_entry == NULL) {
+				new_entry = alloc_request_set_entry(rs, data, size,
+				    hash);
+				new_entry->rid = rid;
+			}
+
+			/* If we lose the slot, look at it again. */
+			ck_pr_fence_store();
+			if (!ck_pr_cas_ptr(&table->slots[idx], NULL, new_entry))
+				continue;
+
+			if (rid == REQUEST_ID_INVAL)
+				ck_pr_store_64(&new_entry->rid, ck_pr_faa_64(&rs->rid_ctr, 1));
+
+			uint64_t nentries = ck_pr_faa_64(&index->nentries, 1) + 1;
+			if (table->cap / 100 * REQUEST_SET_MAX_LOAD_PCT < nentries)
+				resize_request_set_index(index, table);
+
+			return new_entry;
+		}
+
+		/* The table is being resized, wait for the new one. */
+		while (ck_pr_load_ptr(&index->table) == table)
+			ck_pr_stall();
+	}
+}
+
+/*
+ * Stores a request, that needs no further truncation, in the request set.
+ * Returns its request ID.
+ */
+request_id_t
+add_final_request(struct request_set *rs, const char *data, size_t size)
+{
+	assert(rs != NULL);
+	assert(data != NULL);
+
+	uint64_t hash = hash64_init();
+	hash = hash64_update(hash, data, size);
+
+	struct request_set_entry *entry = intern_request_set_entry(rs,
+	    &rs->requests, data, size, hash, REQUEST_ID_INVAL);
+
+	return get_request_set_entry_rid(entry);
+}
+
+/*
+ * Truncates a raw request, and stores the result in the request set.
+ * Returns the request ID of the truncated request.
+ */
+static request_id_t
+add_truncated_request(struct request_set *rs, const char *raw, size_t raw_size,
+                      struct truncate_patterns *tp)
+{
+	/* The truncate patterns need a null-terminated string. */
+	char raw_buf[raw_size + 1];
+	memcpy(raw_buf, raw, raw_size);
+	raw_buf[raw_size] = '\0';
+
+	char trunc_buf[raw_size * SEGMENT_ALIAS_GROWTH_MAX
+	    + tp->max_alias_size * REQUEST_NTRUNCS_MAX + 1];
+	size_t trunc_size = truncate_raw_request(trunc_buf, sizeof(trunc_buf) - 1,
+	    raw_buf, raw_size, tp);
+
+	return add_final_request(rs, trunc_buf, trunc_size);
+}
+
+/*
+ * Stores a raw request, as it appears in the log, in the request set,
+ * truncating it first if there are truncate patterns.
+ * Returns the request ID of the stored request.
+ */
+request_id_t
+add_raw_request(struct request_set *rs, const char *raw, size_t raw_size,
+                struct truncate_patterns *tp)
+{
+	assert(rs != NULL);
+	assert(raw != NULL);
+	assert(raw_size <= REQUEST_LEN_MAX);
+	assert(tp != NULL);
+
+	if (tp->npatterns == 0 && tp->segment_classes == 0)
+		return add_final_request(rs, raw, raw_size);
+
+	return add_truncated_request(rs, raw, raw_size, tp);
+}
+
 /*
  * Stores a request field pointed to by src into the request set rs.
  * Returns a numeric request ID.
+ *
+ * Raw requests are looked up directly from the log, and truncated only
+ * the first time they are seen.
  */
 request_id_t
 add_request_set_entry(struct request_set *rs, struct request_info *ri,
@@ -84,72 +355,88 @@ add_request_set_entry(struct request_set *rs, struct request_info *ri,
 	assert(ri != NULL);
 	assert(tp != NULL);
 
-	size_t hash = hash64_init();
-	struct request_set_entry **handlep;
-	ck_spinlock_t *bucket_lock;
-	struct request_set_entry *entry;
-
-#define REQUEST_LEN_MAX 4096
-	char raw_buf[REQUEST_LEN_MAX + 1] = {0};
-	size_t req_size = 0;
-	if (ri->request != NULL)
-		req_size = init_raw_request_from_src(ri->request, raw_buf, sizeof(raw_buf) - 1);
-	else
-		req_size = init_raw_request_from_fields(ri, raw_buf, sizeof(raw_buf) - 1);
+	char raw_buf[REQUEST_LEN_MAX + 1];
+	const char *raw;
+	size_t raw_size;
+	if (ri->request != NULL) {
+		raw = ri->request;
+		raw_size = get_raw_request_size(ri->request, REQUEST_LEN_MAX);
+	} else {
+		raw = raw_buf;
+		raw_size = init_raw_request_from_fields(ri, raw_buf, sizeof(raw_buf) - 1);
+	}
 
-	char trunc_buf[req_size + tp->max_alias_size * REQUEST_NTRUNCS_MAX + 1];
-	size_t trunc_size = truncate_raw_request(trunc_buf, sizeof(trunc_buf) - 1,
-	    raw_buf, req_size, tp);
+	uint64_t raw_hash = hash64_init();
+	raw_hash = hash64_update(raw_hash, raw, raw_size);
 
-	hash = hash64_update(hash, trunc_buf, trunc_size);
-	size_t bucket_idx = hash & REQUEST_SET_BUCKET_MASK;
-	handlep = &rs->handles[bucket_idx];
-	bucket_lock = &rs->locks[bucket_idx];
-	entry = NULL;
+	struct request_set_entry *entry;
 
-	ck_spinlock_lock(bucket_lock);
+	/* Without truncate patterns, raw requests are the final ones. */
+	if (tp->npatterns == 0 && tp->segment_classes == 0) {
+		entry = intern_request_set_entry(rs, &rs->requests, raw, raw_size,
+		    raw_hash, REQUEST_ID_INVAL);
+		return get_request_set_entry_rid(entry);
+	}
 
-	HASH_FIND(hh, *handlep, trunc_buf, trunc_size, entry);
+	entry = find_request_set_entry(&rs->raw_requests, raw, raw_size, raw_hash);
 	if (entry != NULL)
-		goto finish;
-
-	entry = calloc(1, sizeof(*entry));
-	if (entry == NULL)
-		ERR("%s", "calloc");
+		return entry->rid;
 
-	entry->data = calloc(1, trunc_size + 1);
-	if (entry->data == NULL)
-		ERR("%s", "calloc");
-	memcpy(entry->data, trunc_buf, trunc_size);
+	request_id_t rid = add_truncated_request(rs, raw, raw_size, tp);
+	if (ck_pr_load_64(&rs->raw_requests.nentries) < REQUEST_SET_RAW_NENTRIES_MAX) {
+		intern_request_set_entry(rs, &rs->raw_requests, raw, raw_size,
+		    raw_hash, rid);
+	}
 
-	ck_spinlock_lock(&rs->rid_lock);
+	return rid;
+}
 
-	entry->hash = hash;
-	entry->rid = rs->rid_ctr++;
+static void
+init_request_set_index(struct request_set_index *index)
+{
+	index->table = alloc_request_set_table(REQUEST_SET_INIT_CAP);
+	ck_spinlock_init(&index->resize_lock);
+	index->nentries = 0;
+}
 
-	ck_spinlock_unlock(&rs->rid_lock);
+void
+init_request_set(struct request_set *rs)
+{
+	init_request_set_index(&rs->requests);
+	init_request_set_index(&rs->raw_requests);
 
-	HASH_ADD_KEYPTR(hh, *handlep, entry->data, trunc_size, entry);
-	rs->nrequests++;
+	rs->rid_ctr = REQUEST_ID_START;
+	ck_spinlock_init(&rs->arena_lock);
+	init_arena(&rs->arena);
+}
 
-finish:
-	ck_spinlock_unlock(bucket_lock);
+static void
+free_request_set_index(struct request_set_index *index)
+{
+	struct request_set_table *table = index->table;
+	while (table != NULL) {
+		struct request_set_table *prev = table->prev;
+		free(table->slots);
+		free(table);
+		table = prev;
+	}
 
-	return entry->rid;
+	index->table = NULL;
+	index->nentries = 0;
 }
 
+/*
+ * Frees a request set, along with all of its entries at once.
+ * Request tables generated from the set are invalidated.
+ */
 void
-init_request_set(struct request_set *rs)
+free_request_set(struct request_set *rs)
 {
-	for (size_t i = 0; i< REQUEST_SET_NBUCKETS; i++) {
-		rs->handles[i] = NULL;
-		ck_spinlock_init(&rs->locks[i]);
-	}
-
-	ck_spinlock_init(&rs->rid_lock);
+	assert(rs != NULL);
 
-	rs->nrequests = 0;
-	rs->rid_ctr = REQUEST_ID_START;
+	free_request_set_index(&rs->requests);
+	free_request_set_index(&rs->raw_requests);
+	free_arena(&rs->arena);
 }
 
 void
@@ -158,7 +445,7 @@ gen_request_table(struct request_table *rt, struct request_set *rs)
 	assert(rt != NULL);
 	assert(rs != NULL);
 
-	rt->nrequests = rs->nrequests;
+	rt->nrequests = rs->requests.nentries;
 	rt->requests = calloc(rt->nrequests, sizeof(*rt->requests));
 	if (rt->requests == NULL)
 		ERR("%s", "calloc");
@@ -167,12 +454,23 @@ gen_request_table(struct request_table *rt, struct request_set *rs)
 	if (rt->hashes == NULL)
 		ERR("%s", "calloc");
 
-	for (size_t bucket_idx = 0; bucket_idx < REQUEST_SET_NBUCKETS; bucket_idx++) {
-		struct request_set_entry *entry, *tmp;
-		HASH_ITER(hh, rs->handles[bucket_idx], entry, tmp) {
-			request_id_t rid = entry->rid;
-			rt->requests[rid] = entry->data;
-			rt->hashes[rid] = entry->hash;
-		}
+	struct request_set_table *table = rs->requests.table;
+	for (size_t i = 0; i < table->cap; i++) {
+		struct request_set_entry *entry = table->slots[i];
+		if (entry == NULL)
+			continue;
+
+		request_id_t rid = entry->rid;
+		rt->requests[rid] = entry->data;
+		rt->hashes[rid] = entry->hash;
 	}
 }
+
+void
+free_request_table(struct request_table *rt)
+{
+	assert(rt != NULL);
+
+	free(rt->requests);
+	free(rt->hashes);
+}
@@ -5,13 +5,14 @@
 #include <stdint.h>
 #include <inttypes.h>
 
-#include "lib/uthash.h"
-
+#include "arena.h"
 #include "truncate.h"
 
 typedef uint64_t request_id_t;
 #define PRIuRID PRIu64
 
+#define REQUEST_LEN_MAX 4096 /* Longest raw request read from a line */
+
 struct request_info {
 	const char *request; /* If this is null, the fields below are set, and vice versa. */
 	const char *method;
@@ -23,23 +24,56 @@ struct request_info {
 /* Request field data and incremental ID, stored in a hash table. */
 struct request_set_entry {
 	char         *data;
+	size_t        size;
 	uint64_t      hash;
 	request_id_t  rid;
+};
+
+/* Open-addressing table of request set entries, with linear probing. */
+struct request_set_table {
+	size_t                     cap;   /* Slot count, a power of two */
+	size_t                     mask;  /* cap - 1 */
+	struct request_set_entry **slots;
+	struct request_set_table  *prev;  /* Table this one replaced, if any */
+};
 
-	UT_hash_handle hh;
+/*
+ * Lock-free hash set of request set entries.
+ *
+ * Entries are inserted into empty slots with a compare-and-swap, and
+ * are never moved or removed, so looking up an existing entry takes
+ * no locks. When the table gets too full, one thread copies the entries
+ * to a table twice the size, after sealing each empty slot of the old
+ * table, so that no insertion gets lost during the copy.
+ */
+struct request_set_index {
+#define REQUEST_SET_INIT_CAP        (1 << 10)
+#define REQUEST_SET_MAX_LOAD_PCT    75
+	struct request_set_table *table;       /* Current table */
+	ck_spinlock_t             resize_lock;
+	uint64_t                  nentries;    /* Entry count */
 };
 
+/*
+ * Set of unique requests.
+ *
+ * Truncating a request is expensive, so we also remember which request
+ * ID each raw request, as it appears in the log, was truncated to.
+ * The raw request index is bounded, since logs with IDs in their URLs
+ * may have as many unique raw requests as lines.
+ *
+ * Entries are allocated from an arena, and live until the whole set
+ * is freed.
+ */
 struct request_set {
-#define REQUEST_SET_NBUCKETS           (1 << 8)
-#define REQUEST_SET_BUCKET_MASK        (REQUEST_SET_NBUCKETS - 1)
-#define REQUEST_SET_INIT_LIM_NREQUESTS 8
-	struct request_set_entry *handles[REQUEST_SET_NBUCKETS];
-	ck_spinlock_t             locks[REQUEST_SET_NBUCKETS];
-	size_t                    nrequests; /* Unique request count */
+	struct request_set_index requests;     /* Truncated requests, each with a unique ID */
+#define REQUEST_SET_RAW_NENTRIES_MAX (1 << 20)
+	struct request_set_index raw_requests; /* Raw requests, with IDs of truncated ones */
 #define REQUEST_ID_INVAL UINT64_MAX
 #define REQUEST_ID_START 0
-	ck_spinlock_t             rid_lock;
-	request_id_t              rid_ctr; /* Incremental request ID */
+	request_id_t             rid_ctr;      /* Incremental request ID */
+	ck_spinlock_t            arena_lock;
+	struct arena             arena;        /* Entries of both indices */
 };
 
 /* Mapping from incremental request IDs to request strings. */
@@ -50,8 +84,12 @@ struct request_table {
 };
 
 request_id_t add_request_set_entry(struct request_set *, struct request_info *, struct truncate_patterns *);
+request_id_t add_final_request(struct request_set *, const char *, size_t);
+request_id_t add_raw_request(struct request_set *, const char *, size_t, struct truncate_patterns *);
 
 void init_request_set(struct request_set *);
+void free_request_set(struct request_set *);
 void gen_request_table(struct request_table *, struct request_set *);
+void free_request_table(struct request_table *);
 
 #endif
@@ -1,20 +1,379 @@
 #include <assert.h>
 #include <ck_spinlock.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "hash.h"
 #include "session.h"
 #include "util.h"
 
+/* Seed of the high half of 128-bit session IDs. */
+#define SESSION_ID_HIGH_SEED 0x9e3779b97f4a7c15ULL
+
+session_id_t
+init_session_id(void)
+{
+#ifdef SESSION_ID_128
+	session_id_t high = hash64_init() ^ SESSION_ID_HIGH_SEED;
+	return high << 64 | hash64_init();
+#else
+	return hash64_init();
+#endif
+}
+
+/* Adds a session field to a session ID. */
+session_id_t
+update_session_id(session_id_t sid, const char *s, size_t len)
+{
+#ifdef SESSION_ID_128
+	session_id_t high = hash64_update((uint64_t)(sid >> 64), s, len);
+	return high << 64 | hash64_update((uint64_t)sid, s, len);
+#else
+	return hash64_update(sid, s, len);
+#endif
+}
+
+/* Adds an IP address, without the port number, to a session ID. */
+session_id_t
+update_session_id_ipaddr(session_id_t sid, const char *s)
+{
+#ifdef SESSION_ID_128
+	session_id_t high = hash64_update_ipaddr((uint64_t)(sid >> 64), s);
+	return high << 64 | hash64_update_ipaddr((uint64_t)sid, s);
+#else
+	return hash64_update_ipaddr(sid, s);
+#endif
+}
+
 void
 init_session_map(struct session_map *sm)
 {
-	for (size_t i = 0; i < SESSION_MAP_NBUCKETS; i++) {
-		sm->handles[i] = NULL;
-		ck_spinlock_init(&sm->locks[i]);
+	for (size_t i = 0; i < SESSION_MAP_NSHARDS; i++) {
+		struct session_map_shard *shard = &sm->shards[i];
+		ck_spinlock_init(&shard->lock);
+		shard->nslots = 0;
+		shard->nentries = 0;
+		shard->slots = NULL;
+		init_arena(&shard->arena);
+		for (size_t c = 0; c < SESSION_MAP_SHARD_NBUF_CLASSES; c++)
+			shard->free_bufs[c] = NULL;
 	}
 }
 
+/* Session IDs are hashes already, so their low bits pick the shard. */
+static size_t
+get_session_map_shard(session_id_t sid)
+{
+	return (size_t)sid & (SESSION_MAP_NSHARDS - 1);
+}
+
+/* Returns the capacity class of a request buffer of at least size bytes. */
+static size_t
+get_session_buf_class(size_t size)
+{
+	size_t buf_class = 0;
+	while (SESSION_MAP_BUF_MIN_SIZE << buf_class < size)
+		buf_class++;
+
+	assert(buf_class < SESSION_MAP_SHARD_NBUF_CLASSES);
+	return buf_class;
+}
+
+/*
+ * Returns a request buffer of capacity class buf_class, from the free
+ * list of the shard if possible, or from its arena otherwise.
+ */
+static void *
+alloc_session_buf(struct session_map_shard *shard, size_t buf_class)
+{
+	void *buf = shard->free_bufs[buf_class];
+	if (buf != NULL) {
+		memcpy(&shard->free_bufs[buf_class], buf, sizeof(buf));
+		return buf;
+	}
+
+	return alloc_from_arena(&shard->arena,
+	    SESSION_MAP_BUF_MIN_SIZE << buf_class);
+}
+
+/* Puts a request buffer on the free list of its class, linked through its first bytes. */
+static void
+free_session_buf(struct session_map_shard *shard, void *buf, size_t buf_class)
+{
+	memcpy(buf, &shard->free_bufs[buf_class], sizeof(buf));
+	shard->free_bufs[buf_class] = buf;
+}
+
+static size_t
+get_session_slot_request_size(struct session_slot *slot)
+{
+	if (slot->wide)
+		return sizeof(struct session_request);
+	return sizeof(struct session_map_request);
+}
+
+/* Returns the number of requests that fit in the slot or its buffer. */
+static size_t
+get_session_slot_caprequests(struct session_slot *slot)
+{
+	if (slot->buf_class == SESSION_SLOT_INLINE)
+		return SESSION_SLOT_NINLINE;
+
+	return (SESSION_MAP_BUF_MIN_SIZE << slot->buf_class)
+	    / get_session_slot_request_size(slot);
+}
+
+static struct session_map_request *
+get_compact_session_requests(struct session_slot *slot)
+{
+	assert(!slot->wide);
+
+	if (slot->buf_class == SESSION_SLOT_INLINE)
+		return slot->requests.inline_requests;
+	return slot->requests.buf;
+}
+
+/* Wide sessions always have a request buffer. */
+static struct session_request *
+get_wide_session_requests(struct session_slot *slot)
+{
+	assert(slot->wide);
+	assert(slot->buf_class != SESSION_SLOT_INLINE);
+
+	return slot->requests.buf;
+}
+
+/* Returns nonzero if a request can be stored compactly in a slot. */
+static int
+is_compact_session_request(struct session_slot *slot, uint64_t ts,
+                           request_id_t rid)
+{
+	int64_t dts = (int64_t)ts - (int64_t)slot->base_ts;
+	return rid <= UINT32_MAX && INT32_MIN <= dts && dts <= INT32_MAX;
+}
+
+static void
+get_session_slot_request(struct session_slot *slot, size_t r,
+                         struct session_request *req)
+{
+	assert(r < slot->nrequests);
+
+	if (slot->wide) {
+		*req = get_wide_session_requests(slot)[r];
+		return;
+	}
+
+	struct session_map_request *mreq = &get_compact_session_requests(slot)[r];
+	req->rid = mreq->rid;
+	req->ts = (uint64_t)((int64_t)slot->base_ts + mreq->dts);
+}
+
+/* Stores request r of a slot, which must have room for it. */
+static void
+set_session_slot_request(struct session_slot *slot, size_t r, uint64_t ts,
+                         request_id_t rid)
+{
+	assert(r < get_session_slot_caprequests(slot));
+
+	if (slot->wide) {
+		struct session_request *req = &get_wide_session_requests(slot)[r];
+		req->rid = rid;
+		req->ts = ts;
+		return;
+	}
+
+	assert(is_compact_session_request(slot, ts, rid));
+	struct session_map_request *mreq = &get_compact_session_requests(slot)[r];
+	mreq->rid = (uint32_t)rid;
+	mreq->dts = (int32_t)((int64_t)ts - (int64_t)slot->base_ts);
+}
+
+/*
+ * Moves the requests of a slot into a new request buffer of capacity
+ * class buf_class, converting them to plain session requests if wide
+ * is set, and frees the old buffer.
+ */
+static void
+move_session_slot_requests(struct session_map_shard *shard,
+                           struct session_slot *slot, size_t buf_class,
+                           int wide)
+{
+	assert(slot->wide == 0 || wide);
+
+	void *buf = alloc_session_buf(shard, buf_class);
+	if (slot->wide == wide) {
+		const void *src = slot->requests.buf;
+		if (slot->buf_class == SESSION_SLOT_INLINE)
+			src = slot->requests.inline_requests;
+		memcpy(buf, src, slot->nrequests * get_session_slot_request_size(slot));
+	} else {
+		struct session_request *wide_requests = buf;
+		for (size_t r = 0; r < slot->nrequests; r++)
+			get_session_slot_request(slot, r, &wide_requests[r]);
+	}
+
+	if (slot->buf_class != SESSION_SLOT_INLINE)
+		free_session_buf(shard, slot->requests.buf, slot->buf_class);
+
+	slot->buf_class = (uint8_t)buf_class;
+	slot->wide = (uint8_t)wide;
+	slot->requests.buf = buf;
+}
+
+/* Converts the requests of a slot to plain session requests. */
+static void
+widen_session_slot(struct session_map_shard *shard, struct session_slot *slot,
+                   size_t caprequests)
+{
+	size_t size = caprequests * sizeof(struct session_request);
+	move_session_slot_requests(shard, slot, get_session_buf_class(size), 1);
+}
+
+/*
+ * Decodes the requests of a slot into a buffer of the caller, growing
+ * the buffer as needed, and sets entry to the session.
+ */
+static void
+decode_session_slot(struct session_slot *slot, struct session_map_entry *entry,
+                    struct session_request **requestsp, size_t *caprequestsp)
+{
+	if (*caprequestsp < slot->nrequests) {
+		size_t caprequests = MAX(SESSION_MAP_ENTRY_INIT_CAPREQUESTS,
+		    MAX(slot->nrequests, 2 * *caprequestsp));
+		free(*requestsp);
+		*requestsp = calloc(caprequests, sizeof(**requestsp));
+		if (*requestsp == NULL)
+			ERR("%s", "calloc");
+		*caprequestsp = caprequests;
+	}
+
+	for (size_t r = 0; r < slot->nrequests; r++)
+		get_session_slot_request(slot, r, &(*requestsp)[r]);
+
+	entry->sid = slot->sid;
+	entry->nrequests = slot->nrequests;
+	entry->last_ts = slot->last_ts;
+	entry->caprequests = *caprequestsp;
+	entry->requests = *requestsp;
+}
+
+/*
+ * Returns the slot of the session with session ID sid, or the empty
+ * slot where it belongs. The bits above the shard index pick the
+ * first slot to probe.
+ */
+static struct session_slot *
+find_session_slot(struct session_slot *slots, size_t nslots, session_id_t sid)
+{
+	size_t mask = nslots - 1;
+	size_t i = (size_t)(sid >> SESSION_MAP_NSHARDS_LOG2) & mask;
+
+	while (slots[i].nrequests != 0 && slots[i].sid != sid)
+		i = (i + 1) & mask;
+
+	return &slots[i];
+}
+
+/* Moves the sessions of a shard into a new table with nslots slots. */
+static void
+resize_session_map_shard(struct session_map_shard *shard, size_t nslots)
+{
+	assert(shard->nentries * 100 < nslots * SESSION_MAP_SHARD_MAX_LOAD_PCT
+	    || nslots == 0);
+
+	struct session_slot *slots = NULL;
+	if (nslots != 0) {
+		slots = calloc(nslots, sizeof(*slots));
+		if (slots == NULL)
+			ERR("%s", "calloc");
+	}
+
+	for (size_t i = 0; i < shard->nslots; i++) {
+		struct session_slot *slot = &shard->slots[i];
+		if (slot->nrequests != 0)
+			*find_session_slot(slots, nslots, slot->sid) = *slot;
+	}
+
+	free(shard->slots);
+	shard->nslots = nslots;
+	shard->slots = slots;
+}
+
+/*
+ * Returns the slot of the session with session ID sid in a shard,
+ * claiming an empty slot for it if needed, with ts as the base
+ * timestamp. A claimed slot stays empty until the caller adds requests
+ * to it. The caller must have exclusive access to the shard.
+ */
+static struct session_slot *
+claim_session_slot(struct session_map_shard *shard, session_id_t sid,
+                   uint64_t ts)
+{
+	if (shard->nslots * SESSION_MAP_SHARD_MAX_LOAD_PCT
+	    <= (shard->nentries + 1) * 100) {
+		size_t nslots = SESSION_MAP_SHARD_INIT_NSLOTS;
+		if (shard->nslots != 0) {
+			assert(shard->nslots < (SIZE_MAX / sizeof(*shard->slots) / 2));
+			nslots = 2 * shard->nslots;
+		}
+		resize_session_map_shard(shard, nslots);
+	}
+
+	struct session_slot *slot = find_session_slot(shard->slots,
+	    shard->nslots, sid);
+	if (slot->nrequests == 0) {
+		slot->sid = sid;
+		slot->base_ts = ts;
+		slot->last_ts = ts;
+		slot->buf_class = SESSION_SLOT_INLINE;
+		slot->wide = 0;
+		shard->nentries++;
+	}
+
+	return slot;
+}
+
+/*
+ * Appends a request to the session in a slot. Requests move from the
+ * slot to a request buffer of their own when they no longer fit
+ * inline, to a buffer of the next capacity class when the buffer is
+ * full, and to plain session requests when the request does not fit
+ * the compact encoding. The caller must have exclusive access to the
+ * shard.
+ */
+static void
+append_session_slot(struct session_map_shard *shard, struct session_slot *slot,
+                    uint64_t ts, request_id_t rid)
+{
+	assert(slot->nrequests < UINT32_MAX);
+
+	if (!slot->wide && !is_compact_session_request(slot, ts, rid)) {
+		widen_session_slot(shard, slot, slot->nrequests + 1);
+	} else if (slot->nrequests == get_session_slot_caprequests(slot)) {
+		size_t buf_class = 0;
+		if (slot->buf_class != SESSION_SLOT_INLINE)
+			buf_class = slot->buf_class + 1u;
+		move_session_slot_requests(shard, slot, buf_class, slot->wide);
+	}
+
+	set_session_slot_request(slot, slot->nrequests, ts, rid);
+	slot->nrequests++;
+	slot->last_ts = MAX(slot->last_ts, ts);
+}
+
+/*
+ * Appends a request to the session with session ID sid in one shard,
+ * creating the session if needed. The caller must have exclusive
+ * access to the shard.
+ */
+static void
+append_session_map_entry(struct session_map_shard *shard, session_id_t sid,
+                         uint64_t ts, request_id_t rid)
+{
+	append_session_slot(shard, claim_session_slot(shard, sid, ts), ts, rid);
+}
+
 /*
  * Creates or modifies a session entry in the session table, with
  * session ID sid as the key. Since multiple threads may be editing
@@ -27,60 +386,275 @@ amend_session_map_entry(struct session_map *sm, session_id_t sid, uint64_t ts,
 {
 	assert(sm != NULL);
 
-	struct session_map_entry *entry = NULL;
+	struct session_map_shard *shard = &sm->shards[get_session_map_shard(sid)];
 
-	/* TODO: make sid better distributed */
-	size_t bucket_idx = hash64_init();
-	bucket_idx = hash64_update(bucket_idx, (void *)&sid, sizeof(sid));
-	bucket_idx &= SESSION_MAP_BUCKET_MASK;
+	ck_spinlock_lock(&shard->lock);
+	append_session_map_entry(shard, sid, ts, rid);
+	ck_spinlock_unlock(&shard->lock);
+}
 
-	/*
-	 * We have to use pointer to a pointer, otherwise the uthash
-	 * macros don't work as intended.
-	 */
-	struct session_map_entry **handlep = &sm->handles[bucket_idx];
-	ck_spinlock_t *lock = &sm->locks[bucket_idx];
+/*
+ * Adds a copy of a whole session to the session table.
+ * The session ID must not be in the table yet.
+ */
+void
+add_session_map_entry(struct session_map *sm, session_id_t sid,
+                      const struct session_request *requests, size_t nrequests)
+{
+	assert(sm != NULL);
+	assert(requests != NULL);
+	assert(0 < nrequests);
 
-	ck_spinlock_lock(lock);
+	struct session_map_shard *shard = &sm->shards[get_session_map_shard(sid)];
 
-	HASH_FIND_INT(*handlep, &sid, entry);
-	if (entry == NULL) {
-		entry = calloc(1, sizeof(*entry));
-		if (entry == NULL)
-			ERR("%s", "calloc");
-		entry->sid = sid;
-		entry->nrequests = 1;
-		entry->caprequests = SESSION_MAP_ENTRY_INIT_CAPREQUESTS;
-		entry->requests = calloc(SESSION_MAP_ENTRY_INIT_CAPREQUESTS,
-		    sizeof(*entry->requests));
-		if (entry->requests == NULL)
-			ERR("%s", "calloc");
+	ck_spinlock_lock(&shard->lock);
+	struct session_slot *slot = claim_session_slot(shard, sid,
+	    requests[0].ts);
+	assert(slot->nrequests == 0);
 
-		entry->requests[0].rid = rid;
-		entry->requests[0].ts = ts;
+	for (size_t r = 0; r < nrequests; r++)
+		append_session_slot(shard, slot, requests[r].ts, requests[r].rid);
+	ck_spinlock_unlock(&shard->lock);
+}
+
+void
+init_session_records(struct session_records *sr)
+{
+	assert(sr != NULL);
 
-		HASH_ADD_INT(*handlep, sid, entry);
-		goto finish;
+	for (size_t p = 0; p < SESSION_RECORDS_NPARTITIONS; p++) {
+		struct session_record_partition *part = &sr->partitions[p];
+		part->nrecords = 0;
+		part->caprecords = 0;
+		part->records = NULL;
 	}
+}
+
+/*
+ * Buffers a session record in the partition of its session map shard.
+ */
+void
+add_session_record(struct session_records *sr, session_id_t sid, uint64_t ts,
+                   request_id_t rid)
+{
+	assert(sr != NULL);
+
+	struct session_record_partition *part =
+	    &sr->partitions[get_session_map_shard(sid)];
 
-	if (entry->nrequests == entry->caprequests) {
-		assert(entry->caprequests < (SIZE_MAX / sizeof(*entry->requests) / 2));
+	if (part->nrecords == part->caprecords) {
+		size_t new_caprecords = SESSION_RECORD_PARTITION_INIT_CAPRECORDS;
+		if (part->caprecords != 0) {
+			assert(part->caprecords < (SIZE_MAX / sizeof(*part->records) / 2));
+			new_caprecords = 2 * part->caprecords;
+		}
 
-		size_t new_caprequests = 2 * entry->caprequests;
-		size_t new_size = new_caprequests * sizeof(*entry->requests);
-		struct session_request *new_requests = realloc(entry->requests,
-		    new_size);
-		if (new_requests == NULL)
+		size_t new_size = new_caprecords * sizeof(*part->records);
+		struct session_record *new_records = realloc(part->records, new_size);
+		if (new_records == NULL)
 			ERR("%s", "realloc");
 
-		entry->caprequests = new_caprequests;
-		entry->requests = new_requests;
+		part->caprecords = new_caprecords;
+		part->records = new_records;
+	}
+
+	struct session_record *record = &part->records[part->nrecords++];
+	record->sid = sid;
+	record->ts = ts;
+	record->rid = rid;
+}
+
+/*
+ * Merges partition p of every session record buffer in srs into the
+ * session map, and frees the merged records.
+ *
+ * Each partition belongs to its own session map shard, so different
+ * partitions may be merged by different threads in parallel without
+ * locking.
+ */
+void
+merge_session_records(struct session_map *sm, struct session_records **srs,
+                      size_t nsrs, size_t p)
+{
+	assert(sm != NULL);
+	assert(srs != NULL);
+	assert(p < SESSION_RECORDS_NPARTITIONS);
+
+	struct session_map_shard *shard = &sm->shards[p];
+
+	for (size_t i = 0; i < nsrs; i++) {
+		struct session_record_partition *part = &srs[i]->partitions[p];
+		for (size_t r = 0; r < part->nrecords; r++) {
+			struct session_record *record = &part->records[r];
+			assert(get_session_map_shard(record->sid) == p);
+			append_session_map_entry(shard, record->sid, record->ts,
+			    record->rid);
+		}
+
+		free(part->records);
+		part->nrecords = 0;
+		part->caprecords = 0;
+		part->records = NULL;
+	}
+}
+
+/*
+ * Removes the sessions whose latest request is older than before_ts,
+ * passing each to evict before freeing it. The remaining sessions of
+ * a shard are then moved into a table sized for them, which also
+ * closes the gaps left in the probe sequences.
+ * Each shard is locked while it is swept, so other threads may keep
+ * adding requests to the session map.
+ * Returns the number of evicted sessions.
+ */
+size_t
+evict_session_map_entries(struct session_map *sm, uint64_t before_ts,
+                          session_evict_fn evict, void *ctx)
+{
+	assert(sm != NULL);
+	assert(evict != NULL);
+
+	/* Evicted sessions are decoded into one buffer. */
+	size_t caprequests = 0;
+	struct session_request *requests = NULL;
+
+	size_t nevicted = 0;
+	for (size_t i = 0; i < SESSION_MAP_NSHARDS; i++) {
+		struct session_map_shard *shard = &sm->shards[i];
+		size_t nevicted_shard = 0;
+
+		ck_spinlock_lock(&shard->lock);
+		for (size_t s = 0; s < shard->nslots; s++) {
+			struct session_slot *slot = &shard->slots[s];
+			if (slot->nrequests == 0 || before_ts <= slot->last_ts)
+				continue;
+
+			struct session_map_entry entry;
+			decode_session_slot(slot, &entry, &requests, &caprequests);
+			evict(ctx, &entry);
+			if (slot->buf_class != SESSION_SLOT_INLINE)
+				free_session_buf(shard, slot->requests.buf,
+				    slot->buf_class);
+			slot->nrequests = 0;
+			nevicted_shard++;
+		}
+
+		if (nevicted_shard != 0) {
+			shard->nentries -= nevicted_shard;
+
+			/* An emptied shard drops all of its request buffers at once. */
+			if (shard->nentries == 0) {
+				free_arena(&shard->arena);
+				for (size_t c = 0; c < SESSION_MAP_SHARD_NBUF_CLASSES; c++)
+					shard->free_bufs[c] = NULL;
+			}
+
+			size_t nslots = 0;
+			if (shard->nentries != 0) {
+				nslots = SESSION_MAP_SHARD_INIT_NSLOTS;
+				while (nslots * SESSION_MAP_SHARD_MAX_LOAD_PCT
+				    <= 2 * shard->nentries * 100)
+					nslots *= 2;
+			}
+			resize_session_map_shard(shard, nslots);
+		}
+		ck_spinlock_unlock(&shard->lock);
+
+		nevicted += nevicted_shard;
+	}
+
+	free(requests);
+	return nevicted;
+}
+
+/*
+ * Replaces the request ID of every session request with rid_map[rid],
+ * after requests have been merged together.
+ */
+void
+remap_session_map_requests(struct session_map *sm, const request_id_t *rid_map)
+{
+	assert(sm != NULL);
+	assert(rid_map != NULL);
+
+	for (size_t i = 0; i < SESSION_MAP_NSHARDS; i++) {
+		struct session_map_shard *shard = &sm->shards[i];
+		for (size_t s = 0; s < shard->nslots; s++) {
+			struct session_slot *slot = &shard->slots[s];
+			for (size_t r = 0; r < slot->nrequests; r++) {
+				struct session_request req;
+				get_session_slot_request(slot, r, &req);
+				req.rid = rid_map[req.rid];
+				if (!slot->wide
+				    && !is_compact_session_request(slot, req.ts, req.rid))
+					widen_session_slot(shard, slot, slot->nrequests);
+				set_session_slot_request(slot, r, req.ts, req.rid);
+			}
+		}
 	}
+}
+
+size_t
+count_session_map_entries(struct session_map *sm)
+{
+	assert(sm != NULL);
+
+	size_t nentries = 0;
+	for (size_t i = 0; i < SESSION_MAP_NSHARDS; i++)
+		nentries += sm->shards[i].nentries;
+
+	return nentries;
+}
+
+void
+init_session_map_iter(struct session_map_iter *iter)
+{
+	assert(iter != NULL);
+
+	iter->shard = 0;
+	iter->slot = 0;
+	iter->caprequests = 0;
+	iter->requests = NULL;
+}
+
+/*
+ * Sets entry to the next session of the session map, with its requests
+ * decoded into the buffer of the iterator, which is reused for the next
+ * session. Returns 0 when all sessions have been visited.
+ * The session map must not be modified during the iteration.
+ */
+int
+next_session_map_entry(struct session_map *sm, struct session_map_iter *iter,
+                       struct session_map_entry *entry)
+{
+	assert(sm != NULL);
+	assert(iter != NULL);
+	assert(entry != NULL);
+
+	while (iter->shard < SESSION_MAP_NSHARDS) {
+		struct session_map_shard *shard = &sm->shards[iter->shard];
+		while (iter->slot < shard->nslots) {
+			struct session_slot *slot = &shard->slots[iter->slot++];
+			if (slot->nrequests != 0) {
+				decode_session_slot(slot, entry, &iter->requests,
+				    &iter->caprequests);
+				return 1;
+			}
+		}
+
+		iter->shard++;
+		iter->slot = 0;
+	}
+
+	return 0;
+}
+
+void
+free_session_map_iter(struct session_map_iter *iter)
+{
+	assert(iter != NULL);
 
-	size_t r = entry->nrequests;
-	entry->requests[r].rid = rid;
-	entry->requests[r].ts = ts;
-	entry->nrequests++;
-finish:
-	ck_spinlock_unlock(lock);
+	free(iter->requests);
+	iter->caprequests = 0;
+	iter->requests = NULL;
 }
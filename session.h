@@ -4,35 +4,164 @@
 #include <ck_spinlock.h>
 #include <stdint.h>
 
+#include "arena.h"
 #include "request.h"
 
+/*
+ * Session IDs are 64-bit hashes of the session fields. Building with
+ * SESSION_ID_128 (make WITH_SID128=1) makes them 128 bits wide, from
+ * two independently seeded hashes, for logs with enough sessions for
+ * 64-bit IDs to collide.
+ */
+#ifdef SESSION_ID_128
+#ifndef __SIZEOF_INT128__
+#error "128-bit session IDs need a compiler with unsigned __int128"
+#endif
+typedef unsigned __int128 session_id_t;
+#else
 typedef uint64_t session_id_t;
-#define PRIuSID PRIu64
+#endif
 
 struct session_request {
 	request_id_t rid;
 	uint64_t     ts;
 };
 
-/* Session-specific information, stored in a hash table. */
+/*
+ * Session-specific information, as passed around outside the session
+ * map. The session map decodes the requests of the entries it returns
+ * into a buffer of the caller, such as that of a session map iterator.
+ */
 struct session_map_entry {
 	session_id_t sid;                       /* Session ID */
 	size_t       nrequests;                 /* Number of requests in session */
+	uint64_t     last_ts;                   /* Latest request timestamp */
 #define SESSION_MAP_ENTRY_INIT_CAPREQUESTS 8
 	size_t       caprequests;               /* Request buffer capacity */
 	struct       session_request *requests; /* Request buffer */
+};
 
-	UT_hash_handle hh;
+/*
+ * Session request as stored in the session map: a 32-bit request ID,
+ * and the timestamp as a signed 32-bit offset from the first request
+ * of the session, which covers sessions of over three weeks either way.
+ * Sessions with requests that do not fit are stored as plain session
+ * requests instead.
+ */
+struct session_map_request {
+	uint32_t rid;
+	int32_t  dts; /* Milliseconds from the base timestamp of the session */
 };
 
-#define SESSION_MAP_NBUCKETS    (1 << 16)
-#define SESSION_MAP_BUCKET_MASK (SESSION_MAP_NBUCKETS - 1)
+/*
+ * Slot of a session map shard. Sessions with up to SESSION_SLOT_NINLINE
+ * requests keep them in the slot itself, and larger sessions in a
+ * request buffer of their own.
+ */
+struct session_slot {
+	session_id_t sid;         /* Session ID */
+	uint64_t     base_ts;     /* Timestamp of the first request added */
+	uint64_t     last_ts;     /* Latest request timestamp */
+	uint32_t     nrequests;   /* Number of requests in session, 0 if the slot is empty */
+#define SESSION_SLOT_INLINE UINT8_MAX
+	uint8_t      buf_class;   /* Capacity class of the request buffer, SESSION_SLOT_INLINE if inline */
+	uint8_t      wide;        /* Requests are stored as struct session_request */
+	union {
+#define SESSION_SLOT_NINLINE 4
+		struct session_map_request inline_requests[SESSION_SLOT_NINLINE];
+		void                      *buf;
+	} requests;
+};
+
+/*
+ * Open-addressing table of sessions, probed linearly from the session ID.
+ *
+ * Request buffers of the sessions that outgrow their slots come from
+ * the arena of the shard, in capacity classes of
+ * SESSION_MAP_BUF_MIN_SIZE << class bytes. Buffers left behind by
+ * growing or evicted sessions are kept in a free list per class, for
+ * the next session that needs one.
+ */
+struct session_map_shard {
+	ck_spinlock_t        lock;
+	size_t               nslots;   /* Power of two, or 0 before the first session */
+	size_t               nentries;
+	struct session_slot *slots;
+#define SESSION_MAP_BUF_MIN_SIZE       (8 * sizeof(struct session_map_request))
+#define SESSION_MAP_SHARD_NBUF_CLASSES 32
+	struct arena         arena;
+	void                *free_bufs[SESSION_MAP_SHARD_NBUF_CLASSES];
+};
+
+/*
+ * Sessions are spread over shards by the low bits of their session IDs,
+ * each shard with its own lock and table, which grows as needed.
+ */
 struct session_map {
-	struct session_map_entry *handles[SESSION_MAP_NBUCKETS];
-	ck_spinlock_t             locks[SESSION_MAP_NBUCKETS];
+#define SESSION_MAP_NSHARDS_LOG2       8
+#define SESSION_MAP_NSHARDS            (1 << SESSION_MAP_NSHARDS_LOG2)
+#define SESSION_MAP_SHARD_INIT_NSLOTS  16
+#define SESSION_MAP_SHARD_MAX_LOAD_PCT 75
+	struct session_map_shard shards[SESSION_MAP_NSHARDS];
+};
+
+/*
+ * Position of an iteration over the sessions of a session map, with
+ * the buffer that the requests of each session are decoded into.
+ */
+struct session_map_iter {
+	size_t                  shard;
+	size_t                  slot;
+	size_t                  caprequests;
+	struct session_request *requests;
+};
+
+/* One parsed line, as far as sessions are concerned. */
+struct session_record {
+	session_id_t sid;
+	uint64_t     ts;
+	request_id_t rid;
+};
+
+/* Records belonging to one session map shard. */
+struct session_record_partition {
+#define SESSION_RECORD_PARTITION_INIT_CAPRECORDS 64
+	size_t                 nrecords;
+	size_t                 caprecords;
+	struct session_record *records;
+};
+
+/*
+ * Thread-local buffer of session records, partitioned by session map
+ * shard, so that each partition can later be merged into the session
+ * map by one thread without locking.
+ */
+struct session_records {
+#define SESSION_RECORDS_NPARTITIONS SESSION_MAP_NSHARDS
+	struct session_record_partition partitions[SESSION_RECORDS_NPARTITIONS];
 };
 
+session_id_t init_session_id(void);
+session_id_t update_session_id(session_id_t, const char *, size_t);
+session_id_t update_session_id_ipaddr(session_id_t, const char *);
+
 void init_session_map(struct session_map *);
 void amend_session_map_entry(struct session_map *, session_id_t, uint64_t ts, request_id_t);
+void add_session_map_entry(struct session_map *, session_id_t, const struct session_request *, size_t);
+
+void init_session_records(struct session_records *);
+void add_session_record(struct session_records *, session_id_t, uint64_t, request_id_t);
+void merge_session_records(struct session_map *, struct session_records **, size_t, size_t);
+
+/* Called with each session removed from the session map. */
+typedef void (*session_evict_fn)(void *, struct session_map_entry *);
+
+size_t evict_session_map_entries(struct session_map *, uint64_t, session_evict_fn, void *);
+void   remap_session_map_requests(struct session_map *, const request_id_t *);
+size_t count_session_map_entries(struct session_map *);
+
+void init_session_map_iter(struct session_map_iter *);
+int  next_session_map_entry(struct session_map *, struct session_map_iter *, struct session_map_entry *);
+void free_session_map_iter(struct session_map_iter *);
 
 #endif
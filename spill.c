@@ -0,0 +1,526 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spill.h"
+#include "util.h"
+
+/* Reading a run in smaller pieces than this costs more in seeks than it saves. */
+#define SPILL_MERGE_MIN_RECORDS 4096
+
+/* Position in one sorted run during a merge. */
+struct spill_cursor {
+	int                    fd;
+	uint64_t               offset;    /* File offset of the next unread record */
+	uint64_t               nunread;   /* Records left in the file */
+	size_t                 nrecords;  /* Records in the buffer */
+	size_t                 pos;       /* Next record in the buffer */
+	size_t                 caprecords;
+	struct session_record *records;
+};
+
+static int
+cmp_session_record(const void *a, const void *b)
+{
+	const struct session_record *ra = a;
+	const struct session_record *rb = b;
+
+	if (ra->sid != rb->sid)
+		return ra->sid < rb->sid ? -1 : 1;
+	if (ra->ts != rb->ts)
+		return ra->ts < rb->ts ? -1 : 1;
+	if (ra->rid != rb->rid)
+		return ra->rid < rb->rid ? -1 : 1;
+	return 0;
+}
+
+void
+init_spill_buffer(struct spill_buffer *sb, size_t caprecords)
+{
+	assert(sb != NULL);
+	assert(0 < caprecords);
+
+	sb->fd         = -1;
+	sb->file_size  = 0;
+	sb->nrecords   = 0;
+	sb->caprecords = caprecords;
+	sb->nruns      = 0;
+	sb->capruns    = 0;
+	sb->runs       = NULL;
+
+	sb->records = calloc(caprecords, sizeof(*sb->records));
+	if (sb->records == NULL)
+		ERR("%s", "calloc");
+}
+
+/*
+ * Creates the temporary file of a spill buffer in $TMPDIR, or /tmp.
+ * The file is unlinked right away, so that it is removed on exit.
+ */
+static void
+open_spill_file(struct spill_buffer *sb)
+{
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+
+	char path[strlen(dir) + sizeof("/apathy.XXXXXX")];
+	snprintf(path, sizeof(path), "%s/apathy.XXXXXX", dir);
+
+	sb->fd = mkstemp(path);
+	if (sb->fd == -1)
+		ERR("failed to create temporary file in '%s'", dir);
+	if (unlink(path) == -1)
+		ERR("failed to remove temporary file at '%s'", path);
+}
+
+/* Appends the buffered records to the file, and empties the buffer. */
+static void
+write_spill_records(struct spill_buffer *sb)
+{
+	const char *src = (const char *)sb->records;
+	size_t size = sb->nrecords * sizeof(*sb->records);
+	while (0 < size) {
+		ssize_t n = pwrite(sb->fd, src, size, (off_t)sb->file_size);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			ERR("%s", "failed to write temporary file");
+		}
+
+		src += n;
+		size -= (size_t)n;
+		sb->file_size += (uint64_t)n;
+	}
+
+	sb->nrecords = 0;
+}
+
+/*
+ * Sorts the buffered records, and appends them to the file
+ * as a new run.
+ */
+void
+flush_spill_buffer(struct spill_buffer *sb)
+{
+	assert(sb != NULL);
+
+	if (sb->nrecords == 0)
+		return;
+
+	if (sb->fd == -1)
+		open_spill_file(sb);
+
+	qsort(sb->records, sb->nrecords, sizeof(*sb->records),
+	    cmp_session_record);
+
+	if (sb->nruns == sb->capruns) {
+		size_t new_capruns = sb->capruns == 0 ? 16 : 2 * sb->capruns;
+		struct spill_run *new_runs = realloc(sb->runs,
+		    new_capruns * sizeof(*new_runs));
+		if (new_runs == NULL)
+			ERR("%s", "realloc");
+
+		sb->capruns = new_capruns;
+		sb->runs = new_runs;
+	}
+
+	struct spill_run *run = &sb->runs[sb->nruns++];
+	run->offset = sb->file_size;
+	run->nrecords = sb->nrecords;
+
+	write_spill_records(sb);
+}
+
+/*
+ * Buffers a session record, writing the buffer out as a sorted run
+ * first if it is full.
+ */
+void
+add_spill_record(struct spill_buffer *sb, session_id_t sid, uint64_t ts,
+                 request_id_t rid)
+{
+	assert(sb != NULL);
+
+	if (sb->nrecords == sb->caprecords)
+		flush_spill_buffer(sb);
+
+	struct session_record *record = &sb->records[sb->nrecords++];
+	record->sid = sid;
+	record->ts = ts;
+	record->rid = rid;
+}
+
+/*
+ * Reads the next records of a run into the buffer of its cursor.
+ * Returns 0 if the run has been read to its end.
+ */
+static int
+fill_spill_cursor(struct spill_cursor *cursor)
+{
+	size_t nrecords = (size_t)MIN(cursor->nunread, cursor->caprecords);
+	if (nrecords == 0)
+		return 0;
+
+	char *dst = (char *)cursor->records;
+	size_t size = nrecords * sizeof(*cursor->records);
+	while (0 < size) {
+		ssize_t n = pread(cursor->fd, dst, size, (off_t)cursor->offset);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			ERR("%s", "failed to read temporary file");
+		}
+		if (n == 0)
+			ERRX("%s", "temporary file was truncated");
+
+		dst += n;
+		size -= (size_t)n;
+		cursor->offset += (uint64_t)n;
+	}
+
+	cursor->nunread -= nrecords;
+	cursor->nrecords = nrecords;
+	cursor->pos = 0;
+	return 1;
+}
+
+static int
+cmp_spill_cursor(struct spill_cursor *a, struct spill_cursor *b)
+{
+	return cmp_session_record(&a->records[a->pos], &b->records[b->pos]);
+}
+
+/* Moves the cursor at index i down the min-heap to its place. */
+static void
+sift_spill_heap(struct spill_cursor **heap, size_t nheap, size_t i)
+{
+	while (1) {
+		size_t min = i;
+		size_t l = 2 * i + 1;
+		size_t r = 2 * i + 2;
+		if (l < nheap && cmp_spill_cursor(heap[l], heap[min]) < 0)
+			min = l;
+		if (r < nheap && cmp_spill_cursor(heap[r], heap[min]) < 0)
+			min = r;
+		if (min == i)
+			break;
+
+		struct spill_cursor *tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+/* Appends a request to a session being read back from the runs. */
+static void
+append_spill_session(struct session_map_entry *entry,
+                     struct session_record *record)
+{
+	if (entry->nrequests == entry->caprequests) {
+		assert(entry->caprequests < (SIZE_MAX / sizeof(*entry->requests) / 2));
+
+		size_t new_caprequests = 2 * entry->caprequests;
+		struct session_request *new_requests = realloc(entry->requests,
+		    new_caprequests * sizeof(*new_requests));
+		if (new_requests == NULL)
+			ERR("%s", "realloc");
+
+		entry->caprequests = new_caprequests;
+		entry->requests = new_requests;
+	}
+
+	struct session_request *req = &entry->requests[entry->nrequests++];
+	req->rid = record->rid;
+	req->ts = record->ts;
+	entry->last_ts = record->ts;
+}
+
+/* Called with each record of a merge, in session ID and timestamp order. */
+typedef void (*spill_record_fn)(void *, struct session_record *);
+
+/*
+ * Merges the records of the cursors with a min-heap, passing each one
+ * to fn. Cursors without records are left out.
+ */
+static void
+merge_spill_cursors(struct spill_cursor *cursors, size_t ncursors,
+                    spill_record_fn fn, void *ctx)
+{
+	struct spill_cursor **heap = calloc(MAX(1, ncursors), sizeof(*heap));
+	if (heap == NULL)
+		ERR("%s", "calloc");
+
+	size_t nheap = 0;
+	for (size_t c = 0; c < ncursors; c++) {
+		if (cursors[c].pos < cursors[c].nrecords)
+			heap[nheap++] = &cursors[c];
+	}
+
+	for (size_t i = nheap / 2; 0 < i; i--)
+		sift_spill_heap(heap, nheap, i - 1);
+
+	while (0 < nheap) {
+		struct spill_cursor *cursor = heap[0];
+		fn(ctx, &cursor->records[cursor->pos]);
+
+		cursor->pos++;
+		if (cursor->pos == cursor->nrecords && !fill_spill_cursor(cursor))
+			heap[0] = heap[--nheap];
+		sift_spill_heap(heap, nheap, 0);
+	}
+
+	free(heap);
+}
+
+/* Sorted run in one of the temporary files, during a merge. */
+struct spill_merge_run {
+	int      fd;
+	uint64_t offset;
+	uint64_t nrecords;
+};
+
+/*
+ * Merges runs with buffers of caprecords records each, passing each
+ * record to fn.
+ */
+static void
+merge_spill_runs(struct spill_merge_run *runs, size_t nruns,
+                 size_t caprecords, spill_record_fn fn, void *ctx)
+{
+	assert(0 < caprecords);
+
+	struct spill_cursor *cursors = calloc(MAX(1, nruns), sizeof(*cursors));
+	if (cursors == NULL)
+		ERR("%s", "calloc");
+
+	for (size_t c = 0; c < nruns; c++) {
+		struct spill_cursor *cursor = &cursors[c];
+		cursor->fd = runs[c].fd;
+		cursor->offset = runs[c].offset;
+		cursor->nunread = runs[c].nrecords;
+		cursor->caprecords = (size_t)MIN(caprecords, runs[c].nrecords);
+		cursor->records = calloc(MAX(1, cursor->caprecords),
+		    sizeof(*cursor->records));
+		if (cursor->records == NULL)
+			ERR("%s", "calloc");
+
+		fill_spill_cursor(cursor);
+	}
+
+	merge_spill_cursors(cursors, nruns, fn, ctx);
+
+	for (size_t c = 0; c < nruns; c++)
+		free(cursors[c].records);
+	free(cursors);
+}
+
+/* Appends each record to the buffer of a spill buffer, writing it when full. */
+static void
+write_spill_record(void *ctx, struct session_record *record)
+{
+	struct spill_buffer *sb = ctx;
+
+	sb->records[sb->nrecords++] = *record;
+	if (sb->nrecords == sb->caprecords)
+		write_spill_records(sb);
+}
+
+/* Sessions being put together from the records of a merge. */
+struct spill_sessions {
+	struct session_map_entry entry;
+	size_t                   nsessions;
+	spill_session_fn         fn;
+	void                    *ctx;
+};
+
+static void
+collect_spill_record(void *ctx, struct session_record *record)
+{
+	struct spill_sessions *ss = ctx;
+	struct session_map_entry *entry = &ss->entry;
+
+	if (entry->nrequests != 0 && entry->sid != record->sid) {
+		ss->fn(ss->ctx, entry);
+		entry->nrequests = 0;
+		ss->nsessions++;
+	}
+	entry->sid = record->sid;
+	append_spill_session(entry, record);
+}
+
+/*
+ * Merges the runs into fewer, longer runs in a temporary file of its
+ * own, until there are at most fanin of them, so that the buffers of
+ * each pass fit in mem_size bytes. Returns the new number of runs.
+ */
+static size_t
+reduce_spill_runs(struct spill_merge_run *runs, size_t nruns, size_t fanin,
+                  size_t mem_size, struct spill_buffer *out)
+{
+	/* Each pass reads fanin runs at a time, and buffers one output run. */
+	size_t caprecords = MAX(1, mem_size / (fanin + 1)
+	    / sizeof(struct session_record));
+
+	while (fanin < nruns) {
+		if (out->fd == -1) {
+			init_spill_buffer(out, caprecords);
+			open_spill_file(out);
+		}
+
+		size_t nmerged = 0;
+		for (size_t i = 0; i < nruns; i += fanin) {
+			size_t ngroup = MIN(fanin, nruns - i);
+			struct spill_merge_run merged = {
+				.fd       = out->fd,
+				.offset   = out->file_size,
+				.nrecords = 0
+			};
+			for (size_t r = i; r < i + ngroup; r++)
+				merged.nrecords += runs[r].nrecords;
+
+			merge_spill_runs(&runs[i], ngroup, caprecords,
+			    write_spill_record, out);
+			write_spill_records(out);
+			runs[nmerged++] = merged;
+		}
+		nruns = nmerged;
+	}
+
+	return nruns;
+}
+
+/*
+ * Flushes the spill buffers, and merges all of their runs by session
+ * ID and timestamp, passing each session to fn as a session map entry
+ * that is only valid during the call.
+ *
+ * If nothing was spilled, the buffers are sorted and merged in memory.
+ * Otherwise, the record buffers are freed before merging, and up to
+ * mem_size bytes are used for reading the runs, merging them in more
+ * than one pass if there are too many to read at once.
+ * Returns the number of sessions.
+ */
+size_t
+merge_spill_buffers(struct spill_buffer **sbs, size_t nsbs, size_t mem_size,
+                    spill_session_fn fn, void *ctx)
+{
+	assert(sbs != NULL);
+	assert(fn != NULL);
+
+	struct spill_sessions ss = {
+		.entry = {
+			.nrequests   = 0,
+			.caprequests = SESSION_MAP_ENTRY_INIT_CAPREQUESTS
+		},
+		.nsessions = 0,
+		.fn        = fn,
+		.ctx       = ctx
+	};
+	ss.entry.requests = calloc(ss.entry.caprequests,
+	    sizeof(*ss.entry.requests));
+	if (ss.entry.requests == NULL)
+		ERR("%s", "calloc");
+
+	size_t nruns = 0;
+	for (size_t i = 0; i < nsbs; i++)
+		nruns += sbs[i]->nruns;
+
+	if (nruns == 0) {
+		struct spill_cursor *cursors = calloc(MAX(1, nsbs), sizeof(*cursors));
+		if (cursors == NULL)
+			ERR("%s", "calloc");
+
+		for (size_t i = 0; i < nsbs; i++) {
+			struct spill_buffer *sb = sbs[i];
+			qsort(sb->records, sb->nrecords, sizeof(*sb->records),
+			    cmp_session_record);
+
+			cursors[i].fd = -1;
+			cursors[i].records = sb->records;
+			cursors[i].nrecords = sb->nrecords;
+			cursors[i].caprecords = sb->caprecords;
+		}
+
+		merge_spill_cursors(cursors, nsbs, collect_spill_record, &ss);
+		free(cursors);
+
+		for (size_t i = 0; i < nsbs; i++)
+			sbs[i]->nrecords = 0;
+	} else {
+		for (size_t i = 0; i < nsbs; i++) {
+			flush_spill_buffer(sbs[i]);
+			free(sbs[i]->records);
+			sbs[i]->records = NULL;
+			sbs[i]->caprecords = 0;
+		}
+
+		nruns = 0;
+		for (size_t i = 0; i < nsbs; i++)
+			nruns += sbs[i]->nruns;
+
+		struct spill_merge_run *runs = calloc(nruns, sizeof(*runs));
+		if (runs == NULL)
+			ERR("%s", "calloc");
+
+		for (size_t i = 0, c = 0; i < nsbs; i++) {
+			for (size_t r = 0; r < sbs[i]->nruns; r++, c++) {
+				runs[c].fd = sbs[i]->fd;
+				runs[c].offset = sbs[i]->runs[r].offset;
+				runs[c].nrecords = sbs[i]->runs[r].nrecords;
+			}
+		}
+
+		/*
+		 * Read at least SPILL_MERGE_MIN_RECORDS records of each run at
+		 * a time, even if that takes more than one pass.
+		 */
+		size_t fanin = MAX(2, mem_size / SPILL_MERGE_MIN_RECORDS
+		    / sizeof(struct session_record));
+
+		struct spill_buffer out = { .fd = -1 };
+		nruns = reduce_spill_runs(runs, nruns, fanin, mem_size, &out);
+
+		size_t caprecords = MAX(1, mem_size / nruns
+		    / sizeof(struct session_record));
+		free(out.records);
+		out.records = NULL;
+		out.caprecords = 0;
+		merge_spill_runs(runs, nruns, caprecords, collect_spill_record, &ss);
+
+		free_spill_buffer(&out);
+		free(runs);
+	}
+
+	if (ss.entry.nrequests != 0) {
+		fn(ctx, &ss.entry);
+		ss.nsessions++;
+	}
+
+	free(ss.entry.requests);
+	return ss.nsessions;
+}
+
+void
+free_spill_buffer(struct spill_buffer *sb)
+{
+	assert(sb != NULL);
+
+	if (sb->fd != -1 && close(sb->fd) == -1)
+		ERR("%s", "close");
+
+	free(sb->records);
+	free(sb->runs);
+	sb->fd = -1;
+	sb->records = NULL;
+	sb->runs = NULL;
+	sb->nrecords = 0;
+	sb->caprecords = 0;
+	sb->nruns = 0;
+	sb->capruns = 0;
+}
@@ -0,0 +1,40 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "session.h"
+
+/* Records of one sorted run, in the file of a spill buffer. */
+struct spill_run {
+	uint64_t offset;   /* File offset of the first record */
+	uint64_t nrecords;
+};
+
+/*
+ * Thread-local buffer of session records, for sessions that do not
+ * fit in memory. When the buffer is full, it is sorted by session ID
+ * and timestamp, and written to a temporary file as one run.
+ */
+struct spill_buffer {
+	int                    fd;        /* Unlinked temporary file */
+	uint64_t               file_size;
+	size_t                 nrecords;
+	size_t                 caprecords;
+	struct session_record *records;
+	size_t                 nruns;
+	size_t                 capruns;
+	struct spill_run      *runs;
+};
+
+/* Called with each session read back from the runs, in session ID order. */
+typedef void (*spill_session_fn)(void *, struct session_map_entry *);
+
+void   init_spill_buffer(struct spill_buffer *, size_t);
+void   add_spill_record(struct spill_buffer *, session_id_t, uint64_t, request_id_t);
+void   flush_spill_buffer(struct spill_buffer *);
+size_t merge_spill_buffers(struct spill_buffer **, size_t, size_t, spill_session_fn, void *);
+void   free_spill_buffer(struct spill_buffer *);
+
+#endif
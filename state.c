@@ -0,0 +1,467 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "state.h"
+#include "util.h"
+
+#define STATE_MAGIC   "APATHYST"
+#define STATE_VERSION 3
+
+static uint64_t
+hash_u64(uint64_t hash, uint64_t v)
+{
+	return hash64_update(hash, (const char *)&v, sizeof(v));
+}
+
+/*
+ * Hashes the options that decide what is read from each line, and how
+ * sessions are formed, so that a state file is not resumed with
+ * a different configuration.
+ */
+uint64_t
+hash_state_config(struct line_config *lc, struct truncate_patterns *tp,
+                  uint64_t session_timeout_ms)
+{
+	assert(lc != NULL);
+	assert(tp != NULL);
+
+	uint64_t hash = hash_line_config(hash64_init(), lc);
+
+	hash = hash_u64(hash, (uint64_t)tp->npatterns);
+	for (int i = 0; i < tp->npatterns; i++) {
+		hash = hash64_update(hash, tp->patterns[i],
+		    strlen(tp->patterns[i]) + 1);
+		hash = hash64_update(hash, tp->aliases[i],
+		    strlen(tp->aliases[i]) + 1);
+	}
+	hash = hash_u64(hash, (uint64_t)tp->segment_classes);
+	hash = hash_u64(hash, session_timeout_ms);
+	hash = hash_u64(hash, sizeof(session_id_t));
+
+	return hash;
+}
+
+static void
+write_u64(FILE *f, const char *path, uint64_t v)
+{
+	if (fwrite(&v, sizeof(v), 1, f) != 1)
+		ERR("failed to write state file at '%s'", path);
+}
+
+static void
+write_data(FILE *f, const char *path, const char *data, size_t size)
+{
+	write_u64(f, path, size);
+	if (size != 0 && fwrite(data, size, 1, f) != 1)
+		ERR("failed to write state file at '%s'", path);
+}
+
+static uint64_t
+read_u64(FILE *f, const char *path)
+{
+	uint64_t v;
+	if (fread(&v, sizeof(v), 1, f) != 1)
+		ERRX("truncated state file at '%s'", path);
+	return v;
+}
+
+/* Reads a length-prefixed string, returning it null-terminated. */
+static char *
+read_data(FILE *f, const char *path, size_t *sizep)
+{
+	uint64_t size = read_u64(f, path);
+	if (SIZE_MAX - 1 < size)
+		ERRX("corrupt state file at '%s'", path);
+
+	char *data = calloc(1, size + 1);
+	if (data == NULL)
+		ERR("%s", "calloc");
+	if (size != 0 && fread(data, size, 1, f) != 1)
+		ERRX("truncated state file at '%s'", path);
+
+	*sizep = size;
+	return data;
+}
+
+static session_id_t
+read_sid(FILE *f, const char *path)
+{
+	session_id_t sid;
+	if (fread(&sid, sizeof(sid), 1, f) != 1)
+		ERRX("truncated state file at '%s'", path);
+	return sid;
+}
+
+static void
+write_sid(FILE *f, const char *path, session_id_t sid)
+{
+	if (fwrite(&sid, sizeof(sid), 1, f) != 1)
+		ERR("failed to write state file at '%s'", path);
+}
+
+static double
+read_double(FILE *f, const char *path)
+{
+	double v;
+	if (fread(&v, sizeof(v), 1, f) != 1)
+		ERRX("truncated state file at '%s'", path);
+	return v;
+}
+
+static void
+write_double(FILE *f, const char *path, double v)
+{
+	if (fwrite(&v, sizeof(v), 1, f) != 1)
+		ERR("failed to write state file at '%s'", path);
+}
+
+/* Reads the path graph of evicted sessions into an empty graph. */
+static void
+read_path_graph(FILE *f, const char *path, struct path_graph *pg,
+                uint64_t nrequests)
+{
+	uint64_t nvertices = read_u64(f, path);
+	for (uint64_t v = 0; v < nvertices; v++) {
+		request_id_t rid = read_u64(f, path);
+		uint64_t min_depth = read_u64(f, path);
+		uint64_t nhits_in = read_u64(f, path);
+		uint64_t nedges = read_u64(f, path);
+		if (nrequests <= rid)
+			ERRX("corrupt state file at '%s'", path);
+
+		/* One-vertex graph, merged in to rebuild the edge lists */
+		struct path_graph_vertex vertex = NULL_VERTEX;
+		vertex.rid = rid;
+		vertex.min_depth = min_depth;
+		vertex.total_nhits_in = nhits_in;
+		vertex.nedges = nedges;
+		vertex.edges = calloc(nedges, sizeof(*vertex.edges));
+		if (nedges != 0 && vertex.edges == NULL)
+			ERR("%s", "calloc");
+		for (uint64_t e = 0; e < nedges; e++) {
+			vertex.edges[e].rid = read_u64(f, path);
+			vertex.edges[e].nhits = read_u64(f, path);
+			vertex.edges[e].duration_cma = read_double(f, path);
+			if (nrequests <= vertex.edges[e].rid)
+				ERRX("corrupt state file at '%s'", path);
+		}
+
+		struct path_graph src = {
+			.nvertices   = 1,
+			.capvertices = 1,
+			.vertices    = &vertex
+		};
+		merge_path_graph(pg, &src, NULL);
+		free(vertex.edges);
+	}
+}
+
+static void
+write_path_graph(FILE *f, const char *path, struct path_graph *pg)
+{
+	write_u64(f, path, pg->nvertices);
+	for (size_t v = 0; v < pg->capvertices; v++) {
+		struct path_graph_vertex *vertex = &pg->vertices[v];
+		if (is_null_vertex(vertex))
+			continue;
+
+		write_u64(f, path, vertex->rid);
+		write_u64(f, path, vertex->min_depth);
+		write_u64(f, path, vertex->total_nhits_in);
+		write_u64(f, path, vertex->nedges);
+		for (size_t e = 0; e < vertex->nedges; e++) {
+			write_u64(f, path, vertex->edges[e].rid);
+			write_u64(f, path, vertex->edges[e].nhits);
+			write_double(f, path, vertex->edges[e].duration_cma);
+		}
+	}
+}
+
+static struct state_input *
+find_state_input(struct state *state, const char *path)
+{
+	for (size_t i = 0; i < state->ninputs; i++) {
+		if (strcmp(state->inputs[i].path, path) == 0)
+			return &state->inputs[i];
+	}
+
+	return NULL;
+}
+
+static struct state_input *
+add_state_input(struct state *state, char *path)
+{
+	if (state->ninputs == state->capinputs) {
+		size_t new_capinputs = state->capinputs == 0
+		    ? 16 : 2 * state->capinputs;
+		struct state_input *new_inputs = realloc(state->inputs,
+		    new_capinputs * sizeof(*new_inputs));
+		if (new_inputs == NULL)
+			ERR("%s", "realloc");
+		state->capinputs = new_capinputs;
+		state->inputs = new_inputs;
+	}
+
+	struct state_input *si = &state->inputs[state->ninputs++];
+	memset(si, 0, sizeof(*si));
+	si->path = path;
+
+	return si;
+}
+
+/*
+ * Loads the state file at path into an empty request set, session map
+ * and path graph, so that new requests and sessions are added to them.
+ * Returns 0 if there is no state file yet.
+ */
+int
+load_state(struct state *state, const char *path, uint64_t config_hash,
+           struct request_set *rs, struct session_map *sm,
+           struct path_graph *pg)
+{
+	assert(state != NULL);
+	assert(path != NULL);
+	assert(rs != NULL);
+	assert(sm != NULL);
+	assert(pg != NULL);
+
+	memset(state, 0, sizeof(*state));
+	state->config_hash = config_hash;
+
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		ERR("failed to open state file at '%s'", path);
+	}
+
+	char magic[sizeof(STATE_MAGIC) - 1];
+	if (fread(magic, sizeof(magic), 1, f) != 1
+	 || memcmp(magic, STATE_MAGIC, sizeof(magic)) != 0
+	 || read_u64(f, path) != STATE_VERSION)
+		ERRX("'%s' is not a state file of this version", path);
+
+	if (read_u64(f, path) != config_hash)
+		ERRX("state file at '%s' was written with different fields, truncate patterns or session timeout",
+		     path);
+
+	uint64_t ninputs = read_u64(f, path);
+	for (uint64_t i = 0; i < ninputs; i++) {
+		size_t path_size;
+		struct state_input *si = add_state_input(state,
+		    read_data(f, path, &path_size));
+		si->offset    = read_u64(f, path);
+		si->head_size = read_u64(f, path);
+		si->head_hash = read_u64(f, path);
+	}
+
+	/* Requests are stored in ID order, so they get the same IDs again. */
+	uint64_t nrequests = read_u64(f, path);
+	for (uint64_t rid = REQUEST_ID_START; rid < nrequests; rid++) {
+		size_t size;
+		char *data = read_data(f, path, &size);
+		if (add_final_request(rs, data, size) != rid)
+			ERRX("corrupt state file at '%s'", path);
+		free(data);
+	}
+
+	uint64_t nsessions = read_u64(f, path);
+	for (uint64_t i = 0; i < nsessions; i++) {
+		session_id_t sid = read_sid(f, path);
+		uint64_t n = read_u64(f, path);
+		for (uint64_t r = 0; r < n; r++) {
+			request_id_t rid = read_u64(f, path);
+			uint64_t ts = read_u64(f, path);
+			if (nrequests <= rid)
+				ERRX("corrupt state file at '%s'", path);
+			amend_session_map_entry(sm, sid, ts, rid);
+		}
+	}
+
+	read_path_graph(f, path, pg, nrequests);
+
+	if (fgetc(f) != EOF)
+		ERRX("corrupt state file at '%s'", path);
+	fclose(f);
+
+	return 1;
+}
+
+/*
+ * Returns the canonical path of an input, so that the state matches
+ * regardless of the working directory, or NULL if the input
+ * is not a regular file that could be resumed.
+ */
+static char *
+get_state_input_path(struct input *input)
+{
+	if (input->fd != -1)
+		return NULL;
+
+	char *path = realpath(input->path, NULL);
+	if (path == NULL)
+		ERR("failed to resolve path of '%s'", input->path);
+
+	return path;
+}
+
+static uint64_t
+hash_input_head(struct input *input, size_t size)
+{
+	assert(size <= input->view.size);
+
+	uint64_t hash = hash64_init();
+	return hash64_update(hash, input->view.src, size);
+}
+
+/*
+ * Sets the inputs to continue where the previous run left off.
+ *
+ * Uncompressed logs are scanned from the stored offset, if the start
+ * of the log is unchanged. Otherwise the log has been rotated or
+ * rewritten, and is scanned from the start. A partial line at the end
+ * of a log is left for the next run, since it may still be written to.
+ *
+ * Compressed logs can not be resumed, so they are skipped if they are
+ * unchanged, and scanned in full otherwise.
+ * Standard input and named pipes are always scanned.
+ */
+void
+resume_inputs(struct state *state, struct input *inputs, size_t ninputs)
+{
+	assert(state != NULL);
+	assert(inputs != NULL);
+
+	for (size_t i = 0; i < ninputs; i++) {
+		struct input *input = &inputs[i];
+		char *path = get_state_input_path(input);
+		if (path == NULL)
+			continue;
+
+		if (input->type == INPUT_MAPPED)
+			trim_input_partial_line(input);
+
+		struct state_input *si = find_state_input(state, path);
+		free(path);
+		if (si == NULL)
+			continue;
+
+		int same_head = si->head_size <= input->view.size
+		    && si->head_size <= si->offset
+		    && hash_input_head(input, si->head_size) == si->head_hash;
+
+		if (input->type == INPUT_MAPPED) {
+			if (same_head && si->offset <= input->view.size)
+				input->scan_start = MIN(si->offset, input->scan_end);
+			else
+				WARNX("%s was truncated or rotated since the last run, reading it from the start",
+				      input->path);
+		} else {
+			if (same_head && si->offset == input->view.size)
+				input->skip = 1;
+			else
+				WARNX("%s was modified since the last run, reading it again in full",
+				      input->path);
+		}
+	}
+}
+
+/* Stores how far each input was read in this run. */
+void
+record_inputs(struct state *state, struct input *inputs, size_t ninputs)
+{
+	assert(state != NULL);
+	assert(inputs != NULL);
+
+	for (size_t i = 0; i < ninputs; i++) {
+		struct input *input = &inputs[i];
+		char *path = get_state_input_path(input);
+		if (path == NULL)
+			continue;
+
+		struct state_input *si = find_state_input(state, path);
+		if (si == NULL)
+			si = add_state_input(state, path);
+		else
+			free(path);
+
+		si->offset = input->type == INPUT_MAPPED
+		    ? input->scan_end : input->view.size;
+		si->head_size = MIN(si->offset, STATE_INPUT_HEAD_SIZE);
+		si->head_hash = hash_input_head(input, si->head_size);
+	}
+}
+
+/*
+ * Writes the state to a temporary file, which then replaces the
+ * state file, so that an interrupted run leaves the old state intact.
+ */
+void
+save_state(struct state *state, const char *path, struct request_set *rs,
+           struct session_map *sm, struct path_graph *pg)
+{
+	assert(state != NULL);
+	assert(path != NULL);
+	assert(rs != NULL);
+	assert(sm != NULL);
+	assert(pg != NULL);
+
+	size_t tmp_path_size = strlen(path) + sizeof(".tmp");
+	char *tmp_path = calloc(1, tmp_path_size);
+	if (tmp_path == NULL)
+		ERR("%s", "calloc");
+	snprintf(tmp_path, tmp_path_size, "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (f == NULL)
+		ERR("failed to create state file at '%s'", tmp_path);
+
+	if (fwrite(STATE_MAGIC, sizeof(STATE_MAGIC) - 1, 1, f) != 1)
+		ERR("failed to write state file at '%s'", tmp_path);
+	write_u64(f, tmp_path, STATE_VERSION);
+	write_u64(f, tmp_path, state->config_hash);
+
+	write_u64(f, tmp_path, state->ninputs);
+	for (size_t i = 0; i < state->ninputs; i++) {
+		struct state_input *si = &state->inputs[i];
+		write_data(f, tmp_path, si->path, strlen(si->path));
+		write_u64(f, tmp_path, si->offset);
+		write_u64(f, tmp_path, si->head_size);
+		write_u64(f, tmp_path, si->head_hash);
+	}
+
+	struct request_table rt;
+	gen_request_table(&rt, rs);
+	write_u64(f, tmp_path, rt.nrequests);
+	for (size_t rid = 0; rid < rt.nrequests; rid++)
+		write_data(f, tmp_path, rt.requests[rid], strlen(rt.requests[rid]));
+	free_request_table(&rt);
+
+	write_u64(f, tmp_path, count_session_map_entries(sm));
+	struct session_map_iter iter;
+	struct session_map_entry entry;
+	init_session_map_iter(&iter);
+	while (next_session_map_entry(sm, &iter, &entry)) {
+		write_sid(f, tmp_path, entry.sid);
+		write_u64(f, tmp_path, entry.nrequests);
+		for (size_t r = 0; r < entry.nrequests; r++) {
+			write_u64(f, tmp_path, entry.requests[r].rid);
+			write_u64(f, tmp_path, entry.requests[r].ts);
+		}
+	}
+	free_session_map_iter(&iter);
+
+	write_path_graph(f, tmp_path, pg);
+
+	if (fclose(f) != 0)
+		ERR("failed to write state file at '%s'", tmp_path);
+	if (rename(tmp_path, path) == -1)
+		ERR("failed to replace state file at '%s'", path);
+
+	free(tmp_path);
+}
@@ -0,0 +1,44 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "field.h"
+#include "input.h"
+#include "path_graph.h"
+#include "request.h"
+#include "session.h"
+#include "truncate.h"
+
+/* How far one log was read in a previous run. */
+struct state_input {
+#define STATE_INPUT_HEAD_SIZE 4096
+	char     *path;
+	uint64_t  offset;    /* Bytes read, ending at a line boundary */
+	uint64_t  head_size; /* Bytes covered by head_hash */
+	uint64_t  head_hash; /* Hash of the start of the log, for detecting rotation */
+};
+
+/*
+ * Checkpoint of a previous run, for scanning only the data appended
+ * to the logs since then.
+ *
+ * The state file holds the read offset of each log, along with
+ * the request set and the session map built so far, and the path graph
+ * of sessions evicted from the session map, if any.
+ */
+struct state {
+	uint64_t            config_hash; /* Hash of the options affecting the scan */
+	size_t              ninputs;
+	size_t              capinputs;
+	struct state_input *inputs;
+};
+
+uint64_t hash_state_config(struct line_config *, struct truncate_patterns *, uint64_t);
+int      load_state(struct state *, const char *, uint64_t, struct request_set *, struct session_map *, struct path_graph *);
+void     resume_inputs(struct state *, struct input *, size_t);
+void     record_inputs(struct state *, struct input *, size_t);
+void     save_state(struct state *, const char *, struct request_set *, struct session_map *, struct path_graph *);
+
+#endif
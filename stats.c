@@ -0,0 +1,195 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "stats.h"
+#include "util.h"
+
+static const char *
+stats_phase_str(enum stats_phase phase)
+{
+	static const char *table[STATS_NPHASES] = {
+		[STATS_PHASE_MMAP]          = "mmap",
+		[STATS_PHASE_LINE_CONFIG]   = "line_config",
+		[STATS_PHASE_STATE]         = "state",
+		[STATS_PHASE_CACHE]         = "cache",
+		[STATS_PHASE_SCAN]          = "scan",
+		[STATS_PHASE_MERGE]         = "merge",
+		[STATS_PHASE_TEMPLATES]     = "templates",
+		[STATS_PHASE_REQUEST_TABLE] = "request_table",
+		[STATS_PHASE_PATH_GRAPH]    = "path_graph",
+		[STATS_PHASE_OUTPUT]        = "output"
+	};
+
+	assert(phase < STATS_NPHASES);
+	return table[phase];
+}
+
+enum stats_format
+str_to_stats_format(const char *s)
+{
+	assert(s != NULL);
+
+	if (strcmp(s, "human") == 0)
+		return STATS_FORMAT_HUMAN;
+	if (strcmp(s, "json") == 0)
+		return STATS_FORMAT_JSON;
+
+	return STATS_FORMAT_INVALID;
+}
+
+static void
+get_clock(clockid_t clock_id, struct timespec *ts)
+{
+	if (clock_gettime(clock_id, ts) == -1)
+		ERR("%s", "clock_gettime");
+}
+
+static double
+diff_ms(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3
+	     + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+void
+init_stats(struct stats *stats)
+{
+	assert(stats != NULL);
+
+	memset(stats, 0, sizeof(*stats));
+}
+
+void
+start_stats_phase(struct stats_clock *clock)
+{
+	assert(clock != NULL);
+
+	get_clock(CLOCK_MONOTONIC, &clock->wall);
+	get_clock(CLOCK_PROCESS_CPUTIME_ID, &clock->cpu);
+}
+
+/*
+ * Adds the time elapsed since start_stats_phase() to the given phase.
+ */
+void
+end_stats_phase(struct stats *stats, enum stats_phase phase,
+                struct stats_clock *clock)
+{
+	assert(stats != NULL);
+	assert(phase < STATS_NPHASES);
+	assert(clock != NULL);
+
+	struct stats_clock now;
+	start_stats_phase(&now);
+
+	stats->wall_ms[phase] += diff_ms(&clock->wall, &now.wall);
+	stats->cpu_ms[phase] += diff_ms(&clock->cpu, &now.cpu);
+}
+
+/* Returns the peak resident set size of the process in kilobytes. */
+static long
+get_peak_rss_kb(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		ERR("%s", "getrusage");
+
+	return usage.ru_maxrss;
+}
+
+static double
+per_sec(uint64_t n, double ms)
+{
+	if (ms <= 0.0)
+		return 0.0;
+
+	return n / (ms / 1e3);
+}
+
+static void
+output_stats_human(FILE *out, struct stats *stats, double total_wall_ms,
+                   double total_cpu_ms)
+{
+	double scan_ms = stats->wall_ms[STATS_PHASE_SCAN];
+
+	fprintf(out, "%-16s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+	for (size_t p = 0; p < STATS_NPHASES; p++) {
+		fprintf(out, "%-16s %12.3f %12.3f\n", stats_phase_str(p),
+		    stats->wall_ms[p], stats->cpu_ms[p]);
+	}
+	fprintf(out, "%-16s %12.3f %12.3f\n", "total", total_wall_ms,
+	    total_cpu_ms);
+	fprintf(out, "\n");
+	fprintf(out, "bytes:           %" PRIu64 "\n", stats->nbytes);
+	fprintf(out, "lines:           %" PRIu64 "\n", stats->nlines);
+	fprintf(out, "skipped lines:   %" PRIu64 "\n", stats->nskipped_lines);
+	fprintf(out, "unique requests: %" PRIu64 "\n", stats->nrequests);
+	fprintf(out, "sessions:        %" PRIu64 "\n", stats->nsessions);
+	fprintf(out, "scan bytes/s:    %.0f (%.3f GB/s)\n",
+	    per_sec(stats->nbytes, scan_ms),
+	    per_sec(stats->nbytes, scan_ms) / 1e9);
+	fprintf(out, "scan lines/s:    %.0f\n", per_sec(stats->nlines, scan_ms));
+	fprintf(out, "peak RSS:        %ld KB\n", stats->peak_rss_kb);
+}
+
+static void
+output_stats_json(FILE *out, struct stats *stats, double total_wall_ms,
+                  double total_cpu_ms)
+{
+	double scan_ms = stats->wall_ms[STATS_PHASE_SCAN];
+
+	fprintf(out, "{\"phases\":{");
+	for (size_t p = 0; p < STATS_NPHASES; p++) {
+		fprintf(out, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+		    p == 0 ? "" : ",", stats_phase_str(p),
+		    stats->wall_ms[p], stats->cpu_ms[p]);
+	}
+	fprintf(out, "},");
+	fprintf(out, "\"total_wall_ms\":%.3f,", total_wall_ms);
+	fprintf(out, "\"total_cpu_ms\":%.3f,", total_cpu_ms);
+	fprintf(out, "\"bytes\":%" PRIu64 ",", stats->nbytes);
+	fprintf(out, "\"lines\":%" PRIu64 ",", stats->nlines);
+	fprintf(out, "\"skipped_lines\":%" PRIu64 ",", stats->nskipped_lines);
+	fprintf(out, "\"unique_requests\":%" PRIu64 ",", stats->nrequests);
+	fprintf(out, "\"sessions\":%" PRIu64 ",", stats->nsessions);
+	fprintf(out, "\"scan_bytes_per_sec\":%.0f,", per_sec(stats->nbytes, scan_ms));
+	fprintf(out, "\"scan_lines_per_sec\":%.0f,", per_sec(stats->nlines, scan_ms));
+	fprintf(out, "\"peak_rss_kb\":%ld}\n", stats->peak_rss_kb);
+}
+
+/*
+ * Writes the statistics to out. Throughput is relative to
+ * the wall time of the scan phase only.
+ */
+void
+output_stats(FILE *out, struct stats *stats, enum stats_format format)
+{
+	assert(out != NULL);
+	assert(stats != NULL);
+
+	stats->peak_rss_kb = get_peak_rss_kb();
+
+	double total_wall_ms = 0.0;
+	double total_cpu_ms = 0.0;
+	for (size_t p = 0; p < STATS_NPHASES; p++) {
+		total_wall_ms += stats->wall_ms[p];
+		total_cpu_ms += stats->cpu_ms[p];
+	}
+
+	switch (format) {
+	case STATS_FORMAT_HUMAN:
+		output_stats_human(out, stats, total_wall_ms, total_cpu_ms);
+		break;
+	case STATS_FORMAT_JSON:
+		output_stats_json(out, stats, total_wall_ms, total_cpu_ms);
+		break;
+	case STATS_FORMAT_INVALID:
+	default:
+		assert(0 && "NOTREACHED");
+		break;
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+enum stats_phase {
+	STATS_PHASE_MMAP = 0,
+	STATS_PHASE_LINE_CONFIG,
+	STATS_PHASE_STATE,
+	STATS_PHASE_CACHE,
+	STATS_PHASE_SCAN,
+	STATS_PHASE_MERGE,
+	STATS_PHASE_TEMPLATES,
+	STATS_PHASE_REQUEST_TABLE,
+	STATS_PHASE_PATH_GRAPH,
+	STATS_PHASE_OUTPUT,
+	STATS_NPHASES
+};
+
+enum stats_format {
+	STATS_FORMAT_HUMAN = 0,
+	STATS_FORMAT_JSON,
+	STATS_FORMAT_INVALID
+};
+
+/* Start of a phase, as seen by a wall clock and a CPU clock. */
+struct stats_clock {
+	struct timespec wall;
+	struct timespec cpu;  /* All threads of the process */
+};
+
+/* Run statistics, for tracking performance without a profiler. */
+struct stats {
+	double   wall_ms[STATS_NPHASES];
+	double   cpu_ms[STATS_NPHASES];
+	uint64_t nbytes;
+	uint64_t nlines;
+	uint64_t nskipped_lines;
+	uint64_t nrequests;
+	uint64_t nsessions;
+	long     peak_rss_kb;
+};
+
+void init_stats(struct stats *);
+void start_stats_phase(struct stats_clock *);
+void end_stats_phase(struct stats *, enum stats_phase, struct stats_clock *);
+void output_stats(FILE *, struct stats *, enum stats_format);
+
+enum stats_format str_to_stats_format(const char *);
+
+#endif
@@ -0,0 +1,272 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream.h"
+#include "util.h"
+
+static void
+lock_block_stream(struct block_stream *bs)
+{
+	if (pthread_mutex_lock(&bs->lock) != 0)
+		ERRX("%s", "pthread_mutex_lock");
+}
+
+static void
+unlock_block_stream(struct block_stream *bs)
+{
+	if (pthread_mutex_unlock(&bs->lock) != 0)
+		ERRX("%s", "pthread_mutex_unlock");
+}
+
+/* Waits until a block is free for the producer to fill. */
+static struct stream_block *
+wait_free_block(struct block_stream *bs)
+{
+	lock_block_stream(bs);
+	while (bs->nfree_blocks == 0)
+		pthread_cond_wait(&bs->released, &bs->lock);
+	struct stream_block *block = bs->free_blocks[--bs->nfree_blocks];
+	unlock_block_stream(bs);
+
+	return block;
+}
+
+static void
+queue_block(struct block_stream *bs, struct stream_block *block)
+{
+	lock_block_stream(bs);
+	assert(bs->queue_len < bs->nblocks);
+	bs->queue[(bs->queue_head + bs->queue_len) % bs->nblocks] = block;
+	bs->queue_len++;
+	pthread_cond_signal(&bs->filled);
+	unlock_block_stream(bs);
+}
+
+/* Returns the last newline in src, or NULL if there is none. */
+static const char *
+find_last_newline(const char *src, size_t size)
+{
+	while (0 < size) {
+		if (src[--size] == '\n')
+			return src + size;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fills blocks from one source until the read function returns 0.
+ * A partial line at the end of a block is carried over to the next one,
+ * unless it fills the whole block, in which case it is split.
+ */
+static void
+read_stream_source(struct block_stream *bs, void *source, char *carry)
+{
+	size_t carry_size = 0;
+
+	int eof = 0;
+	while (!eof) {
+		struct stream_block *block = wait_free_block(bs);
+
+		memcpy(block->data, carry, carry_size);
+		size_t size = carry_size;
+		carry_size = 0;
+
+		while (size < STREAM_BLOCK_SIZE) {
+			size_t n = bs->read(source, block->data + size,
+			    STREAM_BLOCK_SIZE - size);
+			if (n == 0) {
+				eof = 1;
+				break;
+			}
+			size += n;
+		}
+
+		if (!eof) {
+			const char *nl = find_last_newline(block->data, size);
+			if (nl != NULL) {
+				size_t line_end = nl + 1 - block->data;
+				carry_size = size - line_end;
+				memcpy(carry, block->data + line_end, carry_size);
+				size = line_end;
+			}
+		}
+
+		if (size == 0) {
+			release_stream_block(bs, block);
+			continue;
+		}
+
+		if (block->data[size - 1] != '\n')
+			block->data[size++] = '\n';
+		block->data[size] = '\0';
+		block->size = size;
+
+		queue_block(bs, block);
+	}
+}
+
+/* Reads sources in order, until none are left. */
+static void *
+run_stream_producer(void *ctx)
+{
+	assert(ctx != NULL);
+
+	struct block_stream *bs = ctx;
+
+	char *carry = malloc(STREAM_BLOCK_SIZE);
+	if (carry == NULL)
+		ERR("%s", "malloc");
+
+	while (1) {
+		lock_block_stream(bs);
+		size_t i = bs->next_source;
+		if (i < bs->nsources)
+			bs->next_source++;
+		unlock_block_stream(bs);
+
+		if (bs->nsources <= i)
+			break;
+
+		read_stream_source(bs, bs->sources[i], carry);
+	}
+
+	free(carry);
+
+	lock_block_stream(bs);
+	if (--bs->nrunning == 0) {
+		bs->done = 1;
+		pthread_cond_broadcast(&bs->filled);
+	}
+	unlock_block_stream(bs);
+
+	return NULL;
+}
+
+/*
+ * Starts nproducers threads filling nblocks blocks with data
+ * read from the sources.
+ * With two blocks per worker thread, each worker can scan one block
+ * while the next one is being filled, and each producer needs one
+ * more block to fill.
+ */
+void
+start_block_stream(struct block_stream *bs, stream_read_fn read,
+                   void **sources, size_t nsources, size_t nblocks,
+                   size_t nproducers)
+{
+	assert(bs != NULL);
+	assert(read != NULL);
+	assert(sources != NULL);
+	assert(0 < nsources);
+	assert(0 < nblocks);
+	assert(0 < nproducers);
+
+	memset(bs, 0, sizeof(*bs));
+	bs->read = read;
+	bs->sources = sources;
+	bs->nsources = nsources;
+	bs->nblocks = nblocks;
+	bs->nproducers = nproducers;
+	bs->nrunning = nproducers;
+
+	bs->blocks = calloc(nblocks, sizeof(*bs->blocks));
+	if (bs->blocks == NULL)
+		ERR("%s", "calloc");
+
+	bs->queue = calloc(nblocks, sizeof(*bs->queue));
+	if (bs->queue == NULL)
+		ERR("%s", "calloc");
+
+	bs->free_blocks = calloc(nblocks, sizeof(*bs->free_blocks));
+	if (bs->free_blocks == NULL)
+		ERR("%s", "calloc");
+
+	/* Room for an added newline and the terminator */
+	size_t block_cap = STREAM_BLOCK_SIZE + 2 + STREAM_BLOCK_PADDING;
+	for (size_t i = 0; i < nblocks; i++) {
+		bs->blocks[i].data = calloc(block_cap, 1);
+		if (bs->blocks[i].data == NULL)
+			ERR("%s", "calloc");
+		bs->free_blocks[bs->nfree_blocks++] = &bs->blocks[i];
+	}
+
+	bs->producers = calloc(nproducers, sizeof(*bs->producers));
+	if (bs->producers == NULL)
+		ERR("%s", "calloc");
+
+	if (pthread_mutex_init(&bs->lock, NULL) != 0)
+		ERRX("%s", "pthread_mutex_init");
+	if (pthread_cond_init(&bs->filled, NULL) != 0)
+		ERRX("%s", "pthread_cond_init");
+	if (pthread_cond_init(&bs->released, NULL) != 0)
+		ERRX("%s", "pthread_cond_init");
+
+	for (size_t i = 0; i < nproducers; i++) {
+		if (pthread_create(&bs->producers[i], NULL, run_stream_producer, bs) != 0)
+			ERR("%s", "pthread_create");
+	}
+}
+
+/*
+ * Waits for the next filled block.
+ * Returns NULL once all blocks have been claimed.
+ */
+struct stream_block *
+claim_stream_block(struct block_stream *bs)
+{
+	assert(bs != NULL);
+
+	lock_block_stream(bs);
+	while (bs->queue_len == 0 && !bs->done)
+		pthread_cond_wait(&bs->filled, &bs->lock);
+
+	struct stream_block *block = NULL;
+	if (bs->queue_len != 0) {
+		block = bs->queue[bs->queue_head];
+		bs->queue_head = (bs->queue_head + 1) % bs->nblocks;
+		bs->queue_len--;
+	}
+	unlock_block_stream(bs);
+
+	return block;
+}
+
+/* Gives a scanned block back to the producer. */
+void
+release_stream_block(struct block_stream *bs, struct stream_block *block)
+{
+	assert(bs != NULL);
+	assert(block != NULL);
+
+	lock_block_stream(bs);
+	assert(bs->nfree_blocks < bs->nblocks);
+	bs->free_blocks[bs->nfree_blocks++] = block;
+	pthread_cond_signal(&bs->released);
+	unlock_block_stream(bs);
+}
+
+/* Waits for the producers to finish, and frees the blocks. */
+void
+finish_block_stream(struct block_stream *bs)
+{
+	assert(bs != NULL);
+
+	for (size_t i = 0; i < bs->nproducers; i++) {
+		if (pthread_join(bs->producers[i], NULL) != 0)
+			ERR("%s", "pthread_join");
+	}
+
+	for (size_t i = 0; i < bs->nblocks; i++)
+		free(bs->blocks[i].data);
+	free(bs->blocks);
+	free(bs->queue);
+	free(bs->free_blocks);
+	free(bs->producers);
+
+	pthread_mutex_destroy(&bs->lock);
+	pthread_cond_destroy(&bs->filled);
+	pthread_cond_destroy(&bs->released);
+}
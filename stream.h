@@ -0,0 +1,57 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Reads at most n bytes into dst, returning 0 at the end of input. */
+typedef size_t (*stream_read_fn)(void *, char *, size_t);
+
+/*
+ * Line-aligned block of input, ending with a newline and
+ * terminated with '\0'. The data is padded so that the block-wise
+ * field scanners may read past the terminator.
+ */
+struct stream_block {
+#define STREAM_BLOCK_SIZE    (2 * 1024 * 1024)
+#define STREAM_BLOCK_PADDING 64
+	char   *data;
+	size_t  size;
+};
+
+/*
+ * Bounded pool of blocks filled by producer threads, and handed
+ * to worker threads as they become available.
+ * Each producer reads one source at a time, until all have been read.
+ * Memory use is fixed at nblocks blocks, regardless of input size.
+ */
+struct block_stream {
+	stream_read_fn        read;
+	void                **sources;
+	size_t                nsources;
+	size_t                next_source; /* Index of next unread source */
+
+	size_t                nblocks;
+	struct stream_block  *blocks;
+	struct stream_block **queue;      /* Filled blocks, in a ring */
+	size_t                queue_head;
+	size_t                queue_len;
+	struct stream_block **free_blocks;
+	size_t                nfree_blocks;
+	int                   done;       /* No more blocks will be queued */
+
+	size_t                nproducers;
+	size_t                nrunning;   /* Producers still reading */
+	pthread_t            *producers;
+
+	pthread_mutex_t       lock;
+	pthread_cond_t        filled;
+	pthread_cond_t        released;
+};
+
+void                 start_block_stream(struct block_stream *, stream_read_fn, void **, size_t, size_t, size_t);
+struct stream_block *claim_stream_block(struct block_stream *);
+void                 release_stream_block(struct block_stream *, struct stream_block *);
+void                 finish_block_stream(struct block_stream *);
+
+#endif
@@ -0,0 +1,386 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "path_graph.h"
+#include "request.h"
+#include "session.h"
+#include "template.h"
+#include "truncate.h"
+#include "util.h"
+
+/*
+ * Endpoint template inference.
+ *
+ * Requests are split into segments at slashes and whitespace, and
+ * inserted into a trie one segment depth at a time. Before the children
+ * of a trie node are created, the number of distinct segments below it
+ * is estimated with a small HyperLogLog sketch, and if it is too high,
+ * all of them are replaced with a single TEMPLATE_PARAM_ALIAS child.
+ * This way the trie, and the resulting set of requests, stays small
+ * even if the URLs contain IDs that no truncate pattern knows of.
+ *
+ * Inference runs after the scan, over the requests already interned
+ * in the request set, so it does not bound memory use during the scan.
+ * Requests are truncated while scanning, so a segment replaced with
+ * a truncate alias counts as a single distinct value here.
+ */
+
+#define TEMPLATE_HLL_NREGISTERS_LOG2 6
+#define TEMPLATE_HLL_NREGISTERS      (1 << TEMPLATE_HLL_NREGISTERS_LOG2)
+#define TEMPLATE_HLL_ALPHA           0.709 /* Bias correction for 64 registers */
+
+#define TEMPLATE_DEPTH_MAX 64 /* Deeper segments are never collapsed */
+
+#define TEMPLATE_TRIE_INIT_CAPNODES    (1 << 10)
+#define TEMPLATE_TRIE_INIT_CAPCHILDREN (1 << 11)
+#define TEMPLATE_PARAM_HASH            0
+
+struct template_node {
+	uint8_t registers[TEMPLATE_HLL_NREGISTERS]; /* Distinct child segments */
+	int     is_param;                           /* Children collapsed into one */
+};
+
+/* Child link in the trie, keyed by parent node and segment hash. */
+struct template_child {
+	uint64_t segment_hash;
+	size_t   parent;
+	size_t   node; /* 0 if unused, since the root is nobody's child */
+};
+
+struct template_trie {
+	size_t                 nnodes;
+	size_t                 capnodes;
+	struct template_node  *nodes;
+	size_t                 nchildren;
+	size_t                 capchildren; /* Power of two */
+	struct template_child *children;
+};
+
+/* Trie insertion state of one request. */
+struct template_request {
+	struct request_set_entry *entry;
+	size_t                    offset;       /* Start of current segment */
+	size_t                    segment_size;
+	uint64_t                  segment_hash;
+	size_t                    node;         /* Parent of current segment */
+	uint64_t                  params;       /* Bit set of collapsed segment depths */
+	int                       active;
+};
+
+/* Finalizer from MurmurHash3, for combining a segment hash with its parent node. */
+static uint64_t
+mix_hash64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static size_t
+add_template_node(struct template_trie *trie)
+{
+	if (trie->nnodes == trie->capnodes) {
+		size_t new_capnodes = 2 * trie->capnodes;
+		struct template_node *new_nodes = realloc(trie->nodes,
+		    new_capnodes * sizeof(*new_nodes));
+		if (new_nodes == NULL)
+			ERR("%s", "realloc");
+
+		trie->capnodes = new_capnodes;
+		trie->nodes = new_nodes;
+	}
+
+	size_t node = trie->nnodes++;
+	memset(&trie->nodes[node], 0, sizeof(trie->nodes[node]));
+
+	return node;
+}
+
+static struct template_child *
+alloc_template_children(size_t capchildren)
+{
+	struct template_child *children = calloc(capchildren, sizeof(*children));
+	if (children == NULL)
+		ERR("%s", "calloc");
+
+	return children;
+}
+
+static void
+init_template_trie(struct template_trie *trie)
+{
+	trie->nnodes = 0;
+	trie->capnodes = TEMPLATE_TRIE_INIT_CAPNODES;
+	trie->nodes = calloc(trie->capnodes, sizeof(*trie->nodes));
+	if (trie->nodes == NULL)
+		ERR("%s", "calloc");
+
+	trie->nchildren = 0;
+	trie->capchildren = TEMPLATE_TRIE_INIT_CAPCHILDREN;
+	trie->children = alloc_template_children(trie->capchildren);
+
+	/* Root */
+	add_template_node(trie);
+}
+
+static void
+free_template_trie(struct template_trie *trie)
+{
+	free(trie->nodes);
+	free(trie->children);
+}
+
+static size_t
+get_template_child_slot(struct template_child *children, size_t capchildren,
+                        size_t parent, uint64_t segment_hash)
+{
+	size_t mask = capchildren - 1;
+	size_t i = mix_hash64(segment_hash ^ parent) & mask;
+	while (children[i].node != 0
+	    && (children[i].parent != parent
+	     || children[i].segment_hash != segment_hash))
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+static void
+grow_template_children(struct template_trie *trie)
+{
+	size_t new_capchildren = 2 * trie->capchildren;
+	struct template_child *new_children = alloc_template_children(new_capchildren);
+
+	for (size_t i = 0; i < trie->capchildren; i++) {
+		struct template_child *child = &trie->children[i];
+		if (child->node == 0)
+			continue;
+
+		size_t slot = get_template_child_slot(new_children,
+		    new_capchildren, child->parent, child->segment_hash);
+		new_children[slot] = *child;
+	}
+
+	free(trie->children);
+	trie->capchildren = new_capchildren;
+	trie->children = new_children;
+}
+
+/*
+ * Returns the child of node parent for the segment hash,
+ * creating it if it does not exist.
+ */
+static size_t
+get_template_child(struct template_trie *trie, size_t parent,
+                   uint64_t segment_hash)
+{
+	/* Keep load under 50% */
+	if (trie->capchildren <= 2 * (trie->nchildren + 1))
+		grow_template_children(trie);
+
+	size_t slot = get_template_child_slot(trie->children,
+	    trie->capchildren, parent, segment_hash);
+	struct template_child *child = &trie->children[slot];
+	if (child->node == 0) {
+		child->segment_hash = segment_hash;
+		child->parent = parent;
+		child->node = add_template_node(trie);
+		trie->nchildren++;
+	}
+
+	return child->node;
+}
+
+static void
+add_template_hll(struct template_node *node, uint64_t segment_hash)
+{
+	size_t r = segment_hash & (TEMPLATE_HLL_NREGISTERS - 1);
+	uint64_t rest = segment_hash >> TEMPLATE_HLL_NREGISTERS_LOG2;
+	uint8_t rank = rest == 0
+	    ? 64 - TEMPLATE_HLL_NREGISTERS_LOG2 + 1
+	    : (uint8_t)__builtin_ctzll(rest) + 1;
+
+	node->registers[r] = MAX(node->registers[r], rank);
+}
+
+/* Estimates the number of distinct segments added to the node. */
+static double
+estimate_template_hll(struct template_node *node)
+{
+	double m = TEMPLATE_HLL_NREGISTERS;
+	double sum = 0.0;
+	size_t nzeros = 0;
+	for (size_t r = 0; r < TEMPLATE_HLL_NREGISTERS; r++) {
+		sum += ldexp(1.0, -node->registers[r]);
+		if (node->registers[r] == 0)
+			nzeros++;
+	}
+
+	double estimate = TEMPLATE_HLL_ALPHA * m * m / sum;
+
+	/* Linear counting is more accurate for small cardinalities. */
+	if (estimate <= 2.5 * m && nzeros != 0)
+		estimate = m * log(m / (double)nzeros);
+
+	return estimate;
+}
+
+/*
+ * Builds the template of a request into buf, with collapsed
+ * segments replaced by TEMPLATE_PARAM_ALIAS.
+ * Returns the template size.
+ */
+static size_t
+gen_request_template(char *buf, struct template_request *req)
+{
+	const char *data = req->entry->data;
+	size_t size = req->entry->size;
+	size_t alias_size = strlen(TEMPLATE_PARAM_ALIAS);
+
+	size_t buf_size = 0;
+	size_t offset = 0;
+	for (size_t depth = 0; offset <= size; depth++) {
+		size_t segment_size = get_request_segment_size(data + offset,
+		    size - offset);
+
+		if (depth < TEMPLATE_DEPTH_MAX && ((req->params >> depth) & 1)) {
+			memcpy(buf + buf_size, TEMPLATE_PARAM_ALIAS, alias_size);
+			buf_size += alias_size;
+		} else {
+			memcpy(buf + buf_size, data + offset, segment_size);
+			buf_size += segment_size;
+		}
+
+		offset += segment_size;
+		if (offset == size)
+			break;
+
+		/* Delimiter */
+		buf[buf_size++] = data[offset++];
+	}
+
+	return buf_size;
+}
+
+/*
+ * Replaces each request in the request set with its inferred template,
+ * merging requests that share one, and updates the session map and
+ * the path graph of evicted sessions, if any, to refer to the merged
+ * request IDs.
+ *
+ * A trie node is collapsed if it has more than max_cardinality
+ * distinct child segments.
+ */
+void
+infer_request_templates(struct request_set *rs, struct session_map *sm,
+                        struct path_graph *pg, uint64_t max_cardinality)
+{
+	assert(rs != NULL);
+	assert(sm != NULL);
+	assert(0 < max_cardinality);
+
+	size_t nrequests = rs->requests.nentries;
+	if (nrequests == 0)
+		return;
+
+	struct template_request *reqs = calloc(nrequests, sizeof(*reqs));
+	if (reqs == NULL)
+		ERR("%s", "calloc");
+
+	struct request_set_table *table = rs->requests.table;
+	for (size_t i = 0; i < table->cap; i++) {
+		struct request_set_entry *entry = table->slots[i];
+		if (entry == NULL)
+			continue;
+
+		struct template_request *req = &reqs[entry->rid];
+		req->entry = entry;
+		req->active = 1;
+	}
+
+	struct template_trie trie;
+	init_template_trie(&trie);
+
+	size_t level_start = 0;
+	size_t nactive = nrequests;
+	for (size_t depth = 0; depth < TEMPLATE_DEPTH_MAX && 0 < nactive; depth++) {
+		/* Count distinct segments below each node of this level. */
+		for (size_t r = 0; r < nrequests; r++) {
+			struct template_request *req = &reqs[r];
+			if (!req->active)
+				continue;
+
+			const char *segment = req->entry->data + req->offset;
+			req->segment_size = get_request_segment_size(segment,
+			    req->entry->size - req->offset);
+
+			req->segment_hash = hash64_update(hash64_init(), segment,
+			    req->segment_size);
+			add_template_hll(&trie.nodes[req->node], req->segment_hash);
+		}
+
+		for (size_t n = level_start; n < trie.nnodes; n++) {
+			struct template_node *node = &trie.nodes[n];
+			node->is_param = max_cardinality < estimate_template_hll(node);
+		}
+
+		/* Descend to the next level. */
+		level_start = trie.nnodes;
+		for (size_t r = 0; r < nrequests; r++) {
+			struct template_request *req = &reqs[r];
+			if (!req->active)
+				continue;
+
+			uint64_t segment_hash = req->segment_hash;
+			if (trie.nodes[req->node].is_param) {
+				req->params |= 1ULL << depth;
+				segment_hash = TEMPLATE_PARAM_HASH;
+			}
+			req->node = get_template_child(&trie, req->node, segment_hash);
+
+			req->offset += req->segment_size;
+			if (req->offset == req->entry->size) {
+				req->active = 0;
+				nactive--;
+			} else
+				req->offset++; /* Delimiter */
+		}
+	}
+
+	free_template_trie(&trie);
+
+	/* Intern templates into a new request set. */
+	struct request_set templates;
+	init_request_set(&templates);
+
+	request_id_t *rid_map = calloc(nrequests, sizeof(*rid_map));
+	if (rid_map == NULL)
+		ERR("%s", "calloc");
+
+	for (size_t r = 0; r < nrequests; r++) {
+		struct template_request *req = &reqs[r];
+		char buf[req->entry->size
+		    + TEMPLATE_DEPTH_MAX * strlen(TEMPLATE_PARAM_ALIAS) + 1];
+		size_t buf_size = gen_request_template(buf, req);
+		rid_map[r] = add_final_request(&templates, buf, buf_size);
+	}
+
+	remap_session_map_requests(sm, rid_map);
+	if (pg != NULL) {
+		struct path_graph remapped;
+		init_path_graph(&remapped, templates.requests.nentries);
+		merge_path_graph(&remapped, pg, rid_map);
+		free_path_graph(pg);
+		*pg = remapped;
+	}
+	free_request_set(rs);
+	*rs = templates;
+
+	free(rid_map);
+	free(reqs);
+}
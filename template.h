@@ -0,0 +1,14 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stdint.h>
+
+#include "path_graph.h"
+#include "request.h"
+#include "session.h"
+
+#define TEMPLATE_PARAM_ALIAS "$PARAM"
+
+void infer_request_templates(struct request_set *, struct session_map *, struct path_graph *, uint64_t);
+
+#endif
@@ -0,0 +1,28 @@
+# Prints the nodes and edges of a graph by request label, without
+# request IDs or colors, which depend on the order of the scan.
+/^ *r[0-9]+ \[label=/ {
+	id = $1
+	label = $0
+	sub(/^[^"]*"/, "", label)
+	sub(/\\n.*/, "", label)
+	name[id] = label
+	stats = $0
+	sub(/^[^\\]*\\n/, "", stats)
+	sub(/".*/, "", stats)
+	print "node " label " " stats
+	next
+}
+/^ *r[0-9]+ -> r[0-9]+ / {
+	xl = $0
+	sub(/^[^"]*"/, "", xl)
+	sub(/".*/, "", xl)
+	edges[++nedges] = $1 " " $3 " " xl
+}
+END {
+	for (i = 1; i <= nedges; i++) {
+		split(edges[i], e, " ")
+		rest = edges[i]
+		sub(/^[^ ]+ [^ ]+ /, "", rest)
+		print "edge " name[e[1]] " -> " name[e[2]] " " rest
+	}
+}
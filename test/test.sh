@@ -0,0 +1,102 @@
+#!/bin/sh
+
+# End-to-end tests: runs apathy on small logs made from the examples
+# and bench/gen_log, and checks the output and --stats=json counters
+# of runs that must agree with each other.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+nfailed=0
+
+pass() {
+	echo "ok   $1"
+}
+
+fail() {
+	echo "FAIL $1: $2"
+	nfailed=$((nfailed + 1))
+}
+
+# Extracts a numeric field from the --stats=json output.
+json_field() {
+	sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p"
+}
+
+stats() {
+	./apathy --stats=json -o /dev/null "$@" 2>&1 >/dev/null | grep '^{'
+}
+
+# A line longer than a scan chunk spans several chunks, and must still
+# be scanned once, as must the line after it.
+test_long_line() {
+	log=$TMP/long_line.log
+	head -n 4 examples/simple.log > "$log"
+	printf '2018-12-12T12:00:01.700Z 127.0.0.99:5000 "GET http://my-api/' >> "$log"
+	head -c $((5 * 1024 * 1024)) /dev/zero | tr '\0' a >> "$log"
+	printf '" "long"\n' >> "$log"
+	tail -n +5 examples/simple.log >> "$log"
+
+	want=$(wc -l < "$log" | tr -d ' ')
+	for threads in 1 4; do
+		got=$(stats -C "$threads" "$log" | json_field lines)
+		if [ "$got" != "$want" ]; then
+			fail long_line "$got lines scanned with $threads threads, want $want"
+			return
+		fi
+	done
+	pass long_line
+}
+
+# Lines crossing the units of a BGZF log are scanned before sessions
+# idle for longer than the timeout are evicted around them, so the
+# graph is the same as for the uncompressed log.
+test_bgzf_session_timeout() {
+	./bench/gen_log -s 12M -o "$TMP/timeout.log"
+	./bench/gen_log -s 12M -c bgzf -o "$TMP/timeout.log.gz"
+
+	for threads in 1 4; do
+		for log in timeout.log timeout.log.gz; do
+			./apathy -C "$threads" --segment-classes all \
+			    --session-timeout 10 "$TMP/$log" 2>/dev/null \
+			    | awk -f test/graph.awk | sort > "$TMP/$log.graph"
+		done
+		if ! cmp -s "$TMP/timeout.log.graph" "$TMP/timeout.log.gz.graph"; then
+			fail bgzf_session_timeout "graphs differ with $threads threads"
+			return
+		fi
+	done
+	pass bgzf_session_timeout
+}
+
+# Sessions spilled to disk under a memory limit, and merged in one
+# or more passes, or merged in memory if nothing was spilled, give the
+# same graph as sessions kept in memory.
+test_memory_limit() {
+	log=$TMP/memory_limit.log
+	./bench/gen_log -s 8M -o "$log"
+
+	./apathy "$log" 2>/dev/null | awk -f test/graph.awk | sort > "$TMP/want.graph"
+	for limit in 1G 256K 16K; do
+		./apathy --memory-limit "$limit" "$log" 2>/dev/null \
+		    | awk -f test/graph.awk | sort > "$TMP/got.graph"
+		if ! cmp -s "$TMP/want.graph" "$TMP/got.graph"; then
+			fail memory_limit "graphs differ with a limit of $limit"
+			return
+		fi
+	done
+	pass memory_limit
+}
+
+test_long_line
+test_bgzf_session_timeout
+test_memory_limit
+
+if [ "$nfailed" -ne 0 ]; then
+	echo "$nfailed test(s) failed"
+	exit 1
+fi
@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "file_view.h"
+#include "pattern_set.h"
 #include "regex.h"
 #include "truncate.h"
 #include "util.h"
@@ -65,12 +66,81 @@ get_pattern_alias(char *line, const char **aliasp, const char **pattern_linep)
 		alias_size++;
 	line[alias_size] = '\0';
 
+	/* Alias without a pattern */
+	if (c == '\0') {
+		*pattern_linep = line + alias_size;
+		return;
+	}
+
 	size_t sep_size = 1;
 	while ((c = *s++) != '\0' && (isspace(c) || c == '='))
 		sep_size++;
 	*pattern_linep = line + alias_size + sep_size;
 }
 
+static const struct {
+	const char         *name;
+	const char         *alias;
+	enum segment_class  segment_class;
+} segment_classes[] = {
+	{ "uuid", "$UUID", SEGMENT_CLASS_UUID },
+	{ "int",  "$INT",  SEGMENT_CLASS_INT  },
+	{ "hex",  "$HEX",  SEGMENT_CLASS_HEX  },
+	{ "b64",  "$B64",  SEGMENT_CLASS_B64  }
+};
+
+#define NSEGMENT_CLASSES (sizeof(segment_classes) / sizeof(segment_classes[0]))
+
+static int
+alias_to_segment_class(const char *alias)
+{
+	for (size_t i = 0; i < NSEGMENT_CLASSES; i++) {
+		if (strcmp(alias, segment_classes[i].alias) == 0)
+			return segment_classes[i].segment_class;
+	}
+
+	return SEGMENT_CLASS_INVALID;
+}
+
+/*
+ * Parses a comma-separated list of segment class names, such as "uuid,int".
+ * Returns a bit set of segment classes, or SEGMENT_CLASS_INVALID
+ * on unknown names.
+ */
+int
+str_to_segment_classes(const char *s)
+{
+	assert(s != NULL);
+
+	int classes = 0;
+	while (*s != '\0') {
+		size_t name_size = strcspn(s, ",");
+		int found = 0;
+
+		if (name_size == 3 && strncmp(s, "all", 3) == 0) {
+			classes |= SEGMENT_CLASS_ALL;
+			found = 1;
+		}
+
+		for (size_t i = 0; i < NSEGMENT_CLASSES && !found; i++) {
+			if (strlen(segment_classes[i].name) == name_size
+			 && strncmp(s, segment_classes[i].name, name_size) == 0) {
+				classes |= segment_classes[i].segment_class;
+				found = 1;
+			}
+		}
+
+		if (!found)
+			return SEGMENT_CLASS_INVALID;
+
+		s += name_size;
+		if (*s == ',')
+			s++;
+	}
+
+	return classes;
+}
+
 void
 init_truncate_patterns(struct truncate_patterns *tp, const char *path)
 {
@@ -82,6 +152,7 @@ init_truncate_patterns(struct truncate_patterns *tp, const char *path)
 
 	tp->npatterns = 0;
 	tp->max_alias_size = 0;
+	tp->segment_classes = 0;
 
 	char *src = file_view.src;
 	char *line = src;
@@ -103,6 +174,16 @@ init_truncate_patterns(struct truncate_patterns *tp, const char *path)
 		const char *pattern;
 		get_pattern_alias(line, &alias, &pattern);
 
+		/* A reserved alias alone enables a built-in segment class. */
+		if (*pattern == '\0') {
+			int segment_class = alias_to_segment_class(alias);
+			if (segment_class == SEGMENT_CLASS_INVALID)
+				ERRX("missing truncate pattern for alias '%s'", alias);
+			tp->segment_classes |= segment_class;
+			line += line_size + 1;
+			continue;
+		}
+
 		regex_t regex;
 		memset(&regex, 0, sizeof(regex));
 		int cflags = REG_EXTENDED | REG_NEWLINE;
@@ -117,6 +198,196 @@ init_truncate_patterns(struct truncate_patterns *tp, const char *path)
 
 		line += line_size + 1;
 	}
+
+	init_pattern_set(&tp->pattern_set, tp->patterns, tp->npatterns);
+}
+
+/* Byte properties used for classifying segments */
+enum {
+	SEGMENT_BYTE_INT       = 1 << 0, /* May appear in an integer */
+	SEGMENT_BYTE_HEX       = 1 << 1, /* May appear in a hex string */
+	SEGMENT_BYTE_B64       = 1 << 2, /* May appear in a base64 token */
+	SEGMENT_BYTE_DIGIT     = 1 << 3,
+	SEGMENT_BYTE_UPPER     = 1 << 4,
+	SEGMENT_BYTE_LOWER     = 1 << 5,
+	SEGMENT_BYTE_MEMBERS   = SEGMENT_BYTE_INT | SEGMENT_BYTE_HEX | SEGMENT_BYTE_B64
+};
+
+#define SEGMENT_UUID_SIZE    36
+#define SEGMENT_HEX_SIZE_MIN 16
+#define SEGMENT_B64_SIZE_MIN 20
+
+/* Branch-free, since segment bytes are hard to predict. */
+static int
+get_segment_byte_flags(unsigned char c)
+{
+	unsigned u = c;
+	int digit = (u - '0') < 10u;
+	int lower = (u - 'a') < 26u;
+	int upper = (u - 'A') < 26u;
+	int hex_letter = ((u - 'a') < 6u) | ((u - 'A') < 6u);
+	int symbol = (c == '-') | (c == '_') | (c == '+') | (c == '=');
+
+	return digit * (SEGMENT_BYTE_MEMBERS | SEGMENT_BYTE_DIGIT)
+	     | hex_letter * SEGMENT_BYTE_HEX
+	     | (lower | upper | symbol) * SEGMENT_BYTE_B64
+	     | lower * SEGMENT_BYTE_LOWER
+	     | upper * SEGMENT_BYTE_UPPER;
+}
+
+static int
+is_uuid_segment(const char *s, size_t size)
+{
+	if (size != SEGMENT_UUID_SIZE)
+		return 0;
+	if (s[8] != '-' || s[13] != '-' || s[18] != '-' || s[23] != '-')
+		return 0;
+
+	/* With the dashes in place, the rest must be hex digits. */
+	int all = SEGMENT_BYTE_HEX;
+	size_t ndashes = 0;
+	for (size_t i = 0; i < size; i++) {
+		unsigned char c = s[i];
+		int is_dash = c == '-';
+		ndashes += is_dash;
+		all &= get_segment_byte_flags(c) | (is_dash * SEGMENT_BYTE_HEX);
+	}
+
+	return all != 0 && ndashes == 4;
+}
+
+/*
+ * Returns the alias of the first enabled class that the segment
+ * belongs to, or NULL if none.
+ *
+ *   $UUID: 8-4-4-4-12 hex digits separated by dashes
+ *   $INT:  decimal digits only
+ *   $HEX:  at least 16 hex digits in a single case, with some decimal digit
+ *   $B64:  at least 20 base64 or base64url characters, with some
+ *          decimal digit, uppercase and lowercase letter
+ */
+static const char *
+classify_segment(const char *s, size_t size, int classes)
+{
+	if (size == 0)
+		return NULL;
+
+	if ((classes & SEGMENT_CLASS_UUID) && is_uuid_segment(s, size))
+		return "$UUID";
+
+	/* Classes the segment may still belong to, given its size */
+	int wanted = 0;
+	if (classes & SEGMENT_CLASS_INT)
+		wanted |= SEGMENT_BYTE_INT;
+	if ((classes & SEGMENT_CLASS_HEX) && SEGMENT_HEX_SIZE_MIN <= size)
+		wanted |= SEGMENT_BYTE_HEX;
+	if ((classes & SEGMENT_CLASS_B64) && SEGMENT_B64_SIZE_MIN <= size)
+		wanted |= SEGMENT_BYTE_B64;
+
+	/*
+	 * Classes all bytes belong to, and properties any byte has.
+	 * Most segments are ruled out by their first few bytes.
+	 */
+	int all = wanted;
+	int any = 0;
+	for (size_t i = 0; i < size && all != 0; i++) {
+		int flags = get_segment_byte_flags(s[i]);
+		all &= flags;
+		any |= flags;
+	}
+	if (all == 0)
+		return NULL;
+
+	if ((classes & SEGMENT_CLASS_INT) && (all & SEGMENT_BYTE_INT))
+		return "$INT";
+
+	int mixed_case = (any & SEGMENT_BYTE_UPPER) && (any & SEGMENT_BYTE_LOWER);
+	if ((classes & SEGMENT_CLASS_HEX)
+	 && SEGMENT_HEX_SIZE_MIN <= size
+	 && (all & SEGMENT_BYTE_HEX)
+	 && (any & SEGMENT_BYTE_DIGIT)
+	 && !mixed_case)
+		return "$HEX";
+
+	if ((classes & SEGMENT_CLASS_B64)
+	 && SEGMENT_B64_SIZE_MIN <= size
+	 && (all & SEGMENT_BYTE_B64)
+	 && (any & SEGMENT_BYTE_DIGIT)
+	 && mixed_case)
+		return "$B64";
+
+	return NULL;
+}
+
+/*
+ * Returns the size of the first segment of request data in s,
+ * up to the next slash or whitespace.
+ */
+size_t
+get_request_segment_size(const char *s, size_t size)
+{
+	assert(s != NULL);
+
+	size_t segment_size = 0;
+	while (segment_size < size) {
+		char c = s[segment_size];
+		if (c == '/' || c == ' ' || c == '\t' || c == '\n'
+		 || c == '\v' || c == '\f' || c == '\r')
+			break;
+		segment_size++;
+	}
+
+	return segment_size;
+}
+
+/*
+ * Splits the request data in src into segments delimited by slashes
+ * and whitespace, and replaces segments belonging to any of the given
+ * classes with their aliases. The result is stored in dst.
+ *
+ * Returns the size of the (possibly) modified request data.
+ */
+size_t
+classify_request_segments(char *dst, size_t dst_size, const char *src,
+                          size_t src_size, int classes)
+{
+	assert(dst != NULL);
+	assert(src != NULL);
+
+	/* Unchanged data is copied in spans, up to each replaced segment. */
+	size_t dst_off = 0;
+	size_t copy_off = 0;
+	size_t src_off = 0;
+	while (src_off < src_size) {
+		const char *segment = src + src_off;
+		size_t segment_size = get_request_segment_size(segment,
+		    src_size - src_off);
+
+		const char *alias = classify_segment(segment, segment_size, classes);
+		if (alias != NULL) {
+			size_t span_size = src_off - copy_off;
+			size_t alias_size = strlen(alias);
+			if (dst_size - dst_off < span_size + alias_size)
+				break;
+
+			memcpy(dst + dst_off, src + copy_off, span_size);
+			dst_off += span_size;
+			memcpy(dst + dst_off, alias, alias_size);
+			dst_off += alias_size;
+			copy_off = src_off + segment_size;
+		}
+
+		/* Skip the delimiter, if any */
+		src_off += segment_size;
+		if (src_off < src_size)
+			src_off++;
+	}
+
+	size_t rest_size = MIN(src_size - copy_off, dst_size - dst_off);
+	memcpy(dst + dst_off, src + copy_off, rest_size);
+	dst_off += rest_size;
+
+	return dst_off;
 }
 
 /*
@@ -124,6 +395,13 @@ init_truncate_patterns(struct truncate_patterns *tp, const char *path)
  * patterns, and replaces any matches with their respective aliases.
  * The resulting modified request data is stored in trunc_buf.
  *
+ * Candidate patterns are first found with a single pass over the
+ * request data, so that the regex engine is only run for patterns
+ * that are known to match, or whose syntax the pattern set does
+ * not support. The first pattern in file order still wins.
+ *
+ * Built-in segment classes, if any, are truncated before the patterns.
+ *
  * Returns the size of the (possibly) modified request data.
  */
 size_t
@@ -137,6 +415,16 @@ truncate_raw_request(char *trunc_buf, size_t trunc_buf_size,
 	memset(trunc_buf, '\0', trunc_buf_size);
 	size_t trunc_size = 0;
 
+	char segment_buf[tp->segment_classes != 0
+	    ? raw_buf_size * SEGMENT_ALIAS_GROWTH_MAX + 1 : 1];
+	if (tp->segment_classes != 0) {
+		raw_buf_size = classify_request_segments(segment_buf,
+		    sizeof(segment_buf) - 1, raw_buf, raw_buf_size,
+		    tp->segment_classes);
+		segment_buf[raw_buf_size] = '\0';
+		raw_buf = segment_buf;
+	}
+
 	int pattern_idx = -1;
 	int npatterns = tp->npatterns;
 	regex_t *regex = NULL;
@@ -144,7 +432,16 @@ truncate_raw_request(char *trunc_buf, size_t trunc_buf_size,
 	const char *alias = NULL;
 	size_t alias_size = 0;
 	regmatch_t matches[1];
+
+	struct pattern_set *ps = &tp->pattern_set;
+	uint64_t matched[PATTERN_SET_NWORDS(TRUNCATE_NPATTERNS_MAX)];
+	if (0 < npatterns)
+		match_pattern_set(ps, raw_buf, strnlen(raw_buf, raw_buf_size), matched);
+
 	for (int p = 0; p < npatterns; p++) {
+		if (is_pattern_supported(ps, p)
+		 && !((matched[p / 64] >> (p % 64)) & 1))
+			continue;
 		regex = &tp->regexes[p];
 		pattern = tp->patterns[p];
 		alias = tp->aliases[p];
@@ -1,10 +1,27 @@
 #ifndef TRUNCATE_H
 #define TRUNCATE_H
 
+#include "pattern_set.h"
 #include "regex.h"
 
 #define REQUEST_NTRUNCS_MAX 8
 
+/*
+ * Built-in classes of URL path segments, which are truncated
+ * without going through the regex engine.
+ */
+enum segment_class {
+	SEGMENT_CLASS_UUID    = 1 << 0,
+	SEGMENT_CLASS_INT     = 1 << 1,
+	SEGMENT_CLASS_HEX     = 1 << 2,
+	SEGMENT_CLASS_B64     = 1 << 3,
+	SEGMENT_CLASS_ALL     = (1 << 4) - 1,
+	SEGMENT_CLASS_INVALID = -1
+};
+
+/* How much a request may grow when its segments are replaced by aliases. */
+#define SEGMENT_ALIAS_GROWTH_MAX 4
+
 struct truncate_patterns {
 #define TRUNCATE_NPATTERNS_MAX 512
 	int         npatterns;
@@ -13,9 +30,16 @@ struct truncate_patterns {
 	const char *aliases[TRUNCATE_NPATTERNS_MAX];
 	size_t      alias_sizes[TRUNCATE_NPATTERNS_MAX];
 	size_t      max_alias_size;
+	int         segment_classes; /* Bit set of enum segment_class */
+
+	/* All patterns compiled into one automaton, to find candidates in one pass */
+	struct pattern_set pattern_set;
 };
 
 void   init_truncate_patterns(struct truncate_patterns *, const char *);
+int    str_to_segment_classes(const char *);
+size_t get_request_segment_size(const char *, size_t);
+size_t classify_request_segments(char *, size_t, const char *, size_t, int);
 size_t truncate_raw_request(char *, size_t, const char *, size_t, struct truncate_patterns *);
 
 #endif
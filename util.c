@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "util.h"
@@ -11,3 +13,40 @@ parse_long(const char *s)
 		ERRX("invalid integer: %s", s);
 	return n;
 }
+
+/* Parses a byte count with an optional K, M or G suffix. */
+uint64_t
+parse_size(const char *s)
+{
+	char *endptr = NULL;
+	errno = 0;
+	uint64_t size = strtoull(s, &endptr, 10);
+	if (endptr == s || errno != 0)
+		ERRX("invalid size: %s", s);
+
+	uint64_t unit = 1;
+	switch (*endptr) {
+	case 'G':
+	case 'g':
+		unit = 1024 * 1024 * 1024;
+		endptr++;
+		break;
+	case 'M':
+	case 'm':
+		unit = 1024 * 1024;
+		endptr++;
+		break;
+	case 'K':
+	case 'k':
+		unit = 1024;
+		endptr++;
+		break;
+	default:
+		break;
+	}
+
+	if (*endptr != '\0' || size == 0 || UINT64_MAX / unit < size)
+		ERRX("invalid size: %s", s);
+
+	return size * unit;
+}
@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <err.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -17,6 +18,7 @@
 		fprintf(stderr, "DEBUG at %s:%d (%s): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
 	} while (0)
 
-long parse_long(const char *);
+long     parse_long(const char *);
+uint64_t parse_size(const char *);
 
 #endif